@@ -0,0 +1,370 @@
+/*
+ *	batch.c
+ *
+ *	batch mode -- many files back to back over one connection.  The
+ *	sender end turns the files into one stream for get_data(), each
+ *	object behind a header with its name, size and the simulated time
+ *	it started; the receiver end splits the stream from deliver_data()
+ *	again, writes every object to `name_r' and records how long it
+ *	took from the first byte sent to the last byte delivered.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	BATCH_MAGIC	0x42544348	/* "BTCH" */
+#define	BATCH_NAMELEN	1024
+
+/*
+ *	object header -- in the stream in front of every object
+ */
+struct batchhdr {
+	unsigned int bh_magic;
+	unsigned int bh_namelen;	/* name follows the header */
+	long long bh_size;		/* object size (bytes) */
+	simtime_t bh_start;		/* sender started it (usec) */
+};
+
+/*
+ *	one object
+ */
+struct batchobj {
+	char *bo_name;
+	long long bo_size;
+	simtime_t bo_latency;		/* receiver: first to last byte */
+};
+
+static struct batchobj *batch_obj;	/* the list (sender) */
+static int batch_nobj;
+
+/* sender */
+static int batch_cur = -1;	/* object being sent */
+static int batch_fd = -1;
+static char batch_hbuf[sizeof(struct batchhdr) + BATCH_NAMELEN];
+static int batch_hlen, batch_hoff;	/* header left to send */
+
+/* receiver */
+static struct batchobj *batch_rx;	/* completed objects */
+static int batch_nrx, batch_maxrx;
+static struct batchhdr batch_rhdr;
+static char batch_rname[BATCH_NAMELEN + 3];
+static int batch_rhave;		/* header + name bytes received */
+static long long batch_rleft;	/* object bytes still to come */
+static int batch_rfd = -1;
+static simtime_t batch_first = -1;	/* first object started */
+static simtime_t batch_last;		/* last object done */
+static long long batch_bytes;
+
+static int batch_add(char *);
+static int batch_next(simtime_t);
+static void batch_done(simtime_t);
+
+/*
+ * int
+ * batch_init(char *spec)
+ *	read the list of objects: the files of directory `spec', or the
+ *	paths in file `spec', one per line
+ *
+ * return value:
+ *	number of objects
+ *	-1	error
+ */
+int
+batch_init(char *spec)
+{
+	struct stat st;
+	struct dirent *de;
+	DIR *dir;
+	FILE *fp;
+	char path[BATCH_NAMELEN];
+	size_t len;
+
+	if (stat(spec, &st) < 0) {
+		perror(spec);
+		return -1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if ((dir = opendir(spec)) == NULL) {
+			perror(spec);
+			return -1;
+		}
+		while ((de = readdir(dir)) != NULL) {
+			len = strlen(de->d_name);
+			/* skip our own output from an earlier run */
+			if (de->d_name[0] == '.' || (len > 2 &&
+			    strcmp(de->d_name + len - 2, "_r") == 0))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", spec,
+				de->d_name);
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+			    batch_add(path) < 0)
+				break;
+		}
+		closedir(dir);
+	} else {
+		if ((fp = fopen(spec, "r")) == NULL) {
+			perror(spec);
+			return -1;
+		}
+		while (fgets(path, sizeof(path), fp) != NULL) {
+			path[strcspn(path, "\n")] = '\0';
+			if (path[0] != '\0' && path[0] != '#' &&
+			    batch_add(path) < 0)
+				break;
+		}
+		fclose(fp);
+	}
+	return batch_nobj;
+}
+
+static int
+batch_add(char *path)
+{
+	struct batchobj *bo;
+
+	bo = realloc(batch_obj, (batch_nobj + 1) * sizeof(*bo));
+	if (bo == NULL) {
+		perror("batch_init: realloc");
+		return -1;
+	}
+	batch_obj = bo;
+	bo += batch_nobj++;
+	bo->bo_name = strdup(path);
+	bo->bo_size = 0;
+	return 0;
+}
+
+/*
+ * int
+ * batch_read(void *buf, int size, simtime_t now)
+ *	next piece of the object stream for get_data()
+ *
+ * return value:
+ *	positive int:	bytes in buf
+ *	0		all objects sent
+ *	-1		error
+ */
+int
+batch_read(void *buf, int size, simtime_t now)
+{
+	int cnt = 0, n;
+
+	while (cnt < size) {
+		if (batch_hoff < batch_hlen) {
+			/* header of the current object */
+			n = batch_hlen - batch_hoff;
+			if (n > size - cnt)
+				n = size - cnt;
+			memcpy((char *)buf + cnt, batch_hbuf + batch_hoff, n);
+			batch_hoff += n;
+			cnt += n;
+			continue;
+		}
+		if (batch_fd >= 0) {
+			if ((n = read(batch_fd, (char *)buf + cnt,
+					size - cnt)) < 0) {
+				if (errno == EINTR)
+					continue;
+				perror(batch_obj[batch_cur].bo_name);
+				return -1;
+			}
+			if (n > 0) {
+				cnt += n;
+				continue;
+			}
+			close(batch_fd);
+			batch_fd = -1;
+		}
+		if (batch_next(now) <= 0)
+			break;
+	}
+	return cnt;
+}
+
+/*
+ *	open the next object and build its header
+ *
+ * return value:
+ *	1	next object ready
+ *	0	no more objects
+ */
+static int
+batch_next(simtime_t now)
+{
+	struct batchhdr *bh = (struct batchhdr *)batch_hbuf;
+	struct batchobj *bo;
+	struct stat st;
+
+	while (++batch_cur < batch_nobj) {
+		bo = &batch_obj[batch_cur];
+		if ((batch_fd = open(bo->bo_name, O_RDONLY)) < 0 ||
+		    fstat(batch_fd, &st) < 0) {
+			perror(bo->bo_name);
+			if (batch_fd >= 0)
+				close(batch_fd);
+			batch_fd = -1;
+			continue;	/* skip it */
+		}
+		bo->bo_size = st.st_size;
+		bh->bh_magic = BATCH_MAGIC;
+		bh->bh_namelen = strlen(bo->bo_name);
+		if (bh->bh_namelen > BATCH_NAMELEN)
+			bh->bh_namelen = BATCH_NAMELEN;
+		bh->bh_size = st.st_size;
+		bh->bh_start = now;
+		memcpy(bh + 1, bo->bo_name, bh->bh_namelen);
+		batch_hlen = sizeof(*bh) + bh->bh_namelen;
+		batch_hoff = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * void
+ * batch_write(void *buf, int size, simtime_t now)
+ *	take delivered stream data: object headers and object data
+ */
+void
+batch_write(void *buf, int size, simtime_t now)
+{
+	char *p = buf;
+	int hlen, n;
+
+	while (size > 0) {
+		if (batch_rleft == 0 && batch_rfd < 0) {
+			/* collecting a header, then its name */
+			hlen = sizeof(batch_rhdr);
+			if (batch_rhave >= hlen)
+				hlen += batch_rhdr.bh_namelen;
+			n = hlen - batch_rhave;
+			if (n > size)
+				n = size;
+			if (batch_rhave < (int)sizeof(batch_rhdr))
+				memcpy((char *)&batch_rhdr + batch_rhave, p, n);
+			else
+				memcpy(batch_rname + batch_rhave -
+					sizeof(batch_rhdr), p, n);
+			batch_rhave += n;
+			p += n;
+			size -= n;
+			if (batch_rhave == sizeof(batch_rhdr) &&
+			    (batch_rhdr.bh_magic != BATCH_MAGIC ||
+			     batch_rhdr.bh_namelen > BATCH_NAMELEN)) {
+				fprintf(stderr, "batch: bad object header\n");
+				exit(1);
+			}
+			if (batch_rhave < (int)sizeof(batch_rhdr) ||
+			    batch_rhave < (int)(sizeof(batch_rhdr) +
+			    batch_rhdr.bh_namelen))
+				continue;
+
+			/* header complete: create name_r */
+			strcpy(batch_rname + batch_rhdr.bh_namelen, "_r");
+			if ((batch_rfd = open(batch_rname, O_WRONLY|O_CREAT|
+					O_TRUNC, 0644)) < 0) {
+				fprintf(stderr, "destination file `%s': ",
+					batch_rname);
+				perror("open");
+				exit(1);
+			}
+			batch_rleft = batch_rhdr.bh_size;
+			batch_rhave = 0;
+			if (batch_first < 0)
+				batch_first = batch_rhdr.bh_start;
+			if (batch_rleft == 0)
+				batch_done(now);
+			continue;
+		}
+
+		n = size < batch_rleft ? size : batch_rleft;
+		if (write(batch_rfd, p, n) != n) {
+			perror(batch_rname);
+			exit(1);
+		}
+		p += n;
+		size -= n;
+		batch_rleft -= n;
+		if (batch_rleft == 0)
+			batch_done(now);
+	}
+}
+
+/*
+ *	receiver: an object is complete
+ */
+static void
+batch_done(simtime_t now)
+{
+	struct batchobj *bo;
+
+	close(batch_rfd);
+	batch_rfd = -1;
+	if (batch_nrx == batch_maxrx) {
+		batch_maxrx = batch_maxrx ? batch_maxrx * 2 : 64;
+		if ((batch_rx = realloc(batch_rx,
+				batch_maxrx * sizeof(*bo))) == NULL) {
+			perror("batch: realloc");
+			exit(1);
+		}
+	}
+	bo = &batch_rx[batch_nrx++];
+	batch_rname[batch_rhdr.bh_namelen] = '\0';
+	bo->bo_name = strdup(batch_rname);
+	bo->bo_size = batch_rhdr.bh_size;
+	bo->bo_latency = now - batch_rhdr.bh_start;
+	batch_last = now;
+	batch_bytes += bo->bo_size;
+}
+
+static int
+batch_cmp(const void *a, const void *b)
+{
+	simtime_t la = ((struct batchobj *)a)->bo_latency;
+	simtime_t lb = ((struct batchobj *)b)->bo_latency;
+
+	return la < lb ? -1 : la > lb;
+}
+
+/*
+ *	void batch_stats(int sender) -- print per-object latency and
+ *	aggregate throughput (receiver), or what was sent (sender)
+ */
+void
+batch_stats(int sender)
+{
+	simtime_t span = batch_last - batch_first;
+	long long total = 0;
+	int i;
+
+	if (sender) {
+		for (i = 0; i < batch_nobj; i++)
+			total += batch_obj[i].bo_size;
+		fprintf(stderr, "batch\t\t: %d objects, %lld bytes sent\n",
+			batch_nobj, total);
+		return;
+	}
+	for (i = 0; i < batch_nrx; i++)
+		fprintf(stderr, "object\t\t: %s, %lld bytes, latency "
+			"%lld.%06lld sec\n", batch_rx[i].bo_name,
+			batch_rx[i].bo_size, batch_rx[i].bo_latency / 1000000,
+			batch_rx[i].bo_latency % 1000000);
+	if (batch_nrx == 0)
+		return;
+	qsort(batch_rx, batch_nrx, sizeof(*batch_rx), batch_cmp);
+	fprintf(stderr, "batch\t\t: %d objects, %lld bytes in %lld.%06lld "
+		"sec (%.3f Mbps), latency p50 %lld p99 %lld max %lld usec\n",
+		batch_nrx, batch_bytes, span / 1000000, span % 1000000,
+		span ? batch_bytes * 8.0 / span : 0.0,
+		batch_rx[batch_nrx / 2].bo_latency,
+		batch_rx[(batch_nrx * 99) / 100].bo_latency,
+		batch_rx[batch_nrx - 1].bo_latency);
+}
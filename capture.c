@@ -0,0 +1,315 @@
+/*
+ *	capture.c
+ *
+ *	packet capture -- every packet put on the line, sent by the line
+ *	or lost on it goes into a pcap file stamped with simulated time,
+ *	so a run can be looked at with tcpdump or wireshark.  The lower
+ *	layer packet is wrapped in a made-up IPv4/UDP header (pcap
+ *	LINKTYPE_RAW):
+ *
+ *		source address	10.0.<path>.1 (sender end), .2 (receiver end)
+ *		source port	CAP_PORT + event (CAP_QUEUE, CAP_SEND, ...)
+ *		dest port	CAP_PORT + 100 + lower packet type (LP_*)
+ *
+ *	e.g. `tcpdump -r file udp src port 7003' lists the packets lost
+ *	to the error rate.  Records are collected in a buffer, which is
+ *	handed to a writer thread when it is full: cap_packet() runs in
+ *	the SIGALRM handler and must not wait for the disk.  If the writer
+ *	falls behind by all the buffers, records are dropped and counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	CAP_BUFSIZE	(256*1024)	/* write out in blocks this big */
+#define	CAP_NBUF	4		/* buffers, filling or written */
+#define	CAP_SNAPLEN	65535
+#define	CAP_LINKTYPE	101		/* LINKTYPE_RAW: IPv4 or IPv6 */
+
+/*
+ *	pcap file header and record header
+ */
+struct pcap_hdr {
+	unsigned int ph_magic;
+	unsigned short ph_major, ph_minor;
+	int ph_zone;
+	unsigned int ph_sigfigs;
+	unsigned int ph_snaplen;
+	unsigned int ph_linktype;
+};
+
+struct pcap_rec {
+	unsigned int pr_sec;
+	unsigned int pr_usec;
+	unsigned int pr_caplen;
+	unsigned int pr_len;
+};
+
+/*
+ *	synthetic IPv4 + UDP header, network byte order
+ */
+struct cap_ipudp {
+	unsigned char ip_vhl;
+	unsigned char ip_tos;
+	unsigned char ip_len[2];
+	unsigned char ip_id[2];
+	unsigned char ip_off[2];
+	unsigned char ip_ttl;
+	unsigned char ip_p;
+	unsigned char ip_sum[2];
+	unsigned char ip_src[4];
+	unsigned char ip_dst[4];
+	unsigned char uh_sport[2];
+	unsigned char uh_dport[2];
+	unsigned char uh_ulen[2];
+	unsigned char uh_sum[2];
+};
+
+/*
+ *	buffers of one capture and its writer thread -- the end fills
+ *	cw_buf[cw_tail], the writer writes from cw_buf[cw_head]
+ */
+struct capwriter {
+	int cw_fd;
+	char *cw_buf[CAP_NBUF];
+	int cw_len[CAP_NBUF];		/* -1: no more buffers */
+	int cw_head;			/* writer's, next to write */
+	int cw_tail;			/* end's, being filled */
+	sem_t cw_ready;			/* buffers to write */
+	sem_t cw_free;			/* buffers to fill, besides cw_tail */
+	volatile int cw_error;		/* a write failed */
+	pthread_t cw_thread;
+};
+
+/* one capture per end of the connection, so per thread in -T mode */
+static __thread struct capwriter *cap_w;
+static __thread char *cap_buf;		/* cap_w->cw_buf[cap_w->cw_tail] */
+static __thread int cap_len;
+static __thread int cap_end;		/* 1: sender end, 2: receiver end */
+static __thread long long cap_pkts, cap_bytes, cap_nev[CAP_NEVENT];
+static __thread long long cap_ndrop;	/* records no buffer was free for */
+
+static int cap_submit(int);
+static void *cap_writer(void *);
+
+static void
+put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+/*
+ * int
+ * cap_open(char *file, int sender)
+ *	start capturing the packets of this end to `file'
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+cap_open(char *file, int sender)
+{
+	struct capwriter *cw;
+	struct pcap_hdr ph;
+	sigset_t sigs, osigs;
+	int i, err;
+
+	if ((cw = calloc(1, sizeof(*cw))) == NULL) {
+		perror("cap_open: malloc");
+		return -1;
+	}
+	for (i = 0; i < CAP_NBUF; i++)
+		if ((cw->cw_buf[i] = malloc(CAP_BUFSIZE)) == NULL) {
+			perror("cap_open: malloc");
+			return -1;
+		}
+	if ((cw->cw_fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "capture file `%s': ", file);
+		perror("open");
+		return -1;
+	}
+	sem_init(&cw->cw_ready, 0, 0);
+	sem_init(&cw->cw_free, 0, CAP_NBUF - 1);
+
+	/* keep SIGALRM on this end's thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	err = pthread_create(&cw->cw_thread, NULL, cap_writer, cw);
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (err) {
+		fprintf(stderr, "cap_open: pthread_create: %s\n",
+			strerror(err));
+		return -1;
+	}
+
+	cap_w = cw;
+	cap_buf = cw->cw_buf[0];
+	cap_end = sender ? 1 : 2;
+	ph.ph_magic = 0xa1b2c3d4;	/* usec timestamps, host order */
+	ph.ph_major = 2;
+	ph.ph_minor = 4;
+	ph.ph_zone = 0;
+	ph.ph_sigfigs = 0;
+	ph.ph_snaplen = CAP_SNAPLEN;
+	ph.ph_linktype = CAP_LINKTYPE;
+	memcpy(cap_buf, &ph, sizeof(ph));
+	cap_len = sizeof(ph);
+	return 0;
+}
+
+/*
+ * void
+ * cap_packet(int event, int path, void *pkt, int size, simtime_t now)
+ *	record lower layer packet `pkt' of `size' bytes -- called with
+ *	SIGALRM blocked, or from its handler
+ */
+void
+cap_packet(int event, int path, void *pkt, int size, simtime_t now)
+{
+	struct pcap_rec *pr;
+	struct cap_ipudp *h;
+	unsigned int sum;
+	int i, reclen = sizeof(*pr) + sizeof(*h) + size;
+
+	if (cap_w == NULL || cap_w->cw_error)
+		return;
+	if (cap_len + reclen > CAP_BUFSIZE && cap_submit(0) < 0) {
+		cap_ndrop++;
+		return;
+	}
+
+	pr = (struct pcap_rec *)(cap_buf + cap_len);
+	pr->pr_sec = now / 1000000;
+	pr->pr_usec = now % 1000000;
+	pr->pr_caplen = pr->pr_len = sizeof(*h) + size;
+
+	h = (struct cap_ipudp *)(pr + 1);
+	memset(h, 0, sizeof(*h));
+	h->ip_vhl = 0x45;
+	put16(h->ip_len, sizeof(*h) + size);
+	put16(h->ip_id, cap_pkts);
+	h->ip_ttl = 64;
+	h->ip_p = 17;			/* UDP */
+	h->ip_src[0] = h->ip_dst[0] = 10;
+	h->ip_src[2] = h->ip_dst[2] = path;
+	h->ip_src[3] = cap_end;
+	h->ip_dst[3] = 3 - cap_end;
+	for (sum = 0, i = 0; i < 20; i += 2)
+		sum += ((unsigned char *)h)[i] << 8 |
+			((unsigned char *)h)[i + 1];
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += sum >> 16;
+	put16(h->ip_sum, ~sum);
+	put16(h->uh_sport, CAP_PORT + event);
+	put16(h->uh_dport, CAP_PORT + 100 + *(int *)pkt);
+	put16(h->uh_ulen, 8 + size);	/* no UDP checksum */
+	memcpy(h + 1, pkt, size);
+
+	cap_len += reclen;
+	cap_pkts++;
+	cap_bytes += size;
+	cap_nev[event]++;
+}
+
+/*
+ *	hand the buffer being filled to the writer and take the next one,
+ *	waiting for it if `wait', else only if one is free: the SIGALRM
+ *	handler must not block
+ *
+ * return value:
+ *	0	success
+ *	-1	all buffers are still being written
+ */
+static int
+cap_submit(int wait)
+{
+	struct capwriter *cw = cap_w;
+
+	if (wait) {
+		while (sem_wait(&cw->cw_free) < 0)
+			;		/* EINTR */
+	} else if (sem_trywait(&cw->cw_free) < 0)
+		return -1;
+	cw->cw_len[cw->cw_tail] = cap_len;
+	cw->cw_tail = (cw->cw_tail + 1) % CAP_NBUF;
+	sem_post(&cw->cw_ready);
+	cap_buf = cw->cw_buf[cw->cw_tail];
+	cap_len = 0;
+	return 0;
+}
+
+/*
+ *	writer thread -- write out the buffers in turn until one of
+ *	length -1; after an error it only gives them back
+ */
+static void *
+cap_writer(void *arg)
+{
+	struct capwriter *cw = arg;
+	char *buf;
+	int len, off, n;
+
+	for (;;) {
+		while (sem_wait(&cw->cw_ready) < 0)
+			;		/* EINTR */
+		buf = cw->cw_buf[cw->cw_head];
+		if ((len = cw->cw_len[cw->cw_head]) < 0)
+			break;
+		for (off = 0; off < len && !cw->cw_error; off += n) {
+			if ((n = write(cw->cw_fd, buf + off, len - off)) < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				perror("capture: write");
+				cw->cw_error = 1;
+			}
+		}
+		cw->cw_head = (cw->cw_head + 1) % CAP_NBUF;
+		sem_post(&cw->cw_free);
+	}
+	return NULL;
+}
+
+/*
+ *	void cap_close(void) -- write out what is left, print statistics
+ */
+void
+cap_close(void)
+{
+	struct capwriter *cw = cap_w;
+	int i;
+
+	if (cw == NULL)
+		return;
+	cap_submit(1);
+	cap_len = -1;			/* the writer's end */
+	cap_submit(1);
+	pthread_join(cw->cw_thread, NULL);
+	close(cw->cw_fd);
+	sem_destroy(&cw->cw_ready);
+	sem_destroy(&cw->cw_free);
+	for (i = 0; i < CAP_NBUF; i++)
+		free(cw->cw_buf[i]);
+	free(cw);
+	cap_w = NULL;
+	fprintf(stderr, "capture\t\t: %lld packets, %lld bytes (%lld queued, "
+		"%lld sent, %lld corrupted, %lld lost, %lld queue drops)\n",
+		cap_pkts, cap_bytes, cap_nev[CAP_QUEUE], cap_nev[CAP_SEND],
+		cap_nev[CAP_CORRUPT], cap_nev[CAP_LOSS], cap_nev[CAP_QDROP]);
+	if (cap_ndrop)
+		fprintf(stderr, "capture\t\t: %lld packets not captured, "
+			"the writer fell behind\n", cap_ndrop);
+}
@@ -0,0 +1,356 @@
+/*
+ *	compress.c
+ *
+ *	payload compression between the source and the protocol -- the
+ *	sender end packs as much source data as fits into each buffer
+ *	get_data() fills, and the receiver end unpacks every buffer handed
+ *	to deliver_data() on its own.  Each buffer is one block:
+ *
+ *		2 bytes		raw length, Z_STORED set if not compressed
+ *		...		LZ sequences, or the raw data
+ *
+ *	so a block never needs another one to be decoded, and losing a
+ *	packet costs its own block only.  The codec is LZ77 with byte
+ *	aligned sequences (as LZ4): a token with literal and match length
+ *	nibbles, extra length bytes, the literals, and a 2 byte match
+ *	offset; the last sequence has literals only.  Compression stops
+ *	when the buffer is full, so a packet is filled with compressed
+ *	data however well the source compresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	Z_MAXIN		(16*1024)	/* raw data per block, max */
+#define	Z_HDRSIZE	2
+#define	Z_STORED	0x8000		/* in the header: raw data */
+#define	Z_MINMATCH	4
+#define	Z_LASTLIT	5		/* no match starts this near the end */
+#define	Z_HASHBITS	12
+
+/*
+ *	per end: the sender end compresses, the receiver end decompresses
+ *	(both with -d)
+ */
+static __thread unsigned char *z_raw;	/* source data, 2 * Z_MAXIN */
+static __thread int z_off, z_len;	/* unsent data in z_raw */
+static __thread int z_eof;
+static __thread unsigned char *z_out;	/* decompressed block */
+static __thread unsigned int *z_hash;	/* generation << 16 | position */
+static __thread unsigned int z_gen;
+
+static __thread long long z_in, z_zout, z_nblk, z_nstored, z_nsec;
+static __thread long long z_din, z_dout, z_dnblk, z_dnsec;
+
+/*
+ *	the time compression takes -- the monotonic clock is read in user
+ *	space, so it costs far less than the block; the thread CPU clock
+ *	would be a system call per block
+ */
+static long long
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned int
+z_read32(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int
+z_hashpos(const unsigned char *p)
+{
+	return (z_read32(p) * 2654435761U) >> (32 - Z_HASHBITS);
+}
+
+/*
+ *	bytes of a length past its nibble
+ */
+static int
+z_extlen(int len)
+{
+	return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static unsigned char *
+z_putlen(unsigned char *op, int len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ *	compress from `src' (`len' bytes) into `dst' of `cap' bytes, as
+ *	much as fits; *used is set to the source bytes taken
+ *
+ * return value:
+ *	compressed size
+ */
+static int
+z_compress(unsigned char *dst, int cap, const unsigned char *src, int len,
+	int *used)
+{
+	const unsigned char *ip = src, *anchor = src, *ref;
+	const unsigned char *mlimit = src + len - Z_LASTLIT;
+	unsigned char *op = dst, *oend = dst + cap;
+	unsigned int *hash = z_hash, gen, h, e;
+	int lit, ml, need, step;
+
+	/* a new generation makes the entries of earlier blocks stale */
+	if ((++z_gen & 0xffff) == 0) {
+		memset(hash, 0, sizeof(*hash) << Z_HASHBITS);
+		z_gen++;
+	}
+	gen = z_gen << 16;
+
+	while (ip < mlimit) {
+		lit = ip - anchor;
+		if (op + 1 + z_extlen(lit) + lit >= oend)
+			break;		/* full of literals already */
+		h = z_hashpos(ip);
+		e = hash[h];
+		hash[h] = gen | (ip - src);
+		ref = src + (e & 0xffff);
+		step = 1 + (lit >> 6);		/* faster over noise */
+		if ((e & ~0xffff) != gen || ref >= ip ||
+		    z_read32(ref) != z_read32(ip)) {
+			ip += step;
+			continue;
+		}
+		for (ml = Z_MINMATCH; ip + ml < mlimit && ref[ml] == ip[ml];
+		    ml++)
+			;
+		need = 1 + z_extlen(lit) + lit + 2 +
+			z_extlen(ml - Z_MINMATCH);
+		if (op + need + 1 > oend)
+			break;		/* full: the rest goes as literals */
+
+		*op++ = (lit < 15 ? lit : 15) << 4 |
+			(ml - Z_MINMATCH < 15 ? ml - Z_MINMATCH : 15);
+		if (lit >= 15)
+			op = z_putlen(op, lit);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (ml - Z_MINMATCH >= 15)
+			op = z_putlen(op, ml - Z_MINMATCH);
+		ip += ml;
+		anchor = ip;
+	}
+
+	/* last literals, as many as there are room for */
+	lit = src + len - anchor;
+	while (1 + z_extlen(lit) + lit > oend - op)
+		lit = oend - op - 1 - z_extlen(oend - op);
+	if (lit < 0)
+		lit = 0;
+	*op++ = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = z_putlen(op, lit);
+	memcpy(op, anchor, lit);
+	op += lit;
+	*used = anchor + lit - src;
+	return op - dst;
+}
+
+/*
+ *	decompress `len' bytes at `src' into `dst' of `cap' bytes
+ *
+ * return value:
+ *	decompressed size, -1 if the block is damaged
+ */
+static int
+z_decompress(unsigned char *dst, int cap, const unsigned char *src, int len)
+{
+	const unsigned char *ip = src, *iend = src + len;
+	unsigned char *op = dst, *oend = dst + cap, *ref;
+	int token, lit, ml, n;
+
+	for (;;) {
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15)
+			do {
+				if (ip >= iend)
+					return -1;
+				lit += n = *ip++;
+			} while (n == 255);
+		if (lit > iend - ip || lit > oend - op)
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			return op - dst;	/* last sequence */
+
+		if (iend - ip < 2)
+			return -1;
+		ref = op - (ip[0] | ip[1] << 8);
+		ip += 2;
+		ml = (token & 15) + Z_MINMATCH;
+		if ((token & 15) == 15)
+			do {
+				if (ip >= iend)
+					return -1;
+				ml += n = *ip++;
+			} while (n == 255);
+		if (ref < dst || ref == op || ml > oend - op)
+			return -1;
+		if (op - ref >= ml) {
+			memcpy(op, ref, ml);
+			op += ml;
+		} else
+			while (ml--)		/* overlaps: repeats */
+				*op++ = *ref++;
+	}
+}
+
+/*
+ * int
+ * z_start(void)
+ *	set up the buffers of this end, before the timer runs
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+z_start(void)
+{
+	if ((z_raw = malloc(2 * Z_MAXIN)) == NULL ||
+	    (z_out = malloc(Z_MAXIN)) == NULL ||
+	    (z_hash = calloc(1 << Z_HASHBITS, sizeof(*z_hash))) == NULL) {
+		perror("z_start: malloc");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * int
+ * z_read(void *buf, int size, int (*src)(void *, int))
+ *	fill `buf' with one block of at most `size' bytes of data read
+ *	with `src', which returns 0 at the end
+ *
+ * return value:
+ *	block size, 0 at the end of the data
+ */
+int
+z_read(void *buf, int size, int (*src)(void *, int))
+{
+	unsigned char *p = buf;
+	int n, zlen, used, raw;
+	long long t;
+
+	/* keep a block's worth of source data at hand */
+	if (z_len - z_off < Z_MAXIN && !z_eof) {
+		memmove(z_raw, z_raw + z_off, z_len - z_off);
+		z_len -= z_off;
+		z_off = 0;
+		while (z_len < 2 * Z_MAXIN) {
+			n = src(z_raw + z_len, 2 * Z_MAXIN - z_len);
+			if (n == 0) {
+				z_eof = 1;
+				break;
+			}
+			z_len += n;
+		}
+	}
+	if (z_off == z_len || size <= Z_HDRSIZE)
+		return 0;
+
+	raw = z_len - z_off;
+	if (raw > Z_MAXIN)
+		raw = Z_MAXIN;
+	t = nsec();
+	zlen = z_compress(p + Z_HDRSIZE, size - Z_HDRSIZE, z_raw + z_off,
+		raw, &used);
+	if (used <= zlen) {
+		/* does not compress: store it */
+		used = raw < size - Z_HDRSIZE ? raw : size - Z_HDRSIZE;
+		memcpy(p + Z_HDRSIZE, z_raw + z_off, used);
+		zlen = used;
+		p[0] = used & 0xff;
+		p[1] = (used | Z_STORED) >> 8;
+		z_nstored++;
+	} else {
+		p[0] = used & 0xff;
+		p[1] = used >> 8;
+	}
+	z_nsec += nsec() - t;
+	z_off += used;
+	z_in += used;
+	z_zout += Z_HDRSIZE + zlen;
+	z_nblk++;
+	return Z_HDRSIZE + zlen;
+}
+
+/*
+ * int
+ * z_write(void *buf, int size, int (*dst)(void *, int))
+ *	decompress the block of `size' bytes at `buf' and pass the data
+ *	on to `dst'
+ *
+ * return value:
+ *	0	success
+ *	-1	damaged block
+ */
+int
+z_write(void *buf, int size, int (*dst)(void *, int))
+{
+	unsigned char *p = buf;
+	int raw, n;
+	long long t;
+
+	if (size < Z_HDRSIZE)
+		return -1;
+	raw = (p[0] | p[1] << 8) & ~Z_STORED;
+	t = nsec();
+	if (p[1] << 8 & Z_STORED) {
+		if (raw != size - Z_HDRSIZE)
+			return -1;
+		memcpy(z_out, p + Z_HDRSIZE, raw);
+	} else if (raw > Z_MAXIN || (n = z_decompress(z_out, raw,
+			p + Z_HDRSIZE, size - Z_HDRSIZE)) != raw)
+		return -1;
+	z_dnsec += nsec() - t;
+	z_din += size;
+	z_dout += raw;
+	z_dnblk++;
+	dst(z_out, raw);
+	return 0;
+}
+
+/*
+ *	void z_stats(int sender) -- print ratio and CPU time
+ */
+void
+z_stats(int sender)
+{
+	if (sender && z_nblk)
+		fprintf(stderr, "compress\t: %lld -> %lld bytes (ratio %.2f) "
+			"in %lld blocks, %lld stored, %.0f ns/KB\n", z_in,
+			z_zout, (double)z_in / z_zout, z_nblk, z_nstored,
+			z_nsec * 1024.0 / z_in);
+	if (!sender && z_dnblk)
+		fprintf(stderr, "decompress\t: %lld -> %lld bytes in %lld "
+			"blocks, %.0f ns/KB\n", z_din, z_dout, z_dnblk,
+			z_dnsec * 1024.0 / z_dout);
+}
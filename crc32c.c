@@ -0,0 +1,273 @@
+/*
+ *	crc32c.c
+ *
+ *	CRC-32C (Castagnoli) for packet checksums.  Uses the CRC32
+ *	instructions of SSE4.2 or ARMv8 where the CPU has them, with three
+ *	independent streams over a buffer so the instruction latency is
+ *	hidden, and slicing-by-8 tables otherwise.  The streams are put
+ *	back together by shifting a CRC over a run of zero bytes, which is
+ *	a table lookup (see crc_zeros()).
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define	CRC_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define	CRC_ARM
+#endif
+#include "transport.h"
+#include "sim.h"
+
+#define	CRC_POLY	0x82f63b78	/* reflected Castagnoli polynomial */
+#define	CRC_LONG	8192		/* stream length, big buffers */
+#define	CRC_SHORT	256		/* stream length, packets */
+
+static uint32_t crc_table[8][256];	/* slicing-by-8 */
+static uint32_t crc_long[4][256];	/* shift over CRC_LONG zeros */
+static uint32_t crc_short[4][256];	/* shift over CRC_SHORT zeros */
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_fn)(uint32_t, const unsigned char *, size_t);
+static char *crc_impl = "sw";
+
+/*
+ *	portable version: eight bytes per step through eight tables
+ */
+static uint32_t
+crc_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7) != 0) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		w = *(const uint64_t *)p ^ crc;	/* little endian */
+		crc = crc_table[7][w & 0xff] ^
+			crc_table[6][(w >> 8) & 0xff] ^
+			crc_table[5][(w >> 16) & 0xff] ^
+			crc_table[4][(w >> 24) & 0xff] ^
+			crc_table[3][(w >> 32) & 0xff] ^
+			crc_table[2][(w >> 40) & 0xff] ^
+			crc_table[1][(w >> 48) & 0xff] ^
+			crc_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/*
+ *	GF(2) matrices for shifting a CRC over runs of zeros
+ */
+static uint32_t
+gf2_times(uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void
+gf2_square(uint32_t *square, uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/*
+ *	build tables that move a CRC over `len' zero bytes (a power of
+ *	two), one table per byte of the CRC
+ */
+static void
+crc_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t even[32], odd[32], *op = even;
+	uint32_t row = 1;
+	int n;
+
+	odd[0] = CRC_POLY;		/* one zero bit */
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_square(even, odd);		/* two zero bits */
+	gf2_square(odd, even);		/* four zero bits */
+	for (;;) {
+		gf2_square(even, odd);	/* one zero byte first time round */
+		op = even;
+		if ((len >>= 1) == 0)
+			break;
+		gf2_square(odd, even);
+		op = odd;
+		if ((len >>= 1) == 0)
+			break;
+	}
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_times(op, n);
+		zeros[1][n] = gf2_times(op, n << 8);
+		zeros[2][n] = gf2_times(op, n << 16);
+		zeros[3][n] = gf2_times(op, (uint32_t)n << 24);
+	}
+}
+
+static uint32_t
+crc_shift(uint32_t zeros[][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/*
+ *	hardware versions -- CRC_STEP8/CRC_STEP1 are the instructions
+ */
+#define	CRC_HW_BODY							\
+	const unsigned char *end;					\
+	uint64_t crc0 = ~crc, crc1, crc2;				\
+									\
+	while (len && ((uintptr_t)p & 7) != 0) {			\
+		crc0 = CRC_STEP1(crc0, *p++);				\
+		len--;							\
+	}								\
+	while (len >= 3 * CRC_LONG) {					\
+		crc1 = crc2 = 0;					\
+		for (end = p + CRC_LONG; p < end; p += 8) {		\
+			crc0 = CRC_STEP8(crc0, *(const uint64_t *)p);	\
+			crc1 = CRC_STEP8(crc1,				\
+				*(const uint64_t *)(p + CRC_LONG));	\
+			crc2 = CRC_STEP8(crc2,				\
+				*(const uint64_t *)(p + 2 * CRC_LONG));	\
+		}							\
+		crc0 = crc_shift(crc_long, crc0) ^ crc1;		\
+		crc0 = crc_shift(crc_long, crc0) ^ crc2;		\
+		p += 2 * CRC_LONG;					\
+		len -= 3 * CRC_LONG;					\
+	}								\
+	while (len >= 3 * CRC_SHORT) {					\
+		crc1 = crc2 = 0;					\
+		for (end = p + CRC_SHORT; p < end; p += 8) {		\
+			crc0 = CRC_STEP8(crc0, *(const uint64_t *)p);	\
+			crc1 = CRC_STEP8(crc1,				\
+				*(const uint64_t *)(p + CRC_SHORT));	\
+			crc2 = CRC_STEP8(crc2,				\
+				*(const uint64_t *)(p + 2 * CRC_SHORT));\
+		}							\
+		crc0 = crc_shift(crc_short, crc0) ^ crc1;		\
+		crc0 = crc_shift(crc_short, crc0) ^ crc2;		\
+		p += 2 * CRC_SHORT;					\
+		len -= 3 * CRC_SHORT;					\
+	}								\
+	for (; len >= 8; p += 8, len -= 8)				\
+		crc0 = CRC_STEP8(crc0, *(const uint64_t *)p);		\
+	while (len--)							\
+		crc0 = CRC_STEP1(crc0, *p++);				\
+	return ~(uint32_t)crc0;
+
+#ifdef CRC_X86
+#define	CRC_STEP8(c, w)	_mm_crc32_u64(c, w)
+#define	CRC_STEP1(c, b)	_mm_crc32_u8(c, b)
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	CRC_HW_BODY
+}
+#endif /* CRC_X86 */
+
+#ifdef CRC_ARM
+#define	CRC_STEP8(c, w)	__crc32cd(c, w)
+#define	CRC_STEP1(c, b)	__crc32cb(c, b)
+
+__attribute__((target("+crc")))
+static uint32_t
+crc_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	CRC_HW_BODY
+}
+#endif /* CRC_ARM */
+
+static void
+crc_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+	crc_zeros(crc_long, CRC_LONG);
+	crc_zeros(crc_short, CRC_SHORT);
+
+	crc_fn = crc_sw;
+#ifdef CRC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc_fn = crc_sse42;
+		crc_impl = "sse4.2";
+	}
+#endif
+#ifdef CRC_ARM
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc_fn = crc_armv8;
+		crc_impl = "armv8";
+	}
+#endif
+}
+
+/*
+ * unsigned int
+ * crc32c(unsigned int crc, const void *buf, int size)
+ *	CRC-32C of `size' bytes at buf, continuing from `crc' (0 to
+ *	start)
+ *
+ * return value:
+ *	the CRC
+ */
+unsigned int
+crc32c(unsigned int crc, const void *buf, int size)
+{
+	pthread_once(&crc_once, crc_init);
+	return crc_fn(crc, buf, size);
+}
+
+/*
+ *	the same with the portable version, for comparison
+ */
+unsigned int
+crc32c_sw(unsigned int crc, const void *buf, int size)
+{
+	pthread_once(&crc_once, crc_init);
+	return crc_sw(crc, buf, size);
+}
+
+/*
+ *	char *crc32c_impl(void) -- name of the version crc32c() uses
+ */
+char *
+crc32c_impl(void)
+{
+	pthread_once(&crc_once, crc_init);
+	return crc_impl;
+}
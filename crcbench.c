@@ -0,0 +1,122 @@
+/*
+ *	crcbench.c
+ *
+ *	how much a CRC-32C costs per packet:
+ *
+ *		crcbench [packet_size [mbytes]]
+ *
+ *	checks crc32c() against the standard check value, then times it
+ *	and the portable version over 1 KB packets (default) in a buffer
+ *	that stays in cache and in one of `mbytes' MB (64 by default) that
+ *	does not, next to a memcpy() of the same packets.
+ */
+
+#define	_GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	CHECK_VALUE	0xe3069283	/* crc32c("123456789") */
+#define	MIN_NSEC	200000000LL	/* time each case at least this */
+
+static unsigned char *src, *dst;
+static volatile unsigned int sink;
+
+static long long
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ *	ns per packet of `fn' (NULL: memcpy) over packets of `psize'
+ *	bytes, walking `span' bytes of the buffer
+ */
+static double
+bench(unsigned int (*fn)(unsigned int, const void *, int), int psize,
+	long span)
+{
+	long long t0, t, n = 0;
+	long off = 0;
+
+	t0 = nsec();
+	do {
+		for (int i = 0; i < 1024; i++, n++) {
+			if (fn != NULL)
+				sink = fn(0, src + off, psize);
+			else
+				memcpy(dst + off, src + off, psize);
+			if ((off += psize) + psize > span)
+				off = 0;
+		}
+		t = nsec() - t0;
+	} while (t < MIN_NSEC);
+	return (double)t / n;
+}
+
+static void
+report(char *name, int psize, long span)
+{
+	double hw, sw, cp;
+
+	hw = bench(crc32c, psize, span);
+	sw = bench(crc32c_sw, psize, span);
+	cp = bench(NULL, psize, span);
+	printf("%-10s %-8s %8.1f ns %6.2f GB/s | %-4s %8.1f ns %6.2f GB/s "
+		"| memcpy %8.1f ns %6.2f GB/s\n", name, crc32c_impl(), hw,
+		psize / hw, "sw", sw, psize / sw, cp, psize / cp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int psize = 1024;
+	long mbytes = 64;
+	unsigned int crc;
+	long i;
+
+	if (argc > 1 && (psize = atoi(argv[1])) <= 0) {
+		fprintf(stderr, "usage: %s [packet_size [mbytes]]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2 && (mbytes = atol(argv[2])) <= 0) {
+		fprintf(stderr, "usage: %s [packet_size [mbytes]]\n", argv[0]);
+		exit(1);
+	}
+	if ((src = malloc(mbytes << 20)) == NULL ||
+	    (dst = malloc(mbytes << 20)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	if (psize > mbytes << 20)
+		psize = mbytes << 20;
+	for (i = 0; i < mbytes << 20; i++)
+		src[i] = dst[i] = random();
+
+	/* every version, every length and alignment agrees */
+	if ((crc = crc32c(0, "123456789", 9)) != CHECK_VALUE) {
+		fprintf(stderr, "crc32c: %08x, expected %08x\n", crc,
+			CHECK_VALUE);
+		exit(1);
+	}
+	for (i = 0; i < 3 * 8192 * 2 + 64; i += 1 + i / 8)
+		if (crc32c(0, src + (i & 7), i) !=
+				crc32c_sw(0, src + (i & 7), i) ||
+		    crc32c(crc32c(0, src, i / 3), src + i / 3, i - i / 3) !=
+				crc32c(0, src, i)) {
+			fprintf(stderr, "crc32c: mismatch at length %ld\n", i);
+			exit(1);
+		}
+	printf("crc32c\t\t: check value ok, using %s\n", crc32c_impl());
+
+	printf("%d byte packets\n", psize);
+	report("in cache", psize, 64 * 1024);
+	report("in memory", psize, mbytes << 20);
+	return 0;
+}
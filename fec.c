@@ -0,0 +1,648 @@
+/*
+ *	fec.c
+ *
+ *	forward error correction between the protocol and the line.
+ *	The sender groups data packets into blocks of k and appends m
+ *	parity packets (interleaved XOR or a systematic Reed-Solomon code
+ *	over GF(2^8)); the receiver rebuilds lost data packets from the
+ *	parity so they never reach the protocol as losses.
+ *
+ *	A block symbol is the 2-byte payload length followed by the
+ *	payload, zero padded to the longest symbol of the block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define	GF_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define	GF_NEON
+#endif
+#include "transport.h"
+#include "sim.h"
+
+/*
+ *	FEC header -- in front of every data and parity packet
+ */
+struct fechdr {
+	unsigned int fh_block;		/* block number */
+	unsigned char fh_index;		/* data index, or parity row */
+	unsigned char fh_n;		/* data packets in block (parity) */
+	unsigned short fh_len;		/* symbol length (parity) */
+};
+
+#define	FEC_SYMSIZE	(MTU + 2)	/* max symbol length */
+#define	FEC_NBLK	4		/* receiver blocks tracked */
+
+/*
+ *	receiver block state
+ */
+struct fecblk {
+	int fb_used;
+	unsigned int fb_block;		/* block number */
+	int fb_n;			/* data packets, 0: unknown yet */
+	int fb_maxidx;			/* highest data index seen + 1 */
+	int fb_next;			/* next index handed up */
+	int fb_final;			/* no more packets expected */
+	int fb_symlen;			/* parity symbol length */
+	simtime_t fb_last;		/* time of last packet */
+	unsigned char fb_have[FEC_MAXK];	/* data symbol present */
+	unsigned char fb_phave[FEC_MAXM];	/* parity symbol present */
+	unsigned char *fb_data;		/* FEC_MAXK data symbols */
+	unsigned char *fb_par;		/* FEC_MAXM parity symbols */
+};
+
+static int fec_k, fec_m;	/* code parameters */
+static int fec_xor;		/* interleaved XOR instead of RS */
+static int fec_age;		/* flush partial blocks after (usec) */
+
+/* sender */
+static unsigned char *fec_sym;	/* symbols of the open block */
+static unsigned char *fec_pbuf;	/* parity packet being built */
+static int fec_n;		/* data packets in open block */
+static int fec_symlen;		/* longest symbol in open block */
+static unsigned int fec_block;	/* open block number */
+static simtime_t fec_t0;	/* time block was opened */
+
+/* receiver */
+static struct fecblk fec_rb[FEC_NBLK];
+static int fec_head;		/* oldest tracked block */
+static unsigned int fec_done;	/* blocks before this one are retired */
+
+/* statistics */
+static long long fec_ndata, fec_npar, fec_nblk;
+static long long fec_nrecov, fec_nlost;
+
+/*
+ *	GF(2^8) arithmetic, polynomial x^8+x^4+x^3+x^2+1 (0x11d)
+ */
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char gf_mul_tab[256][256];
+
+static void (*gf_muladd)(unsigned char *, const unsigned char *,
+	unsigned char, int);
+
+static unsigned char
+gf_mul(unsigned char a, unsigned char b)
+{
+	if (a == 0 || b == 0)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char
+gf_inv(unsigned char a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ *	dst ^= c * src -- portable version
+ */
+static void
+gf_muladd_tab(unsigned char *dst, const unsigned char *src,
+	unsigned char c, int len)
+{
+	const unsigned char *t = gf_mul_tab[c];
+	int i;
+
+	for (i = 0; i < len; i++)
+		dst[i] ^= t[src[i]];
+}
+
+/*
+ *	SIMD versions: split src bytes into nibbles and look both halves
+ *	up in 16-entry product tables with a byte shuffle
+ */
+#ifdef GF_X86
+__attribute__((target("ssse3")))
+static void
+gf_muladd_ssse3(unsigned char *dst, const unsigned char *src,
+	unsigned char c, int len)
+{
+	unsigned char lo[16], hi[16];
+	__m128i tlo, thi, mask, s, l, h, d;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = gf_mul_tab[c][i];
+		hi[i] = gf_mul_tab[c][i << 4];
+	}
+	tlo = _mm_loadu_si128((__m128i *)lo);
+	thi = _mm_loadu_si128((__m128i *)hi);
+	mask = _mm_set1_epi8(0x0f);
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((__m128i *)(src + i));
+		l = _mm_and_si128(s, mask);
+		h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+		d = _mm_xor_si128(_mm_shuffle_epi8(tlo, l),
+			_mm_shuffle_epi8(thi, h));
+		d = _mm_xor_si128(d, _mm_loadu_si128((__m128i *)(dst + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+	gf_muladd_tab(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void
+gf_muladd_avx2(unsigned char *dst, const unsigned char *src,
+	unsigned char c, int len)
+{
+	unsigned char lo[16], hi[16];
+	__m256i tlo, thi, mask, s, l, h, d;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = gf_mul_tab[c][i];
+		hi[i] = gf_mul_tab[c][i << 4];
+	}
+	tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)lo));
+	thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)hi));
+	mask = _mm256_set1_epi8(0x0f);
+	for (i = 0; i + 32 <= len; i += 32) {
+		s = _mm256_loadu_si256((__m256i *)(src + i));
+		l = _mm256_and_si256(s, mask);
+		h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+		d = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, l),
+			_mm256_shuffle_epi8(thi, h));
+		d = _mm256_xor_si256(d,
+			_mm256_loadu_si256((__m256i *)(dst + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+	gf_muladd_tab(dst + i, src + i, c, len - i);
+}
+#endif /* GF_X86 */
+
+#ifdef GF_NEON
+static void
+gf_muladd_neon(unsigned char *dst, const unsigned char *src,
+	unsigned char c, int len)
+{
+	unsigned char lo[16], hi[16];
+	uint8x16_t tlo, thi, mask, s, d;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = gf_mul_tab[c][i];
+		hi[i] = gf_mul_tab[c][i << 4];
+	}
+	tlo = vld1q_u8(lo);
+	thi = vld1q_u8(hi);
+	mask = vdupq_n_u8(0x0f);
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = vld1q_u8(src + i);
+		d = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(s, mask)),
+			vqtbl1q_u8(thi, vshrq_n_u8(s, 4)));
+		vst1q_u8(dst + i, veorq_u8(d, vld1q_u8(dst + i)));
+	}
+	gf_muladd_tab(dst + i, src + i, c, len - i);
+}
+#endif /* GF_NEON */
+
+static void
+gf_init(void)
+{
+	int i, j, x;
+
+	for (i = 0, x = 1; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 256; j++)
+			gf_mul_tab[i][j] = gf_mul(i, j);
+
+	gf_muladd = gf_muladd_tab;
+#ifdef GF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		gf_muladd = gf_muladd_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		gf_muladd = gf_muladd_ssse3;
+#endif
+#ifdef GF_NEON
+	gf_muladd = gf_muladd_neon;
+#endif
+}
+
+/*
+ *	dst ^= c * src, with the trivial coefficients short-cut
+ */
+static void
+region_muladd(unsigned char *dst, const unsigned char *src,
+	unsigned char c, int len)
+{
+	int i;
+
+	if (c == 0)
+		return;
+	if (c == 1) {
+		for (i = 0; i < len; i++)
+			dst[i] ^= src[i];
+		return;
+	}
+	gf_muladd(dst, src, c, len);
+}
+
+/*
+ *	coefficient of data symbol i in parity row j.  RS uses a Cauchy
+ *	matrix 1/(x_j + y_i) with x_j = 255 - j, y_i = i, so any k rows of
+ *	[I; C] are independent and partial blocks (n < k) decode too.
+ */
+static unsigned char
+fec_coef(int j, int i)
+{
+	if (fec_xor)
+		return (i % fec_m) == j;
+	return gf_inv((255 - j) ^ i);
+}
+
+/*
+ * int
+ * fec_init(int k, int m, int xor, int age)
+ *	k data packets and m parity packets per block; partial blocks
+ *	are closed after `age' usec
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+fec_init(int k, int m, int xor, int age)
+{
+	int i;
+
+	if (k < 1 || k > FEC_MAXK || m < 1 || m > FEC_MAXM)
+		return -1;
+	fec_k = k;
+	fec_m = m;
+	fec_xor = xor;
+	fec_age = age;
+	gf_init();
+
+	fec_sym = malloc(FEC_MAXK * FEC_SYMSIZE);
+	fec_pbuf = malloc(sizeof(struct fechdr) + FEC_SYMSIZE);
+	if (fec_sym == NULL || fec_pbuf == NULL) {
+		perror("fec_init: malloc");
+		return -1;
+	}
+	for (i = 0; i < FEC_NBLK; i++) {
+		fec_rb[i].fb_data = malloc(FEC_MAXK * FEC_SYMSIZE);
+		fec_rb[i].fb_par = malloc(FEC_MAXM * FEC_SYMSIZE);
+		if (fec_rb[i].fb_data == NULL || fec_rb[i].fb_par == NULL) {
+			perror("fec_init: malloc");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ======================================================================
+ *
+ * sender side
+ */
+
+/*
+ *	compute and send the parity packets of the open block
+ */
+static int
+fec_close(void)
+{
+	struct fechdr *fh = (struct fechdr *)fec_pbuf;
+	unsigned char *par = fec_pbuf + sizeof(struct fechdr);
+	int i, j, ret;
+
+	for (j = 0; j < fec_m; j++) {
+		memset(par, 0, fec_symlen);
+		for (i = 0; i < fec_n; i++)
+			region_muladd(par, fec_sym + i * FEC_SYMSIZE,
+				fec_coef(j, i), fec_symlen);
+		fh->fh_block = fec_block;
+		fh->fh_index = j;
+		fh->fh_n = fec_n;
+		fh->fh_len = fec_symlen;
+		ret = line_send(LP_FECPARITY, fec_pbuf,
+			sizeof(struct fechdr) + fec_symlen);
+		if (ret != NET_SUCCESS)
+			return ret;
+		fec_npar++;
+	}
+	fec_nblk++;
+	fec_block++;
+	fec_n = 0;
+	return NET_SUCCESS;
+}
+
+/*
+ * int
+ * fec_send(void *buf, int size, simtime_t now)
+ *	send a data packet, and the block's parity once it is full
+ *
+ * return value: as udt_send()
+ */
+int
+fec_send(void *buf, int size, simtime_t now)
+{
+	unsigned char *sym;
+	struct fechdr *fh;
+	int i, ret;
+
+	if (fec_n == 0) {
+		fec_symlen = 0;
+		fec_t0 = now;
+	}
+	sym = fec_sym + fec_n * FEC_SYMSIZE;
+	sym[0] = size & 0xff;
+	sym[1] = size >> 8;
+	memcpy(sym + 2, buf, size);
+	if (size + 2 > fec_symlen) {
+		/* zero pad the shorter symbols already in the block */
+		for (i = 0; i < fec_n; i++)
+			memset(fec_sym + i * FEC_SYMSIZE + fec_symlen, 0,
+				size + 2 - fec_symlen);
+		fec_symlen = size + 2;
+	} else
+		memset(sym + 2 + size, 0, fec_symlen - size - 2);
+
+	/* the data packet itself goes out right away */
+	fh = (struct fechdr *)fec_pbuf;
+	fh->fh_block = fec_block;
+	fh->fh_index = fec_n;
+	fh->fh_n = 0;
+	fh->fh_len = 0;
+	memcpy(fec_pbuf + sizeof(struct fechdr), buf, size);
+	ret = line_send(LP_FECDATA, fec_pbuf, sizeof(struct fechdr) + size);
+	if (ret != NET_SUCCESS)
+		return ret;
+	fec_ndata++;
+
+	if (++fec_n == fec_k)
+		return fec_close();
+	return NET_SUCCESS;
+}
+
+/*
+ *	void fec_poll(simtime_t now) -- close a partial block that has been open
+ *	for too long, so a loss at the tail of a burst is still covered
+ */
+void
+fec_poll(simtime_t now)
+{
+	if (fec_n > 0 && now - fec_t0 >= fec_age)
+		fec_close();
+}
+
+/* ======================================================================
+ *
+ * receiver side
+ */
+
+/*
+ *	solve for the missing data symbols of a block from its parity
+ *
+ * return value:
+ *	1	block is complete
+ *	0	not enough symbols (yet)
+ */
+static int
+fec_decode(struct fecblk *fb)
+{
+	int miss[FEC_MAXK], rows[FEC_MAXM];
+	unsigned char a[FEC_MAXM][FEC_MAXK];
+	unsigned char *rhs[FEC_MAXM], *tmp;
+	unsigned char c;
+	int nmiss = 0, nrow = 0;
+	int i, j, l, r, p;
+	int len = fb->fb_symlen;
+
+	if (fb->fb_n == 0)
+		return 0;
+	for (i = 0; i < fb->fb_n; i++)
+		if (!fb->fb_have[i])
+			miss[nmiss++] = i;
+	if (nmiss == 0)
+		return 1;
+	for (j = 0; j < fec_m; j++)
+		if (fb->fb_phave[j])
+			rows[nrow++] = j;
+	if (nrow < nmiss)
+		return 0;
+
+	/* rhs_r = parity_r - (contribution of the symbols we have) */
+	for (r = 0; r < nrow; r++) {
+		rhs[r] = fb->fb_par + rows[r] * FEC_SYMSIZE;
+		for (i = 0; i < fb->fb_n; i++)
+			if (fb->fb_have[i])
+				region_muladd(rhs[r],
+					fb->fb_data + i * FEC_SYMSIZE,
+					fec_coef(rows[r], i), len);
+		for (l = 0; l < nmiss; l++)
+			a[r][l] = fec_coef(rows[r], miss[l]);
+	}
+
+	/* Gauss-Jordan elimination, row ops applied to the rhs symbols */
+	for (l = 0; l < nmiss; l++) {
+		for (p = l; p < nrow && a[p][l] == 0; p++)
+			;
+		if (p == nrow)
+			goto fail;	/* singular (XOR rows overlap) */
+		if (p != l) {
+			unsigned char t;
+			for (i = 0; i < nmiss; i++) {
+				t = a[p][i];
+				a[p][i] = a[l][i];
+				a[l][i] = t;
+			}
+			tmp = rhs[p];
+			rhs[p] = rhs[l];
+			rhs[l] = tmp;
+		}
+		if ((c = a[l][l]) != 1) {
+			c = gf_inv(c);
+			for (i = 0; i < nmiss; i++)
+				a[l][i] = gf_mul(a[l][i], c);
+			tmp = fb->fb_data + miss[l] * FEC_SYMSIZE;
+			memset(tmp, 0, len);
+			gf_muladd(tmp, rhs[l], c, len);
+			memcpy(rhs[l], tmp, len);
+		}
+		for (r = 0; r < nrow; r++) {
+			if (r == l || (c = a[r][l]) == 0)
+				continue;
+			for (i = 0; i < nmiss; i++)
+				a[r][i] ^= gf_mul(c, a[l][i]);
+			region_muladd(rhs[r], rhs[l], c, len);
+		}
+	}
+	for (l = 0; l < nmiss; l++) {
+		memcpy(fb->fb_data + miss[l] * FEC_SYMSIZE, rhs[l], len);
+		fb->fb_have[miss[l]] = 1;
+		fec_nrecov++;
+	}
+	/* the parity symbols were consumed in place */
+	memset(fb->fb_phave, 0, sizeof(fb->fb_phave));
+	return 1;
+fail:
+	memset(fb->fb_phave, 0, sizeof(fb->fb_phave));
+	return 0;
+}
+
+/*
+ *	find the state of block `block', allocating it if it is new
+ */
+static struct fecblk *
+fec_lookup(unsigned int block, simtime_t now)
+{
+	struct fecblk *fb;
+	int i;
+
+	if ((int)(block - fec_done) < 0)
+		return NULL;	/* late parity of a finished block */
+	for (i = 0; i < FEC_NBLK; i++) {
+		fb = &fec_rb[(fec_head + i) % FEC_NBLK];
+		if (fb->fb_used && fb->fb_block == block)
+			return fb;
+	}
+
+	/* a newer block started: nothing more will come for older ones */
+	for (i = 0; i < FEC_NBLK; i++) {
+		fb = &fec_rb[(fec_head + i) % FEC_NBLK];
+		if (fb->fb_used && (int)(block - fb->fb_block) > 0)
+			fb->fb_final = 1;
+	}
+	for (i = 0; i < FEC_NBLK; i++) {
+		fb = &fec_rb[(fec_head + i) % FEC_NBLK];
+		if (!fb->fb_used)
+			break;
+	}
+	if (i == FEC_NBLK)
+		return NULL;	/* too many blocks open: drop it */
+	fb->fb_used = 1;
+	fb->fb_block = block;
+	fb->fb_n = fb->fb_maxidx = fb->fb_next = fb->fb_final = 0;
+	fb->fb_last = now;
+	memset(fb->fb_have, 0, sizeof(fb->fb_have));
+	memset(fb->fb_phave, 0, sizeof(fb->fb_phave));
+	return fb;
+}
+
+/*
+ * void
+ * fec_input(int parity, void *buf, int size, simtime_t now)
+ *	take in a data or parity packet from the line
+ */
+void
+fec_input(int parity, void *buf, int size, simtime_t now)
+{
+	struct fechdr *fh = buf;
+	struct fecblk *fb;
+	unsigned char *sym;
+	int len = size - sizeof(struct fechdr);
+
+	if ((fb = fec_lookup(fh->fh_block, now)) == NULL)
+		return;
+	fb->fb_last = now;
+	if (parity) {
+		if (fh->fh_index >= fec_m || fh->fh_len > FEC_SYMSIZE)
+			return;
+		fb->fb_n = fh->fh_n;
+		fb->fb_symlen = fh->fh_len;
+		memcpy(fb->fb_par + fh->fh_index * FEC_SYMSIZE,
+			(char *)buf + sizeof(struct fechdr), fh->fh_len);
+		fb->fb_phave[fh->fh_index] = 1;
+		if (fec_decode(fb) || fh->fh_index == fec_m - 1)
+			fb->fb_final = 1;
+	} else {
+		if (fh->fh_index >= FEC_MAXK)
+			return;
+		sym = fb->fb_data + fh->fh_index * FEC_SYMSIZE;
+		sym[0] = len & 0xff;
+		sym[1] = len >> 8;
+		memcpy(sym + 2, (char *)buf + sizeof(struct fechdr), len);
+		memset(sym + 2 + len, 0, FEC_SYMSIZE - 2 - len);
+		fb->fb_have[fh->fh_index] = 1;
+		if (fh->fh_index + 1 > fb->fb_maxidx)
+			fb->fb_maxidx = fh->fh_index + 1;
+	}
+}
+
+/*
+ * int
+ * fec_deliver(void *buf, int size)
+ *	hand the next in-order data packet up
+ *
+ * return value:
+ *	positive int:	size of data
+ *	0:		nothing deliverable yet
+ */
+int
+fec_deliver(void *buf, int size)
+{
+	struct fecblk *fb;
+	unsigned char *sym;
+	int last, len;
+
+	for (;;) {
+		fb = &fec_rb[fec_head];
+		if (!fb->fb_used)
+			return 0;
+		last = fb->fb_n ? fb->fb_n : fb->fb_maxidx;
+		while (fb->fb_next < last) {
+			if (fb->fb_have[fb->fb_next]) {
+				sym = fb->fb_data + fb->fb_next * FEC_SYMSIZE;
+				fb->fb_next++;
+				len = sym[0] | sym[1] << 8;
+				if (len > size)
+					len = size;
+				memcpy(buf, sym + 2, len);
+				return len;
+			}
+			if (!fb->fb_final)
+				return 0;	/* hold until parity */
+			fec_nlost++;
+			fb->fb_next++;
+		}
+		if (!fb->fb_final)
+			return 0;
+		fb->fb_used = 0;
+		fec_done = fb->fb_block + 1;
+		fec_head = (fec_head + 1) % FEC_NBLK;
+	}
+}
+
+/*
+ *	void fec_expire(simtime_t now) -- give up on blocks idle for too long
+ */
+void
+fec_expire(simtime_t now)
+{
+	int i;
+
+	for (i = 0; i < FEC_NBLK; i++)
+		if (fec_rb[i].fb_used && now - fec_rb[i].fb_last > 2 * fec_age)
+			fec_rb[i].fb_final = 1;
+}
+
+/*
+ *	print FEC statistics
+ */
+void
+fec_stats(int sender)
+{
+	if (sender)
+		fprintf(stderr, "fec\t\t: %s(%d,%d), %lld blocks, "
+			"%lld data + %lld parity packets (%.1f%% overhead)\n",
+			fec_xor ? "xor" : "rs", fec_k, fec_m, fec_nblk,
+			fec_ndata, fec_npar,
+			fec_ndata ? 100.0 * fec_npar / fec_ndata : 0.0);
+	else
+		fprintf(stderr, "fec\t\t: %lld packets recovered, "
+			"%lld unrecoverable\n", fec_nrecov, fec_nlost);
+}
@@ -10,7 +10,7 @@
 #include <assert.h>
 #include "transport.h"
 
-#define	DATASIZE	1024
+#define	DATASIZE	(MTU - 5 * sizeof(int))	/* at most; see SEGSIZE */
 #define HEADERSIZE  (sizeof(Packet) - DATASIZE)
 #define ACKSIZE     sizeof("ACK")
 
@@ -27,27 +27,43 @@ int PMOD(int n, int b) {
 
 /*
   A packet. The header is made of
+  - CRC-32C of the rest of the packet
   - sequence number
   - size of buffer (filled with valid data)
+  - in full duplex mode, the acknowledgement of the other direction:
+	cumulative, and a bitmap of the packets after the first missing one
+	(bit i: packet ack + 2 + i received)
   This is followed by the data.
 */
 typedef struct {
+	 unsigned int crc;
 	 int seqn;
 	 int nbuffer;
+	 int ack;
+	 unsigned int sack;
 	 char buffer[DATASIZE];
 } Packet;
 
-/*  ACK packet. Contains the sequence number and a tiny header ("ACK"). */
+#define SACKBITS    32
+
+/*  ACK packet. Contains a CRC, the sequence number, a tiny header ("ACK")
+	and the receive window: how many more packets the receiver has room
+	for. */
 typedef struct {
+	 unsigned int crc;
 	 char code[ACKSIZE];
 	 int  seqn;
+	 int  rwnd;
 } ACKPacket;
 
-/*  A very simple circular FIFO queue for packets. Allocates memory only on
-	initialization with pqueue_init, frees it in pqueue_destroy.
+/*  A very simple circular FIFO queue for packets. The slots are allocated on
+	initialization with pqueue_init, freed in pqueue_destroy; the packets
+	themselves live in transport send buffers (udt_send_acquire), so they
+	go on the line without being copied.
 	In order to avoid useless copying, instead of taking a Packet argument, 
 	pqueue_push returns a pointer to the new packet. Use this pointer to edit 
 	the packet in-place. Assume no initialization of the Packet data.
+	Popping a packet gives its buffer back to the transport.
 
 	Push --> [TAIL...HEAD] --> Pop
 	We keep the head index, and the length of the queue to compute the tail.
@@ -56,14 +72,14 @@ typedef struct {
 	 int head;
 	 int length;
 	 int maxsize;
-	 Packet* packets;
+	 Packet** packets;
 } PQueue;
 
 void pqueue_init(PQueue* queue, int windowsize) {
 	 queue->head = 0;
 	 queue->length = 0;
 	 queue->maxsize = windowsize;
-	 queue->packets = malloc(sizeof(Packet) * queue->maxsize);
+	 queue->packets = malloc(sizeof(Packet*) * queue->maxsize);
 }
 void pqueue_destroy(PQueue* queue) {
 	 free(queue->packets);
@@ -75,31 +91,32 @@ Packet* pqueue_tail(PQueue* queue) {
 	 int i = (queue->head + queue->length - 1) % queue->maxsize;
 	 assert (queue->head <= queue->maxsize && queue->head >= 0);
 	 assert (queue->length <= queue->maxsize);
-	 return &queue->packets[i];
+	 return queue->packets[i];
 }
 Packet* pqueue_head(PQueue* queue) {
 	 assert (queue->head <= queue->maxsize && queue->head >= 0);
 	 assert (queue->length <= queue->maxsize);
-	 return &queue->packets[queue->head];
+	 return queue->packets[queue->head];
 }
 Packet* pqueue_push(PQueue* queue) {
+	 int i = (queue->head + queue->length) % queue->maxsize;
 	 assert (pqueue_length(queue) < queue->maxsize);
+	 queue->packets[i] = udt_send_acquire(sizeof(Packet));
+	 assert (queue->packets[i] != NULL);
 	 queue->length += 1;
 	 return pqueue_tail(queue);
 }
-Packet* pqueue_pop(PQueue* queue) {
-	 Packet* tmp = pqueue_head(queue);
+void pqueue_pop(PQueue* queue) {
 	 assert (pqueue_length(queue) > 0);
+	 udt_send_release(pqueue_head(queue));
 	 queue->head++;
 	 queue->length--;
 	 queue->head = PMOD(queue->head, queue->maxsize);
-	 return tmp;
 }
-Packet* pqueue_poptail(PQueue* queue) {
-	 Packet* tmp = pqueue_tail(queue);
+void pqueue_poptail(PQueue* queue) {
 	 assert (pqueue_length(queue) > 0);
+	 udt_send_release(pqueue_tail(queue));
 	 queue->length -= 1;
-	 return tmp;
 }
 bool pqueue_empty(PQueue* queue) {
 	 return queue->length == 0;
@@ -111,11 +128,10 @@ void pqueue_map(PQueue* queue, void (*fn)(Packet*) ) {
 	 if (pqueue_empty(queue)) 
 		  return;
 	 while( i != last ) {
-		  fn(&queue->packets[i]);
+		  fn(queue->packets[i]);
 		  i = PMOD(i+1, queue->maxsize);
 	 }
-	 if (pqueue_length(queue) > 1)
-		  fn(&queue->packets[last]);
+	 fn(queue->packets[last]);
 }
 void pqueue_debug_print(PQueue* queue) {
 	 if (pqueue_length(queue) > 0) {
@@ -127,13 +143,14 @@ void pqueue_debug_print(PQueue* queue) {
 	 }
 }
 
-/* Sends a single packet via udt_send */
+/* Sends (or resends) a single packet from its send buffer */
 void send_packet(Packet* packet) {
 	 int ret;
 	 int packet_size = HEADERSIZE + packet->nbuffer;
-	 assert(packet_size > HEADERSIZE);
+	 assert(packet_size >= HEADERSIZE);
 
-	 if ((ret = udt_send(packet, packet_size)) != NET_SUCCESS) {
+	 packet->crc = udt_crc(packet, packet_size);
+	 if ((ret = udt_send_commit(packet, packet_size)) != NET_SUCCESS) {
 		  switch (ret) {
 		  case NET_TOOBIG:
 			   fprintf(stderr, "sender: NET_TOOBIG\n");
@@ -152,7 +169,7 @@ void send_packet(Packet* packet) {
    Return &packet if the packet was added, NULL if there is no more data. */
 Packet* add_packet(PQueue* queue, int seqn) {
 	 Packet* packet = pqueue_push(queue);
-	 int cnt = get_data(packet->buffer, DATASIZE);
+	 int cnt = get_data(packet->buffer, udt_segsize(HEADERSIZE));
 
 	 /* If the newly pushed packet could be filled with data,
 	    we fill in the header. Otherwise we pop it back out and give up. */
@@ -168,8 +185,9 @@ Packet* add_packet(PQueue* queue, int seqn) {
 }
 
 /* Attempts to get an ack. Timeout can be -1 (infinite) or any value >= 0.
-   Returns -1 in case of timeout, otherwise the ACK sequence number. */
-int get_ack(int timeout) {
+   Returns -1 in case of timeout, otherwise the ACK sequence number; the
+   advertised window goes to *rwnd. */
+int get_ack(int timeout, int* rwnd) {
 	 ACKPacket ack;
 	 int ret = udt_recv(&ack, sizeof(ACKPacket), timeout);
 	 if (ret == NET_EOF) {
@@ -179,36 +197,58 @@ int get_ack(int timeout) {
 		  fprintf(stderr, "Sender: NET_SYSERR\n");
 		  exit(1);
 	 }
-	 return ret == 0 ? -1 : ack.seqn;
+	 if (ret == 0 || ret != sizeof(ACKPacket) || !udt_crc_ok(&ack, ret))
+		  return -1;
+	 *rwnd = ack.rwnd;
+	 return ack.seqn;
 }
 
 
-/* Timer, in milliseconds */
-int cnt_time = 0;
-int cnt_timeout = 0;
-bool cnt_active = false;
+/* Timer, in simulated microseconds. One per thread, so that both ends of
+   a full duplex run can share a process (-T). */
+__thread simtime_t cnt_start = 0;
+__thread int cnt_timeout = 0;
+__thread bool cnt_active = false;
 void start_timer(int timeout) {
 	 cnt_timeout = timeout;
-	 cnt_time = 0;
+	 cnt_start = sim_time();
 	 cnt_active = true;
 }
 void stop_timer() {
 	 cnt_active = false;
 }
+bool timer_expired() {
+	 return cnt_active && sim_time() - cnt_start >= cnt_timeout;
+}
+/* Time left until the timer expires, 0 if it is not running */
+int timer_left() {
+	 simtime_t left = cnt_start + cnt_timeout - sim_time();
+	 return cnt_active && left > 0 ? left : 0;
+}
 
-/* Main sender function. Taken from the state diagram on slide 6, chapter 5 */
+/* Main sender function. Taken from the state diagram on slide 6, chapter 5.
+   The window is the smaller of our own and the one the receiver advertises;
+   while the receiver's is zero and nothing is in flight, the timer runs as
+   a persist timer and one packet goes out as a probe each time it expires. */
 void sender(int window, int timeout) {
 	 int base = 1;
 	 int nextseqnum = 1;
+	 int rwnd = window;
+	 int probes = 0;
+	 int retx = 0, timeouts = 0;
 	 bool allsent = false;
+	 bool probe = false;
 	 PQueue sendQ;
 	 pqueue_init(&sendQ, window);
 
 	 while ( !(allsent && pqueue_empty(&sendQ)) ) {
 		  int acknum = -1;
+		  int limit = rwnd < window ? rwnd : window;
+		  bool sent = false;
+		  sim_metric(MET_WINDOW, limit);
 
 		  /* Send new data */
-		  if (!allsent && nextseqnum < base + window) {
+		  if (!allsent && (nextseqnum < base + limit || probe)) {
 			   Packet* packet = add_packet(&sendQ, nextseqnum);
 			   if (packet == NULL) {
 					allsent = true;
@@ -217,13 +257,21 @@ void sender(int window, int timeout) {
 					if (base == nextseqnum)
 						 start_timer(timeout);
 					nextseqnum++;
+					sent = true;
 			   }
+			   probe = false;
 		  }
+
+		  /* Zero window, nothing in flight: start the persist timer */
+		  if (!allsent && rwnd == 0 && base == nextseqnum && !cnt_active)
+			   start_timer(timeout);
 		  
-		  /* Attempt to receive an ACK. */
-		  acknum = get_ack(0);
+		  /* Attempt to receive an ACK. If there was nothing to send,
+			 sleep until one comes in or the timer runs out. */
+		  acknum = get_ack(sent ? 0 : timer_left(), &rwnd);
 		  if (acknum > 0) {
 			   base = acknum + 1;
+			   sim_metric(MET_BASE, base);
 			   if (base == nextseqnum)
 					stop_timer();
 			   else
@@ -236,21 +284,37 @@ void sender(int window, int timeout) {
 		  }
 		  
 		  /* Handle timeouts */
-		  if (cnt_active && cnt_time >= cnt_timeout) {
+		  if (timer_expired()) {
 			   start_timer(cnt_timeout);
-			   pqueue_map(&sendQ, &send_packet);
+			   if (pqueue_empty(&sendQ)) {
+					probe = true;
+					probes++;
+			   } else if (rwnd == 0) {
+					/* the window is still shut: probe again */
+					pqueue_map(&sendQ, &send_packet);
+					probes++;
+			   } else {
+					pqueue_map(&sendQ, &send_packet);
+					retx += nextseqnum - base;
+					sim_metric(MET_RETRANS, retx);
+			   }
+			   sim_metric(MET_TIMEOUTS, ++timeouts);
 		  }
 		  pqueue_debug_print(&sendQ);
 	 }
 	 
 	 pqueue_destroy(&sendQ);
+	 fprintf(stderr, "Sender: %d zero window probes, %d corrupted ACKs\n",
+			 probes, udt_crc_errors());
 }
 
-/* Sends an ACK signal back to the sender. */
-void receiver_acknowledge(int seqn) {
+/* Sends an ACK signal back to the sender, with the receive window. */
+void receiver_acknowledge(int seqn, int rwnd) {
 	 int ret;
-	 ACKPacket ack = {"ACK", 0};
+	 ACKPacket ack = {0, "ACK", 0};
 	 ack.seqn = seqn;
+	 ack.rwnd = rwnd;
+	 ack.crc = udt_crc(&ack, sizeof(ACKPacket));
 	 ret = udt_send(&ack, sizeof(ACKPacket));
 	 if (ret != NET_SUCCESS) {
 		  switch (ret) {
@@ -267,36 +331,347 @@ void receiver_acknowledge(int seqn) {
 	 }
 }
 
-/* Main receiver function. State diagram: slide 8, chapter 5 */
-void receiver() {
+/*  Receive buffer: in-order packets the application has not taken yet.
+	It is bounded by the window handed to receiver(), and its free space
+	is advertised in every ACK, so a slow application throttles the sender
+	instead of making the buffer grow. */
+typedef struct {
+	 int head;
+	 int length;
+	 int maxsize;
+	 int maxlength;		/* high-water mark */
+	 Packet* packets;
+} RBuffer;
+
+void rbuffer_init(RBuffer* rbuf, int size) {
+	 rbuf->head = 0;
+	 rbuf->length = 0;
+	 rbuf->maxsize = size;
+	 rbuf->maxlength = 0;
+	 rbuf->packets = malloc(sizeof(Packet) * size);
+}
+void rbuffer_destroy(RBuffer* rbuf) {
+	 free(rbuf->packets);
+}
+int rbuffer_space(RBuffer* rbuf) {
+	 return rbuf->maxsize - rbuf->length;
+}
+void rbuffer_push(RBuffer* rbuf, Packet* packet) {
+	 Packet* slot;
+	 assert (rbuffer_space(rbuf) > 0);
+	 slot = &rbuf->packets[(rbuf->head + rbuf->length) % rbuf->maxsize];
+	 memcpy(slot, packet, HEADERSIZE + packet->nbuffer);
+	 rbuf->length++;
+	 if (rbuf->length > rbuf->maxlength)
+		  rbuf->maxlength = rbuf->length;
+}
+/* Hands packets to the application while it takes them without blocking,
+   or all of them if wait is set. */
+void rbuffer_deliver(RBuffer* rbuf, bool wait) {
+	 while (rbuf->length > 0) {
+		  Packet* packet = &rbuf->packets[rbuf->head];
+		  if (!wait && deliver_ready() < packet->nbuffer)
+			   break;
+		  deliver_data(packet->buffer, packet->nbuffer);
+		  rbuf->head = PMOD(rbuf->head + 1, rbuf->maxsize);
+		  rbuf->length--;
+	 }
+}
+
+/* Main receiver function. State diagram: slide 8, chapter 5
+   With large segments (udt_gso), the packets that have come in together
+   get one cumulative ACK, for up to a large segment's worth of data, as
+   GRO does, but for no more than a quarter of the window, so that the
+   sender is not held up waiting for it; otherwise every packet is
+   acknowledged. */
+void receiver(int window) {
 	 int ret;
 	 int expected = 1;
-	 Packet packet;
+	 int zerownd = 0;
+	 int unacked = 0;
+	 int ackbatch = udt_gso() / udt_segsize(HEADERSIZE);
+	 bool closed = false;
+	 Packet* packet;
+	 RBuffer rbuf;
+	 rbuffer_init(&rbuf, window);
+	 if (ackbatch > window / 4)
+		  ackbatch = window / 4;
+	 if (ackbatch < 1)
+		  ackbatch = 1;
 
-	 /* Try to receive a packet, check for network errors */
+	 /* Try to receive a packet, check for network errors. The packet is
+		read where the transport received it, not copied out. */
 	 while (1) { 
-		  ret = udt_recv(&packet, sizeof(packet), -1);
+		  /* Let the application catch up, and reopen a closed window */
+		  rbuffer_deliver(&rbuf, false);
+		  if (closed && rbuffer_space(&rbuf) > 0) {
+			   receiver_acknowledge(expected - 1, rbuffer_space(&rbuf));
+			   sim_metric(MET_WINDOW, rbuffer_space(&rbuf));
+			   closed = false;
+		  }
+
+		  /* With data waiting for the application, wake up every tick;
+			 with an ACK held back, only take what has already come */
+		  ret = udt_recv_borrow((void**)&packet,
+								unacked > 0 ? 0 : rbuf.length > 0 ? 1 : -1);
 		  if (ret == NET_EOF)
 			   break;
 		  else if (ret == NET_SYSERR) {
 			   fprintf(stderr, "Receiver: NET_SYSERR\n");
 			   exit(1);
+		  } else if (ret == 0) {
+			   if (unacked > 0) {
+					receiver_acknowledge(expected - 1, rbuffer_space(&rbuf));
+					unacked = 0;
+			   }
+			   continue;
+		  }
+		  if (!udt_crc_ok(packet, ret)) {
+			   udt_recv_release();
+			   continue;	/* damaged: as if lost */
 		  }
 		  
-		  /* At this point we have a valid packet. Check the sequence number. */
-		  assert (ret == HEADERSIZE + packet.nbuffer);
-		  /* printf("Receiver: Received packet #%d. ", packet.seqn); */
-		  if (packet.seqn == expected) {
-			   deliver_data(packet.buffer, packet.nbuffer);
-			   receiver_acknowledge(expected);
+		  /* At this point we have a valid packet. Check the sequence number,
+			 and whether there is room for it. */
+		  assert (ret == HEADERSIZE + packet->nbuffer);
+		  /* printf("Receiver: Received packet #%d. ", packet->seqn); */
+		  if (packet->seqn == expected && rbuffer_space(&rbuf) > 0) {
+			   if (rbuf.length == 0 && deliver_ready() >= packet->nbuffer)
+					deliver_data(packet->buffer, packet->nbuffer);
+			   else
+					rbuffer_push(&rbuf, packet);
 			   expected++;
-		  } else {
-			   receiver_acknowledge(expected - 1);
 		  }
+		  udt_recv_release();
+		  if (rbuffer_space(&rbuf) == 0 && !closed) {
+			   closed = true;
+			   zerownd++;
+		  }
+		  if (++unacked >= ackbatch || closed) {
+			   receiver_acknowledge(expected - 1, rbuffer_space(&rbuf));
+			   unacked = 0;
+		  }
+		  sim_metric(MET_WINDOW, rbuffer_space(&rbuf));
+		  sim_metric(MET_BASE, expected);
+	 }
+
+	 /* Everything is acknowledged; the rest only has to be handed over */
+	 rbuffer_deliver(&rbuf, true);
+	 fprintf(stderr, "Receiver: buffered at most %d of %d packets, "
+			 "%d zero windows, %d corrupted packets\n", rbuf.maxlength,
+			 rbuf.maxsize, zerownd, udt_crc_errors());
+	 rbuffer_destroy(&rbuf);
+}
+
+/*  Full duplex mode: both ends run peer(), each sending its own file and
+	receiving the other's. Acknowledgements ride in the header of the data
+	going the other way; a pure ACK (seqn 0, no data) goes out only when
+	there is no data to carry it. An empty data packet (FIN) ends each
+	direction. The receiving side keeps out-of-order packets within the
+	window and reports them in the SACK bitmap, so a timeout resends only
+	what the other end is missing.
+	After both directions are done, the end lingers for two timeouts to
+	ACK a retransmitted FIN, like TCP's TIME_WAIT. */
+typedef struct {
+	 /* sending */
+	 int base;
+	 int nextseqnum;
+	 bool allsent;			/* FIN queued */
+	 bool* sacked;			/* by seqn % window */
+	 PQueue sendQ;
+	 /* receiving */
+	 int expected;
+	 bool finished;			/* FIN received */
+	 bool ackdue;
+	 bool* have;			/* out of order, by seqn % window */
+	 Packet* ooo;
+	 int window;
+	 /* statistics */
+	 int npure, nretx, nskip, nooo, ntimeout;
+} Peer;
+
+/* Fills in the acknowledgement of what we have received */
+void peer_setack(Peer* p, Packet* packet) {
+	 int i;
+	 packet->ack = p->expected - 1;
+	 packet->sack = 0;
+	 for (i = 0; i < SACKBITS && i < p->window - 1; i++)
+		  if (p->have[(p->expected + 1 + i) % p->window])
+			   packet->sack |= 1u << i;
+	 p->ackdue = false;
+}
+
+bool peer_cansend(Peer* p) {
+	 return !p->allsent && p->nextseqnum < p->base + p->window;
+}
+
+/* Takes in one packet from the other end: its ACK fields, then its data */
+void peer_input(Peer* p, Packet* packet, int timeout) {
+	 int i, seqn;
+
+	 /* cumulative and selective acknowledgement of our data */
+	 if (packet->ack >= p->base) {
+		  p->base = packet->ack + 1;
+		  sim_metric(MET_BASE, p->base);
+		  while (!pqueue_empty(&p->sendQ) &&
+				 pqueue_head(&p->sendQ)->seqn < p->base)
+			   pqueue_pop(&p->sendQ);
+		  if (p->base == p->nextseqnum)
+			   stop_timer();
+		  else
+			   start_timer(timeout);
+	 }
+	 for (i = 0; i < SACKBITS; i++) {
+		  seqn = packet->ack + 2 + i;
+		  if ((packet->sack & (1u << i)) && seqn >= p->base &&
+			  seqn < p->nextseqnum)
+			   p->sacked[seqn % p->window] = true;
+	 }
+
+	 if (packet->seqn == 0)
+		  return;		/* pure ACK */
+	 p->ackdue = true;
+	 seqn = packet->seqn;
+	 if (seqn > p->expected && seqn < p->expected + p->window) {
+		  /* out of order: keep it for later */
+		  if (!p->have[seqn % p->window]) {
+			   memcpy(&p->ooo[seqn % p->window], packet,
+					  HEADERSIZE + packet->nbuffer);
+			   p->have[seqn % p->window] = true;
+			   p->nooo++;
+		  }
+		  return;
+	 }
+	 if (seqn != p->expected)
+		  return;		/* duplicate */
+
+	 /* in order: hand it up, then whatever it unblocks */
+	 for (;;) {
+		  if (packet->nbuffer == 0)
+			   p->finished = true;
+		  else
+			   deliver_data(packet->buffer, packet->nbuffer);
+		  p->expected++;
+		  if (!p->have[p->expected % p->window])
+			   break;
+		  p->have[p->expected % p->window] = false;
+		  packet = &p->ooo[p->expected % p->window];
+	 }
+}
+
+/* Sends an ACK without data */
+void peer_ack(Peer* p) {
+	 Packet ack;
+	 ack.seqn = 0;
+	 ack.nbuffer = 0;
+	 peer_setack(p, &ack);
+	 ack.crc = udt_crc(&ack, HEADERSIZE);
+	 if (udt_send(&ack, HEADERSIZE) != NET_SUCCESS) {
+		  fprintf(stderr, "peer: udt_send failed\n");
+		  exit(1);
+	 }
+	 p->npure++;
+}
+
+/* Waits up to timeout for packets and takes in all that came.
+   Returns false once the other end has gone away. */
+bool peer_recv(Peer* p, int wait, int timeout) {
+	 Packet* packet;
+	 int ret;
+
+	 while ((ret = udt_recv_borrow((void**)&packet, wait)) > 0) {
+		  if (udt_crc_ok(packet, ret)) {
+			   assert (ret == HEADERSIZE + packet->nbuffer);
+			   peer_input(p, packet, timeout);
+		  }
+		  udt_recv_release();
+		  wait = 0;
 	 }
+	 if (ret == NET_SYSERR) {
+		  fprintf(stderr, "peer: NET_SYSERR\n");
+		  exit(1);
+	 }
+	 return ret != NET_EOF;
+}
+
+void peer(int window, int timeout) {
+	 Peer p;
+	 int i, wait, seqn;
+
+	 memset(&p, 0, sizeof(p));
+	 p.base = p.nextseqnum = p.expected = 1;
+	 p.window = window;
+	 p.sacked = calloc(window, sizeof(bool));
+	 p.have = calloc(window, sizeof(bool));
+	 p.ooo = malloc(sizeof(Packet) * window);
+	 pqueue_init(&p.sendQ, window);
+	 sim_metric(MET_WINDOW, window);
+
+	 while (!(p.allsent && pqueue_empty(&p.sendQ) && p.finished)) {
+		  /* Send new data, with our ACK riding along */
+		  if (peer_cansend(&p)) {
+			   Packet* packet = add_packet(&p.sendQ, p.nextseqnum);
+			   if (packet == NULL) {
+					packet = pqueue_push(&p.sendQ);
+					packet->seqn = p.nextseqnum;
+					packet->nbuffer = 0;
+					p.allsent = true;
+			   }
+			   p.sacked[p.nextseqnum % window] = false;
+			   peer_setack(&p, packet);
+			   send_packet(packet);
+			   if (p.base == p.nextseqnum)
+					start_timer(timeout);
+			   p.nextseqnum++;
+		  }
+
+		  /* Take in what came. If we can't send more, sleep until
+			 something comes in or the timer runs out. */
+		  if (peer_cansend(&p) || p.ackdue)
+			   wait = 0;
+		  else if (cnt_active)
+			   wait = timer_left();
+		  else
+			   wait = -1;
+		  if (!peer_recv(&p, wait, timeout))
+			   break;
+
+		  /* Nothing to carry the ACK: send it on its own */
+		  if (p.ackdue && !peer_cansend(&p))
+			   peer_ack(&p);
+
+		  /* Timeout: resend what the other end has not got */
+		  if (timer_expired()) {
+			   start_timer(cnt_timeout);
+			   sim_metric(MET_TIMEOUTS, ++p.ntimeout);
+			   for (seqn = p.base; seqn < p.nextseqnum; seqn++) {
+					i = (p.sendQ.head + seqn - p.base) % p.sendQ.maxsize;
+					if (p.sacked[seqn % window]) {
+						 p.nskip++;
+						 continue;
+					}
+					send_packet(p.sendQ.packets[i]);
+					p.nretx++;
+			   }
+			   sim_metric(MET_RETRANS, p.nretx);
+		  }
+	 }
+
+	 /* TIME_WAIT: ACK the other end's FIN again if it was not heard */
+	 while (p.finished && peer_recv(&p, 2 * timeout, timeout) &&
+			p.ackdue)
+		  peer_ack(&p);
+
+	 fprintf(stderr, "Peer: %d pure ACKs, %d retransmitted, %d skipped "
+			 "by SACK, %d out of order, %d corrupted\n", p.npure, p.nretx,
+			 p.nskip, p.nooo, udt_crc_errors());
+	 pqueue_destroy(&p.sendQ);
+	 free(p.sacked);
+	 free(p.have);
+	 free(p.ooo);
 }
 
-/* called by timer per 10ms */
+/* called by timer every tick; the timer above reads sim_time() instead */
 void timer_handler() {
-	 cnt_time = cnt_time + 10;
+	 /* NOP */;
 }
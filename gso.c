@@ -0,0 +1,145 @@
+/*
+ *	gso.c
+ *
+ *	large segments (-G) -- the application side moves data in buffers
+ *	of GSO_SIZE, and the protocol still takes and hands over one
+ *	segment per packet.  The sender end reads the source a large
+ *	buffer at a time and get_data() cuts it into the segments asked
+ *	for; the receiver end puts the segments given to deliver_data()
+ *	back together and writes them out a large buffer at a time, or as
+ *	soon as the end is about to wait for the line, so that data never
+ *	sits here while nothing arrives.  Either way one read or write
+ *	goes to the source or destination per GSO_SIZE bytes instead of
+ *	one per packet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+#include "sim.h"
+
+/* per end: the sender end reads ahead, the receiver end coalesces */
+static __thread char *gso_rbuf;		/* source data */
+static __thread int gso_roff, gso_rlen;	/* unread data in gso_rbuf */
+static __thread int gso_eof;
+static __thread char *gso_wbuf;		/* delivered data */
+static __thread int gso_wlen;
+
+static __thread long long gso_nread, gso_nrseg;
+static __thread long long gso_nwrite, gso_nwseg, gso_wbytes;
+
+/*
+ * int
+ * gso_start(void)
+ *	set up the buffers of this end, before the timer runs
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+gso_start(void)
+{
+	if ((gso_rbuf = malloc(GSO_SIZE)) == NULL ||
+	    (gso_wbuf = malloc(GSO_SIZE)) == NULL) {
+		perror("gso_start: malloc");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * int
+ * gso_read(void *buf, int size, int (*src)(void *, int))
+ *	up to `size' bytes of the data read with `src', which returns 0
+ *	at the end, GSO_SIZE bytes at a time
+ *
+ * return value:
+ *	bytes, 0 at the end of the data
+ */
+int
+gso_read(void *buf, int size, int (*src)(void *, int))
+{
+	int n;
+
+	/* the rest of a read goes in front of the next, for full segments */
+	if (gso_rlen - gso_roff < size && !gso_eof) {
+		memmove(gso_rbuf, gso_rbuf + gso_roff, gso_rlen - gso_roff);
+		gso_rlen -= gso_roff;
+		gso_roff = 0;
+		if ((n = src(gso_rbuf + gso_rlen, GSO_SIZE - gso_rlen)) == 0)
+			gso_eof = 1;
+		gso_rlen += n;
+		gso_nread++;
+	}
+	if (gso_roff == gso_rlen)
+		return 0;
+	n = gso_rlen - gso_roff < size ? gso_rlen - gso_roff : size;
+	memcpy(buf, gso_rbuf + gso_roff, n);
+	gso_roff += n;
+	gso_nrseg++;
+	return n;
+}
+
+/*
+ * int
+ * gso_write(void *buf, int size, int (*dst)(void *, int))
+ *	pass `size' bytes on to `dst', coalesced with the data before
+ *
+ * return value:
+ *	size
+ */
+int
+gso_write(void *buf, int size, int (*dst)(void *, int))
+{
+	gso_nwseg++;
+	if (gso_wlen + size > GSO_SIZE)
+		gso_flush(dst);
+	if (size >= GSO_SIZE) {
+		gso_nwrite++;
+		gso_wbytes += size;
+		return dst(buf, size);
+	}
+	memcpy(gso_wbuf + gso_wlen, buf, size);
+	gso_wlen += size;
+	return size;
+}
+
+/*
+ *	void gso_flush(int (*dst)(void *, int)) -- pass on what is held
+ */
+void
+gso_flush(int (*dst)(void *, int))
+{
+	if (gso_wlen == 0)
+		return;
+	gso_nwrite++;
+	gso_wbytes += gso_wlen;
+	dst(gso_wbuf, gso_wlen);
+	gso_wlen = 0;
+}
+
+/*
+ *	int gso_held(void) -- bytes held for coalescing
+ */
+int
+gso_held(void)
+{
+	return gso_wlen;
+}
+
+/*
+ *	void gso_stats(int sender) -- print the reads and writes saved
+ */
+void
+gso_stats(int sender)
+{
+	if (sender && gso_nread)
+		fprintf(stderr, "gso\t\t: %lld segments from %lld reads\n",
+			gso_nrseg, gso_nread);
+	if (!sender && gso_nwrite)
+		fprintf(stderr, "gro\t\t: %lld segments in %lld writes "
+			"(%.1f KB each)\n", gso_nwseg, gso_nwrite,
+			gso_wbytes / 1024.0 / gso_nwrite);
+}
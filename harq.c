@@ -0,0 +1,304 @@
+/*
+  N-channel stop-and-wait, as in HARQ.
+
+  sw.c has one packet in flight, so it moves one packet per round trip
+  whatever the bandwidth. Here the sender runs `window' stop-and-wait
+  channels over the one link, each with the logic of sw.c: take data,
+  send it, wait for its ACK, resend it when its timer runs out. A packet
+  carries its channel and the channel's own sequence number, which is
+  all the stop-and-wait logic needs, plus a sequence number over the
+  whole stream, which the receiver uses to put the data of the channels
+  back in order. A channel only takes new data while it is less than
+  `window' packets ahead of the oldest packet not acknowledged, so the
+  receiver needs no more than `window' buffers to reorder.
+*/
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h> /* for exit() */
+#include <assert.h>
+#include "transport.h"
+
+#define	DATASIZE	(MTU - 5 * sizeof(int))	/* at most; see SEGSIZE */
+#define HEADERSIZE  (sizeof(Packet) - DATASIZE)
+#define ACKSIZE     sizeof("ACK")
+
+/* Declarations, to remove warnings */
+int get_data(void*,int);
+int deliver_data(void*, int);
+int udt_recv(void*,int,int);
+
+/* A packet. The header is made of
+   - CRC-32C of the rest of the packet
+   - channel
+   - sequence number within the channel
+   - sequence number within the stream
+   - size of buffer (filled with valid data)
+   This is followed by the data. */
+typedef struct {
+	 unsigned int crc;
+	 int chan;
+	 int cseq;
+	 int seqn;
+	 int nbuffer;
+	 char buffer[DATASIZE];
+} Packet;
+
+/* ACK packet. Contains a CRC, a tiny header, and the channel and channel
+   sequence number acknowledged. */
+typedef struct {
+	 unsigned int crc;
+	 char code[ACKSIZE];
+	 int chan;
+	 int cseq;
+} ACKPacket;
+
+/* One stop-and-wait channel of the sender. The packet is a transport send
+   buffer (udt_send_acquire), taken for each new packet and given back once
+   it is acknowledged. */
+typedef struct {
+	 int state;
+	 int cseq;          /* sequence number of the packet in flight */
+	 Packet* packet;
+	 simtime_t sent;    /* when the packet last went out, for its timer */
+} Channel;
+
+#define CHAN_IDLE       1
+#define CHAN_WAITACK    2
+
+/* Puts the packet of a channel on the line, the first time or again. */
+void channel_send(Channel* c) {
+	 int packet_size = HEADERSIZE + c->packet->nbuffer;
+
+	 c->packet->crc = udt_crc(c->packet, packet_size);
+	 switch (udt_send_commit(c->packet, packet_size)) {
+	 case NET_SUCCESS:
+		  c->state = CHAN_WAITACK;
+		  c->sent = sim_time();
+		  break;
+	 case NET_TOOBIG:
+		  fprintf(stderr, "sender: NET_TOOBIG\n");
+		  exit(1);
+	 case NET_SYSERR:
+		  fprintf(stderr, "sender: NET_SYSERR\n");
+		  exit(1);
+	 default:
+		  fprintf(stderr, "sender: unknown\n");
+		  exit(1);
+	 }
+}
+
+/* Obtains data from the upper layer for an idle channel and sends it.
+   Returns false at the end of the data. */
+bool channel_getdata(Channel* c, int chan, int seqn) {
+	 int count;
+
+	 c->packet = udt_send_acquire(sizeof(Packet));
+	 assert (c->packet != NULL);
+	 count = get_data(c->packet->buffer, udt_segsize(HEADERSIZE));
+	 if (count == NET_EOF) {
+		  udt_send_release(c->packet);
+		  c->packet = NULL;
+		  return false;
+	 }
+	 c->packet->chan = chan;
+	 c->packet->cseq = c->cseq;
+	 c->packet->seqn = seqn;
+	 c->packet->nbuffer = count;
+	 channel_send(c);
+	 return true;
+}
+
+/* Takes in an ACK. Returns true if it frees its channel; an old ACK, for
+   a packet resent in the meantime, does not. */
+bool channel_ack(Channel* chans, int window, ACKPacket* ack) {
+	 Channel* c;
+
+	 assert (ack->chan >= 0 && ack->chan < window);
+	 c = &chans[ack->chan];
+	 if (c->state != CHAN_WAITACK || ack->cseq != c->cseq)
+		  return false;
+	 udt_send_release(c->packet);
+	 c->packet = NULL;
+	 c->cseq++;
+	 c->state = CHAN_IDLE;
+	 return true;
+}
+
+/* Main sender function. The window is the number of channels. ACKs are
+   taken in as fast as they come: one left waiting would let its channel's
+   timer run out, and resending then holds up all the others. */
+void sender(int window, int timeout) {
+	 Channel* chans = calloc(window, sizeof(Channel));
+	 ACKPacket ack;
+	 simtime_t now, wait;
+	 int i, ret, acked, busy = 0, nsent = 0, base = 0;
+	 int nretx = 0, ntimeout = 0, nacks = 0;
+	 bool eof = false;
+
+	 assert (chans != NULL);
+	 for (i = 0; i < window; i++)
+		  chans[i].state = CHAN_IDLE;
+	 sim_metric(MET_WINDOW, window);
+
+	 while (1) {
+		  /* Idle channels take new data, unless that would get too far
+			 ahead of the oldest packet in flight. */
+		  for (i = 0; i < window && !eof; i++)
+			   if (chans[i].state == CHAN_IDLE && nsent - base < window) {
+					if (channel_getdata(&chans[i], i, nsent)) {
+						 nsent++;
+						 busy++;
+					} else
+						 eof = true;
+			   }
+		  if (busy == 0)
+			   break;
+
+		  /* Wait for an ACK until the first timer runs out. */
+		  now = sim_time();
+		  wait = timeout;
+		  for (i = 0; i < window; i++)
+			   if (chans[i].state == CHAN_WAITACK &&
+				   chans[i].sent + timeout - now < wait)
+					wait = chans[i].sent + timeout - now;
+		  ret = udt_recv(&ack, sizeof(ACKPacket), wait > 0 ? wait : 0);
+		  if (ret == NET_EOF) {
+			   fprintf(stderr, "Sender: NET_EOF\n");
+			   exit(1);
+		  } else if (ret == NET_SYSERR) {
+			   fprintf(stderr, "Sender: NET_SYSERR\n");
+			   exit(1);
+		  }
+		  for (acked = 0; ret > 0;
+			   ret = udt_recv(&ack, sizeof(ACKPacket), 0))
+			   if (udt_crc_ok(&ack, ret)) {
+					assert (ret == sizeof(ACKPacket));
+					if (channel_ack(chans, window, &ack))
+						 acked++;
+			   }
+		  if (acked) {
+			   busy -= acked;
+			   nacks += acked;
+			   base = nsent;
+			   for (i = 0; i < window; i++)
+					if (chans[i].state == CHAN_WAITACK &&
+						chans[i].packet->seqn < base)
+						 base = chans[i].packet->seqn;
+			   sim_metric(MET_BASE, base);
+		  }
+
+		  /* Resend the packets whose timer ran out. */
+		  now = sim_time();
+		  for (i = 0; i < window; i++)
+			   if (chans[i].state == CHAN_WAITACK &&
+				   now - chans[i].sent >= timeout) {
+					channel_send(&chans[i]);
+					sim_metric(MET_TIMEOUTS, ++ntimeout);
+					sim_metric(MET_RETRANS, ++nretx);
+			   }
+	 }
+	 fprintf(stderr, "Sender: %d channels, %d packets, %d resent, "
+			 "%d corrupted ACKs\n", window, nacks, nretx,
+			 udt_crc_errors());
+	 free(chans);
+}
+
+/* Sends an ACK for a channel's packet back to the sender. */
+void receiver_acknowledge(int chan, int cseq) {
+	 int ret;
+	 ACKPacket ack = {0, "ACK", 0, 0};
+	 ack.chan = chan;
+	 ack.cseq = cseq;
+	 ack.crc = udt_crc(&ack, sizeof(ACKPacket));
+	 ret = udt_send(&ack, sizeof(ACKPacket));
+	 if (ret != NET_SUCCESS) {
+		  switch (ret) {
+		  case NET_TOOBIG:
+			   fprintf(stderr, "sender: NET_TOOBIG\n");
+			   exit(1);
+		  case NET_SYSERR:
+			   fprintf(stderr, "sender: NET_SYSERR\n");
+			   exit(1);
+		  default:
+			   fprintf(stderr, "sender: unknown\n");
+			   exit(1);
+		  }
+	 }
+}
+
+/* Main receiver function. The window is the number of channels: each
+   channel expects the next packet of its own, and packets that arrive
+   ahead of the stream wait in the reorder buffer, at seqn % window. */
+void receiver(int window)
+{
+	 int* expect = calloc(window, sizeof(int));
+	 bool* have = calloc(window, sizeof(bool));
+	 Packet* ooo = malloc(sizeof(Packet) * window);
+	 int ret, c, next = 0, nooo = 0, maxooo = 0, ndup = 0;
+	 Packet* packet;
+
+	 assert (expect != NULL && have != NULL && ooo != NULL);
+	 sim_metric(MET_WINDOW, window);
+	 while (1) {
+		  ret = udt_recv_borrow((void**)&packet, -1);
+		  if (ret == NET_EOF)
+			   break;
+		  else if (ret == NET_SYSERR) {
+			   fprintf(stderr, "Receiver: NET_SYSERR\n");
+			   exit(1);
+		  }
+		  if (!udt_crc_ok(packet, ret)) {
+			   udt_recv_release();
+			   continue;     /* damaged: as if lost */
+		  }
+
+		  assert (ret == HEADERSIZE + packet->nbuffer);
+		  assert (packet->chan >= 0 && packet->chan < window);
+		  c = packet->chan;
+		  receiver_acknowledge(c, packet->cseq);
+		  if (packet->cseq != expect[c]) {
+			   ndup++;       /* its ACK was lost */
+			   udt_recv_release();
+			   continue;
+		  }
+		  expect[c]++;
+
+		  /* Hand over the data in stream order. */
+		  assert (packet->seqn >= next && packet->seqn < next + window);
+		  if (packet->seqn == next) {
+			   deliver_data(packet->buffer, packet->nbuffer);
+			   next++;
+			   while (have[next % window]) {
+					have[next % window] = false;
+					nooo--;
+					deliver_data(ooo[next % window].buffer,
+								 ooo[next % window].nbuffer);
+					next++;
+			   }
+			   sim_metric(MET_BASE, next);
+		  } else {
+			   ooo[packet->seqn % window] = *packet;
+			   have[packet->seqn % window] = true;
+			   if (++nooo > maxooo)
+					maxooo = nooo;
+		  }
+		  udt_recv_release();
+	 }
+	 fprintf(stderr, "Receiver: %d channels, reordered at most %d packets, "
+			 "%d duplicates, %d corrupted packets\n", window, maxooo, ndup,
+			 udt_crc_errors());
+	 free(expect);
+	 free(have);
+	 free(ooo);
+}
+
+/* Full duplex mode is not implemented for N-channel stop-and-wait. */
+void peer(int window, int timeout) {
+	 fprintf(stderr, "peer: full duplex mode not supported\n");
+	 exit(1);
+}
+
+/* called by timer every tick; the channel timers read sim_time() */
+void timer_handler() {
+	 /* NOP */;
+}
@@ -5,32 +5,38 @@
  *	last update: 2009/05/26 by tera
  */
 
+#define	_GNU_SOURCE		/* CPU_SET, gettid */
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include "transport.h"
+#include "sim.h"
 
 /*
  *	packet format	-- lower layer header + user data
  */
 struct lowerpkt {
-	int lp_type;			/* packet type */
-	char lp_buf[MTU];		/* upper layer data */
+	int lp_type;			/* packet type (LP_* in sim.h) */
+	char lp_buf[MTU + LP_EXTRA];	/* upper layer data */
 };
 
-/* lp_type */
-#define	LP_USERDATA	0		/* user data */
-#define LP_EOF		1		/* no more user data */
-
 #define	LP_HEADERSIZE	4		/* header size */
 
 /*
@@ -38,9 +44,10 @@ struct lowerpkt {
  */
 struct pktbuf {
 	struct pktbuf *pb_next;
+	int pb_ref;			/* owners: protocol and/or line */
 	int pb_stat;			/* status */
 	int pb_size;			/* data size */
-	int pb_txtime;			/* time when this packet to be sent */
+	simtime_t pb_txtime;		/* time when this packet to be sent */
 	struct lowerpkt pb_lowerpkt;	/* lower layer packet */
 };
 
@@ -52,7 +59,7 @@ struct pktbuf {
 struct linebuf {
 	struct pktbuf *lbuf_head;	/* pktbuf head */
 	struct pktbuf *lbuf_tail;	/* pktbuf tail */
-	int lbuf_size;			/* buffered data size */
+	long long lbuf_size;		/* buffered data size */
 	int lbuf_stat;			/* status */
 };
 
@@ -60,119 +67,498 @@ struct linebuf {
 
 #define	ALARM_TICK	(10*1000)	/* 10,000 micro sec (10 msec) */
 #define	ALARM_TICK_MS	10		/* 10 msec */
+#define	SIM_TICKS	5		/* min. simulated ticks per delay */
 
-#define	WATCHDOG_TIMER	(5*60*1000)		/* (5 min) in msec */
+#define	CONSUME_BURST	(16*1024)	/* -c: bytes taken at once (default) */
 
-static struct linebuf lbuf;
+#define	WATCHDOG_TIMER	(5*60*1000000LL)	/* (5 min) in simulated usec */
 
-static int bw;		/* bandwidth: 1, 10, 100 (Mbps) */
-static int delay;	/* delay: 10, 20, 50 (msec) */
-static int bdp;		/* bandwidth-delay product (byte) */
-static int erate;	/* error rate (0, 10, 100, 1,000, 10,000) */
+/*
+ *	simulated link -- path 0 is the one on the command line, -p adds
+ *	more for multipath striping
+ */
+struct path {
+	int p_bw;			/* bandwidth (Mbps) */
+	int p_delay;			/* delay (usec) */
+	long long p_bdp;		/* bandwidth-delay product (byte) */
+	int p_erate;			/* drop 1 in p_erate packets, 0: none */
+};
 
-static int elapsed_time = 0;	/* elapsed time (msec) */
+static __thread struct linebuf lbuf[MP_MAXPATH];	/* one per path */
 
-#ifdef DEBUG
-static int ppid;	/* pid of parent process (receiver) */
-#endif
+static __thread struct lowerpkt rx_pkt;	/* socket receive buffer */
+static __thread struct lowerpkt tx_pkt;	/* corrupted copy on the wire */
+static __thread char rx_subbuf[MTU];	/* data from FEC or multipath */
+static __thread int rx_held;		/* rx_pkt / shm slot is lent out */
 
-static int sock_s;	/* socket for tx */
-static int sock_r;	/* socket for rx */
-static int fd_s;	/* file for tx */
-static int fd_r;	/* file for rx */
+#define	PB_FROMBUF(buf)	((struct pktbuf *)((char *)(buf) - \
+			offsetof(struct pktbuf, pb_lowerpkt.lp_buf)))
+
+static int bw;		/* bandwidth: 1 Mbps .. 100 Gbps (Mbps) */
+static int delay;	/* delay: 1 usec .. 1 sec (usec) */
+static long long bdp;	/* bandwidth-delay product (byte) */
+static int erate;	/* error rate (0, 10, 100, 1,000, 10,000) */
+static double ber;	/* bit error rate (-e), 0: no corruption */
+static __thread struct rng rng_loss[MP_MAXPATH];	/* per path */
+static __thread struct rng rng_ber;	/* bit errors */
+static __thread long long pkts_corrupt;	/* packets sent corrupted */
+static __thread long long bits_flipped;
+static struct path paths[MP_MAXPATH];
+static int npath = 1;	/* paths, more than one: multipath (-p) */
+static int maxdelay;	/* delay of the slowest path (usec) */
+
+static __thread simtime_t elapsed_time = 0;	/* simulated time (usec) */
+static int sim_tick;	/* simulated usec per ALARM_TICK of real time */
+static __thread long long bytes_sent;	/* data handed over by get_data() */
+static __thread long long pkts_sent;	/* packets put on the line */
+static __thread long long bytes_delivered;	/* data to deliver_data() */
+static __thread int crc_errors;	/* packets udt_crc_ok() turned down */
+static int window = WINDOWSIZE;	/* window size for sender() */
+static int rcvwin;		/* window for receiver() (-R), 0: window */
+
+static __thread int sock_s;	/* socket for tx */
+static __thread int sock_r;	/* socket for rx */
+static int fd_src[2] = { -1, -1 };	/* source file, by is_sender */
+static int fd_dst[2] = { -1, -1 };	/* destination file, by is_sender */
+static int batch;	/* file names a list or directory of objects */
+static __thread simtime_t watchdog = WATCHDOG_TIMER;	/* usec */
+static __thread int fd_s;	/* file for tx of this end */
+static __thread int fd_r;	/* file for rx of this end */
+static char *duplex;	/* source file of the receiver end (-d) */
+static char *capture;	/* pcap file of the sender end (-P), NULL: off */
+static char *metrics;	/* live metrics file (-M), NULL: off */
+static char *counters;	/* perf counter file (-C), NULL: off */
+
+static int streaming;	/* stdin to stdout mode */
+static int read_ahead;	/* read-ahead depth in blocks, 0: off */
+static int writebehind;	/* write-behind budget in KB, 0: off */
+static int compress;	/* payload compression (-z) */
+static int segsize = SEGSIZE;	/* data per packet (-g), 0: up to MTU */
+static int gso;		/* large segments (-G) */
+static int fec;		/* forward error correction on */
+static __thread int is_sender;	/* this end is the sender */
+static int shmchan;	/* shared-memory channel instead of sockets */
+static int threaded;	/* sender and receiver threads, no fork() */
+static char *queue;	/* bottleneck queue spec (-q), NULL: none */
+static int cross;	/* cross traffic through the queue (Mbps) */
+static int consume_rate;	/* receiving application speed (Mbps), 0: any */
+static int consume_burst = CONSUME_BURST;	/* bytes taken at once */
+static int consume_batch;	/* -c mbps,kbytes: reads only a full burst */
+static int consume_reading;	/* batch: it is taking a burst */
+static long long consume_bits = CONSUME_BURST * 8;	/* its bucket (bits) */
+static simtime_t consume_last;	/* time of the last refill */
+static long long consume_waits;	/* deliver_data() calls that blocked */
+static __thread timer_t tick_timer;	/* SIGALRM source in thread mode */
+
+#ifndef sigev_notify_thread_id		/* not in older glibc headers */
+#define	sigev_notify_thread_id	_sigev_un._tid
+#endif
+static __thread unsigned long cksum_a = 1, cksum_b = 0; /* adler-32 */
+static __thread long long cksum_len;	/* bytes covered by checksum */
 
 static sigset_t sigs;	/* sigset_t for SIGALRM */
 
+static struct option long_opts[] = {
+	{ "seed", required_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 }
+};
+
 static void print_help(char *);
+static int parse_delay(char *);
+static int link_ok(int, int, int);
+static int erate_div(int);
+static void cksum_update(void *, int);
+static void cksum_print(char *);
+static int src_read(void *, int);
+static int dst_write(void *, int);
+static int data_read(void *, int);
+static int data_write(void *, int);
+static int consume_ready(void);
+static double per_mb(long long, long long);
+static struct pktbuf *pkt_alloc(void);
+static void pkt_free(struct pktbuf *);
+static int line_enqueue(struct pktbuf *, int, int, int, int);
+static void lbuf_append(struct linebuf *, struct pktbuf *);
+static void q_dropped(void *);
+static int recv_view(void **, int);
+static int line_recv(struct lowerpkt **, int);
+static void line_release(void);
+static int chan_write(void *, int);
+static void *endpoint(void *);
+static void run_sender(void);
+static void run_receiver(void);
+static void rng_start(void);
+static void tick_start(char *);
+static void tick_stop(char *);
 static void send_pkt();
+static int line_drain(int);
+static struct lowerpkt *line_corrupt(struct lowerpkt *, int);
 static void alarm_handler();
+static void met_tick(void);
 void timer_handler();
 
 /*
- * syntax: sw file bandwidth delay error_rate
- * syntax: gbn file bandwidth delay error_rate
+ * syntax: sw [options] file bandwidth delay error_rate
+ * syntax: gbn [options] file bandwidth delay error_rate
  *
- *	bandwidth: 1, 10, 100 (Mbps)
- *	delay:     10, 20, 50 (msec)
+ *	-r depth:  read source data ahead in a ring of `depth' blocks
+ *	-w kbytes: write delivered data behind, `kbytes' KB in flight
+ *	-f k,m[,xor|rs]: add m parity packets to every k data packets
+ *	-t usec:   simulated time per 10 msec timer tick
+ *	-W window: window size handed to sender()
+ *	-p bw:delay[:erate]: one more path for multipath striping
+ *	-s rr|rtt|rate: multipath scheduler
+ *	-P pcapfile: capture the packets of both ends, the receiver's to
+ *		   pcapfile_r
+ *	-M file:   publish live counters in `file' for simstat
+ *	-C file:   append each end's CPU counters to `file' (perfbench)
+ *	-e ber:    flip bits at bit error rate `ber' (1e-6)
+ *	-z:        compress the payload, one block per get_data() buffer
+ *	-g size|max: data per packet, max: up to the MTU
+ *	-G:        large segments, source and destination moved GSO_SIZE
+ *		   bytes at a time
+ *	--seed n:  seed of the loss and error models, to repeat a run
+ *	-m:        shared-memory channel between the processes
+ *	-T:        sender and receiver as threads of one process
+ *	file:      source file, or `-' to stream stdin to stdout
+ *	bandwidth: 1, 10, 100, 1000, 10000, 40000, 100000 (Mbps)
+ *	delay:     1us .. 1000ms; plain numbers are msec (10, 20, 50)
  *	error rate: 0, -4 (1*10^-4), -3 (1*10^-3), -2 (1*10^-2), -1 (1*10^-1)
  */
 main(int argc, char *argv[])
 {
 	char *file_s;
 	char file_r[256];
+	char file_d[256];
 	int pid;
 	int sender_stat;
-	int sv1[2];
-	int sv2[2];
+	int sv1[2] = { -1, -1 };
+	int sv2[2] = { -1, -1 };
+	pthread_t tx, rx;
+	int ch, i;
+	int mindelay;
+	int fec_k = 0, fec_m = 0, fec_xor = 0;
+	char fec_code[8];
+	char *sched = "rr";
+	char p_delay[16];
+	int p_erate;
+	char *end;
+	int seeded = 0;
 	struct timeval tv;
-	struct itimerval tt;
-	time_t o_sec, n_sec, sec;
-	long o_msec, n_msec, msec;
-	struct tm *date;
-	struct lowerpkt *lpp;
 
-	if (argc != 5) {
+	while ((ch = getopt_long(argc, argv, "+r:w:f:t:W:R:c:q:x:d:p:s:P:M:C:e:g:zGbmT",
+			long_opts, NULL)) != -1) {
+		switch (ch) {
+		case 'r':
+			read_ahead = atoi(optarg);
+			if (read_ahead <= 0) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'w':
+			writebehind = atoi(optarg);
+			if (writebehind <= 0) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'f':
+			strcpy(fec_code, "rs");
+			if (sscanf(optarg, "%d,%d,%7s", &fec_k, &fec_m,
+					fec_code) < 2 ||
+					(strcmp(fec_code, "rs") != 0 &&
+					 strcmp(fec_code, "xor") != 0)) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			fec_xor = strcmp(fec_code, "xor") == 0;
+			fec = 1;
+			break;
+		case 't':
+			if ((sim_tick = atoi(optarg)) <= 0) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'W':
+			if ((window = atoi(optarg)) <= 0) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'R':
+			if ((rcvwin = atoi(optarg)) <= 0) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'c':
+			consume_rate = strtol(optarg, &end, 10);
+			if (*end == ',') {
+				consume_burst = strtol(end + 1, &end, 10) * 1024;
+				consume_batch = 1;
+			}
+			if (consume_rate <= 0 || consume_burst < MTU ||
+			    *end != '\0') {
+				print_help(argv[0]);
+				exit(1);
+			}
+			consume_bits = consume_burst * 8LL;
+			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 'x':
+			if ((cross = atoi(optarg)) <= 0) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'd':
+			duplex = optarg;
+			break;
+		case 'p':
+			p_erate = 0;
+			if (npath == MP_MAXPATH ||
+			    sscanf(optarg, "%d:%15[^:]:%d", &paths[npath].p_bw,
+					p_delay, &p_erate) < 2 ||
+			    !link_ok(paths[npath].p_bw,
+					paths[npath].p_delay = parse_delay(p_delay),
+					p_erate)) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			paths[npath++].p_erate = erate_div(p_erate);
+			break;
+		case 's':
+			sched = optarg;
+			break;
+		case 'P':
+			capture = optarg;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'C':
+			counters = optarg;
+			break;
+		case 'e':
+			ber = atof(optarg);
+			if (ber <= 0 || ber >= 1) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'S':
+			rng_setseed(strtoull(optarg, &end, 0));
+			if (*optarg == '\0' || *end != '\0') {
+				print_help(argv[0]);
+				exit(1);
+			}
+			seeded = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'g':
+			segsize = strcmp(optarg, "max") == 0 ? 0 :
+				atoi(optarg);
+			if (segsize < 0 || (segsize == 0 &&
+					strcmp(optarg, "max") != 0) ||
+					segsize > MTU) {
+				print_help(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'G':
+			gso = 1;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'm':
+			shmchan = 1;
+			break;
+		case 'T':
+			threaded = shmchan = 1;	/* rings between threads */
+			break;
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind != 4) {
 		print_help(argv[0]);
 		exit(1);
 	}
-	argv++;
+	argv += optind;
 	file_s = *argv++;
 	bw = atoi(*argv++);
-	delay = atoi(*argv++);
+	delay = parse_delay(*argv++);
 	erate = atoi(*argv++);
 
 	/* check arguments */
-	if (bw != 1 && bw != 10 && bw != 100) {
+	if (!link_ok(bw, delay, erate)) {
 		print_help(argv[0]);
 		exit(1);
 	}
-	if (delay != 10 && delay != 20 && delay != 50) {
-		print_help(argv[0]);
-		exit(1);
+
+	if (strcmp(file_s, "-") == 0) {
+		/*
+		 * streaming mode: data goes stdin -> stdout, so move the
+		 * diagnostics of both processes over to stderr.
+		 */
+		streaming = 1;
+		fd_src[1] = 0;
+		if ((fd_dst[0] = dup(1)) < 0 || dup2(2, 1) < 0) {
+			perror("dup");
+			exit(1);
+		}
+	} else if (batch) {
+		/* objects are opened one by one as they are sent */
+		if (read_ahead || writebehind || duplex) {
+			fprintf(stderr, "-b: no -r, -w or -d\n");
+			exit(1);
+		}
+		if ((i = batch_init(file_s)) <= 0) {
+			if (i == 0)
+				fprintf(stderr, "%s: no files\n", file_s);
+			exit(1);
+		}
+	} else {
+		/* open source file */
+		if((fd_src[1] = open(file_s, O_RDONLY)) < 0) {
+			fprintf(stderr, "source file `%s': ", file_s);
+			perror("open");
+			exit(1);
+		}
+
+		/* create destination file */
+		strcpy(file_r, file_s);
+		strcat(file_r, "_r");
+		if ((fd_dst[0] = open(file_r, O_WRONLY|O_CREAT|O_TRUNC,
+						0644)) < 0) {
+			fprintf(stderr, "destination file `%s': ", file_r);
+			perror("open");
+			exit(1);
+		}
 	}
-	if (erate != 0 && erate != -4 && erate != -3 && erate != -2 &&
-			erate != -1) {
-		print_help(argv[0]);
-		exit(1);
+
+	if (duplex) {
+		/* the reverse direction has its own pair of files */
+		if (streaming || fec || read_ahead || writebehind) {
+			fprintf(stderr, "-d: no streaming, -f, -r or -w\n");
+			exit(1);
+		}
+		if ((fd_src[0] = open(duplex, O_RDONLY)) < 0) {
+			fprintf(stderr, "source file `%s': ", duplex);
+			perror("open");
+			exit(1);
+		}
+		snprintf(file_d, sizeof(file_d), "%s_r", duplex);
+		if ((fd_dst[1] = open(file_d, O_WRONLY|O_CREAT|O_TRUNC,
+						0644)) < 0) {
+			fprintf(stderr, "destination file `%s': ", file_d);
+			perror("open");
+			exit(1);
+		}
 	}
 
-	/* open source file */
-	if((fd_s = open(file_s, O_RDONLY)) < 0) {
-		fprintf(stderr, "source file `%s': ", file_s);
-		perror("open");
-		exit(1);
+	/* setup several parameters */
+	/* bandwidth-delay product (byte) */
+	bdp = (long long)bw * delay * 1024/8 / 1000;
+	erate = erate_div(erate);
+	paths[0].p_bw = bw;
+	paths[0].p_delay = delay;
+	paths[0].p_erate = erate;
+	mindelay = maxdelay = delay;
+	for (i = 0; i < npath; i++) {
+		paths[i].p_bdp = (long long)paths[i].p_bw * paths[i].p_delay *
+			1024/8 / 1000;
+		if (paths[i].p_delay < mindelay)
+			mindelay = paths[i].p_delay;
+		if (paths[i].p_delay > maxdelay)
+			maxdelay = paths[i].p_delay;
+	}
+
+	/*
+	 * below 10 msec of delay the simulated clock runs slower than real
+	 * time, so that a delay still spans several timer ticks
+	 */
+	if (sim_tick == 0) {
+		sim_tick = ALARM_TICK;
+		if (mindelay < ALARM_TICK)
+			sim_tick = mindelay / SIM_TICKS;
+		if (sim_tick == 0)
+			sim_tick = 1;
 	}
 
-	/* create destination file */
-	strcpy(file_r, file_s);
-	strcat(file_r, "_r");
-	if ((fd_r = open(file_r, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
-		fprintf(stderr, "destination file `%s': ", file_r);
-		perror("open");
+	/* multipath: the sender stripes its packets over all paths */
+	if (npath > 1) {
+		if (fec || queue) {
+			fprintf(stderr, "-p: no -f or -q\n");
+			exit(1);
+		}
+		if (mp_init(sched) < 0) {
+			print_help(argv[0]);
+			exit(1);
+		}
+		for (i = 0; i < npath; i++)
+			mp_addpath(paths[i].p_bw, paths[i].p_delay);
+		/* a gap waits as long as a slower path may still fill it */
+		mp_timing(maxdelay - mindelay + 2 * sim_tick, sim_tick);
+	}
+
+	/* partial FEC blocks are closed after one link delay */
+	if (fec && fec_init(fec_k, fec_m, fec_xor, delay) < 0) {
+		fprintf(stderr, "fec: need 1 <= k <= %d, 1 <= m <= %d\n",
+			FEC_MAXK, FEC_MAXM);
 		exit(1);
 	}
 
-	/* setup several parameters */
-	bdp = bw * delay * 1024/8;	/* bandwidth-delay product (byte) */
-	if (erate == -1)
-		erate = 10;		/* drop 1 pkt per 10 pkts */
-	else if (erate == -2)
-		erate = 100;		/* drop 1 pkt per 100 pkts */
-	else if (erate == -3)
-		erate = 1000;		/* drop 1 pkt per 1,000 pkts */
-	else if (erate == -4)
-		erate = 10000;		/* drop 1 pkt per 10,000 pkts */
-	lbuf.lbuf_head = lbuf.lbuf_tail = NULL;
-	lbuf.lbuf_stat = lbuf.lbuf_size = 0;
+	/*
+	 * every loss and error model draws from its own stream of the
+	 * seed; without --seed take a new one, and print it so that the
+	 * run can be repeated
+	 */
+	if (!seeded) {
+		gettimeofday(&tv, NULL);
+		rng_setseed((unsigned long long)tv.tv_sec * 1000000 +
+			tv.tv_usec + ((unsigned long long)getpid() << 40));
+	}
+	fprintf(stderr, "seed\t\t: %llu\n", rng_getseed());
 
-	/* setup communication channel between 2 processes */
-	if (socketpair(PF_LOCAL, SOCK_DGRAM, 0, sv1) < 0) {
-		perror("socketpair");
+	/* bottleneck queue on the data direction */
+	if ((cross && !queue) ||
+	    (queue && q_init(queue, bw, delay,
+	    bdp < INT_MAX ? bdp : INT_MAX, cross, q_dropped) < 0)) {
+		print_help(argv[0]);
 		exit(1);
 	}
-	if (socketpair(PF_LOCAL, SOCK_DGRAM, 0, sv2) < 0) {
-		perror("socketpair");
+
+	/* shared with simstat, and between the 2 processes */
+	if (metrics && met_init(metrics) < 0)
 		exit(1);
+
+	/* setup communication channel between 2 processes */
+	if (shmchan) {
+		if (shm_init(sizeof(struct lowerpkt)) < 0)
+			exit(1);
+	} else {
+		if (socketpair(PF_LOCAL, SOCK_DGRAM, 0, sv1) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		if (socketpair(PF_LOCAL, SOCK_DGRAM, 0, sv2) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		/* neither end may block inside the SIGALRM handler */
+		for (i = 0; i < 2; i++) {
+			fcntl(sv1[i], F_SETFL, O_NONBLOCK);
+			fcntl(sv2[i], F_SETFL, O_NONBLOCK);
+		}
 	}
 
 	/* set signal handler */
@@ -180,187 +566,725 @@ main(int argc, char *argv[])
 	sigemptyset(&sigs);
 	sigaddset(&sigs, SIGALRM);
 
-#ifdef DEBUG
-	ppid = getpid();
-#endif
-	/* fork to 2 processes */
+	/* run sender and receiver as 2 threads ... */
+	if (threaded) {
+		/* SIGALRM goes to each endpoint thread through its own timer */
+		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+		if ((errno = pthread_create(&rx, NULL, endpoint, NULL)) != 0 ||
+		    (errno = pthread_create(&tx, NULL, endpoint, "sender")) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_join(tx, NULL);
+		pthread_join(rx, NULL);
+		exit(0);
+	}
+
+	/* ... or fork to 2 processes */
 	if ((pid = fork()) == 0) {	/* child process: sender */
+		is_sender = 1;
 		sock_s = sv1[1];
 		sock_r = sv2[0];
 		close(sv1[0]);
 		close(sv2[1]);
-		srandom(getpid());	/* set seed of random() */
+		if (shmchan)
+			shm_attach(1);
+		run_sender();
+		exit(0);
+	} else {		/* parent process: receiver */
+		sock_r = sv1[0];
+		sock_s = sv2[1];
+		close(sv1[1]);
+		close(sv2[0]);
+		if (shmchan)
+			shm_attach(0);
+		run_receiver();
+		wait(&sender_stat);
+		exit(0);
+	}
+}
 
-		/* get start time */
-		gettimeofday(&tv, NULL);
-		o_sec = tv.tv_sec;
-		o_msec = tv.tv_usec/1000;
-		date = localtime(&o_sec);
-	       	printf("start time\t: %02d:%02d:%02d.%03ld\n",
-		date->tm_hour, date->tm_min, date->tm_sec, o_msec);
-	
-		tt.it_interval.tv_sec = 0;
-		tt.it_interval.tv_usec = ALARM_TICK;
-		tt.it_value.tv_sec = 0;
-		tt.it_value.tv_usec = ALARM_TICK;
-		if (setitimer(ITIMER_REAL, &tt, NULL) < 0) {
-			perror("sender: setitimer");
-			exit(1);
-		}
+/*
+ *	thread mode: run one end of the connection on its own core
+ */
+static void *
+endpoint(void *arg)
+{
+	cpu_set_t cpus;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	is_sender = arg != NULL;
+	sock_s = sock_r = -1;		/* the rings replace the sockets */
+	CPU_ZERO(&cpus);
+	CPU_SET(is_sender % (ncpu > 0 ? ncpu : 1), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+	shm_attach(is_sender);
+	if (is_sender)
+		run_sender();
+	else
+		run_receiver();
+	return NULL;
+}
 
-		sender(WINDOWSIZE, delay*4);	/* call student's routine */
-		close(fd_s);			/* close source file */
+/*
+ *	sender side -- child process, or sender thread
+ */
+static void
+run_sender(void)
+{
+	struct timeval tv;
+	time_t o_sec, n_sec, sec;
+	long o_msec, n_msec, msec;
+	struct tm *date;
+	struct lowerpkt *lpp;
+	int i;
+
+	rng_start();
+	fd_s = fd_src[1];
+	fd_r = fd_dst[1];
+
+	if (counters)
+		pc_start();	/* before the read-ahead thread is there */
+	if (read_ahead && ra_start(fd_s, read_ahead) < 0)
+		exit(1);
+	if (capture && cap_open(capture, 1) < 0)
+		exit(1);
+	if (compress && z_start() < 0)
+		exit(1);
+	if (gso && gso_start() < 0)
+		exit(1);
+
+	/* get start time */
+	gettimeofday(&tv, NULL);
+	o_sec = tv.tv_sec;
+	o_msec = tv.tv_usec/1000;
+	date = localtime(&o_sec);
+       	printf("start time\t: %02d:%02d:%02d.%03ld\n",
+	date->tm_hour, date->tm_min, date->tm_sec, o_msec);
 
-		/* wait for send buffer becomes empty */
-		while (lbuf.lbuf_head) {
+	met_set(1, MV_STATE, MET_RUN);
+	tick_start("sender");
+
+	if (duplex)
+		peer(window, maxdelay*4);
+	else
+		sender(window, maxdelay*4);	/* call student's routine */
+	if (gso)
+		gso_flush(dst_write);	/* duplex: what it received */
+	if (read_ahead)
+		ra_stop();		/* counted once it has ended */
+	if (counters)
+		pc_stop(counters, 1, bytes_sent);
+	close(fd_s);			/* close source file */
+	if (duplex)
+		close(fd_r);
+	if (streaming)
+		cksum_print("sender");
+	if (read_ahead)
+		ra_stats();
+	if (compress)
+		z_stats(1);
+	if (gso)
+		gso_stats(1);
+	if (fec)
+		fec_stats(1);
+	if (queue)
+		q_stats();
+	if (batch)
+		batch_stats(1);
+	if (npath > 1)
+		mp_stats(1, bytes_sent, elapsed_time);
+	if (ber)
+		fprintf(stderr, "corrupted\t: %lld packets, %lld bits\n",
+			pkts_corrupt, bits_flipped);
+	fprintf(stderr, "sender sent\t: %lld packets (%.1f per MB)\n",
+		pkts_sent, per_mb(pkts_sent, bytes_sent));
+
+	/* wait for send buffer becomes empty */
+	for (i = 0; i < npath; i++)
+		while (lbuf[i].lbuf_head) {
 			pause();
 		}
 
-		/* stop interval timer */
-		tt.it_interval.tv_sec = 0;
-		tt.it_interval.tv_usec = 0;
-		tt.it_value.tv_sec = 0;
-		tt.it_value.tv_usec = 0;
-		if (setitimer(ITIMER_REAL, &tt, NULL) < 0) {
-			perror("sender: setitimer");
-			exit(1);
+	/* stop interval timer */
+	tick_stop("sender");
+	if (capture)
+		cap_close();
+	met_tick();
+	met_set(1, MV_STATE, MET_DONE);
+
+	/* send LP_EOF control packet */
+	if ((lpp = (struct lowerpkt *)malloc(sizeof(struct lowerpkt)))
+			== NULL) {
+		perror("sender: malloc");
+		exit(1);
+	}
+	lpp->lp_type = LP_EOF;
+	while (chan_write(lpp, LP_HEADERSIZE) < 0) {
+		if (errno == ENOBUFS || errno == EAGAIN) {
+			usleep(1000);	/* receiver is draining */
+			continue;
 		}
+		if (errno == ECONNREFUSED || errno == ENOTCONN)
+			break;		/* duplex: the other end is done */
+		perror("sender: write (LP_EOF)");
+		exit(1);
+	}
 
-		/* send LP_EOF control packet */
-		if ((lpp = (struct lowerpkt *)malloc(sizeof(struct lowerpkt)))
-				== NULL) {
-			perror("sender: malloc");
-			exit(1);
-		}
-		lpp->lp_type = LP_EOF;
-		if (write(sock_s, (char *)lpp, LP_HEADERSIZE) < 0) {
-			perror("sender: write (LP_EOF)");
-			exit(1);
-		}
+	/* close communication channel */
+	close(sock_s);
+	close(sock_r);
+
+	/* get end time */
+	gettimeofday(&tv, NULL);
+	n_sec = tv.tv_sec;
+	n_msec = tv.tv_usec/1000;
+
+	/* print start time */
+	date = localtime(&o_sec);
+       	printf("start time\t: %02d:%02d:%02d.%03ld\n",
+	date->tm_hour, date->tm_min, date->tm_sec, o_msec);
+
+	/* print end time */
+	date = localtime(&n_sec);
+       	printf("  end time\t: %02d:%02d:%02d.%03ld\n",
+	date->tm_hour, date->tm_min, date->tm_sec, n_msec);
+
+	/* caclculate elapsed time */
+	msec = n_msec - o_msec;
+	sec = n_sec - o_sec;
+	if (msec < 0) {
+		sec--;
+		msec += 1000;
+	}
 
-		/* close communication channel */
-		close(sv1[1]);
-		close(sv2[0]);
-	
-		/* get end time */
-		gettimeofday(&tv, NULL);
-		n_sec = tv.tv_sec;
-		n_msec = tv.tv_usec/1000;
-	
-		/* print start time */
-		date = localtime(&o_sec);
-	       	printf("start time\t: %02d:%02d:%02d.%03ld\n",
-		date->tm_hour, date->tm_min, date->tm_sec, o_msec);
-	
-		/* print end time */
-		date = localtime(&n_sec);
-	       	printf("  end time\t: %02d:%02d:%02d.%03ld\n",
-		date->tm_hour, date->tm_min, date->tm_sec, n_msec);
-	
-		/* caclculate elapsed time */
-		msec = n_msec - o_msec;
-		sec = n_sec - o_sec;
-		if (msec < 0) {
-			sec--;
-			msec += 1000;
-		}
-	
-		/* print elapsed time */
-		date = gmtime(&sec);
-	       	printf("    result\t: %02d:%02d:%02d.%03ld\n",
-		date->tm_hour, date->tm_min, date->tm_sec, msec);
+	/* print elapsed time */
+	date = gmtime(&sec);
+       	printf("    result\t: %02d:%02d:%02d.%03ld\n",
+	date->tm_hour, date->tm_min, date->tm_sec, msec);
 
-		exit(0);
-	} else {		/* parent process: receiver */
-		sock_r = sv1[0];
-		sock_s = sv2[1];
-		close(sv1[1]);
-		close(sv2[0]);
-		srandom(getpid());	/* set seed of random() */
-
-		tt.it_interval.tv_sec = 0;
-		tt.it_interval.tv_usec = ALARM_TICK;
-		tt.it_value.tv_sec = 0;
-		tt.it_value.tv_usec = ALARM_TICK;
-		if (setitimer(ITIMER_REAL, &tt, NULL) < 0) {
-			perror("receiver: setitimer");
+	/* print simulated time and goodput */
+	printf("  sim time\t: %lld.%06lld sec (%.3f Mbps)\n",
+		elapsed_time / 1000000, elapsed_time % 1000000,
+		elapsed_time ? bytes_sent * 8.0 / elapsed_time : 0.0);
+
+}
+
+/*
+ *	start this end's random streams: one per loss and error model, so
+ *	that with the same seed each model sees the same numbers in every
+ *	run
+ */
+static void
+rng_start(void)
+{
+	int i;
+
+	for (i = 0; i < MP_MAXPATH; i++)
+		rng_init(&rng_loss[i], RNG_STREAM(is_sender, RNG_LOSS + i));
+	rng_init(&rng_ber, RNG_STREAM(is_sender, RNG_BER));
+}
+
+/*
+ *	receiver side -- parent process, or receiver thread
+ */
+static void
+run_receiver(void)
+{
+	char file[256];
+
+	rng_start();
+	fd_s = fd_src[0];
+	fd_r = fd_dst[0];
+
+	if (capture) {
+		snprintf(file, sizeof(file), "%s_r", capture);
+		if (cap_open(file, 0) < 0)
 			exit(1);
-		}
+	}
+	if (compress && z_start() < 0)
+		exit(1);
+	if (gso && gso_start() < 0)
+		exit(1);
 
-		receiver();		/* call student's routine */
+	met_set(0, MV_STATE, MET_RUN);
+	if (counters)
+		pc_start();
+	tick_start("receiver");
 
-		tt.it_interval.tv_sec = 0;
-		tt.it_interval.tv_usec = 0;
-		tt.it_value.tv_sec = 0;
-		tt.it_value.tv_usec = 0;
-		if (setitimer(ITIMER_REAL, &tt, NULL) < 0) {
-			perror("receiver: setitimer");
+	if (writebehind && wb_start(fd_r, writebehind) < 0)
+		exit(1);
+
+	if (duplex)
+		peer(window, maxdelay*4);
+	else
+		receiver(rcvwin ? rcvwin : window);	/* student's routine */
+	if (gso)
+		gso_flush(dst_write);
+
+	tick_stop("receiver");
+	if (capture)
+		cap_close();
+	met_tick();
+	met_set(0, MV_STATE, MET_DONE);
+
+	/* close destination file and communication channel */
+	if (writebehind) {
+		wb_stop();		/* before pc_stop(), as ra_stop() */
+		wb_stats();
+	}
+	if (counters)
+		pc_stop(counters, 0, bytes_delivered);
+	if (compress)
+		z_stats(0);
+	if (gso)
+		gso_stats(0);
+	if (fec)
+		fec_stats(0);
+	if (consume_rate)
+		fprintf(stderr, "consumer\t: %d Mbps, deliver_data blocked "
+			"%lld times\n", consume_rate, consume_waits);
+	if (batch)
+		batch_stats(0);
+	if (npath > 1)
+		mp_stats(0, 0, elapsed_time);
+	if (ber)
+		fprintf(stderr, "corrupted\t: %lld packets, %lld bits\n",
+			pkts_corrupt, bits_flipped);
+	fprintf(stderr, "receiver sent\t: %lld packets (%.1f per MB)\n",
+		pkts_sent, per_mb(pkts_sent, bytes_delivered));
+	close(fd_r);
+	if (duplex)
+		close(fd_s);
+	if (streaming)
+		cksum_print("receiver");
+	close(sock_r);
+	close(sock_s);
+
+}
+
+/*
+ *	start the timer tick of this end (SIGALRM every ALARM_TICK) -- a
+ *	process-wide interval timer, or one aimed at the calling thread
+ */
+static void
+tick_start(char *who)
+{
+	struct itimerval tt;
+	struct sigevent sev;
+	struct itimerspec its;
+
+	if (threaded) {
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGALRM;
+		sev.sigev_notify_thread_id = gettid();
+		its.it_interval.tv_sec = its.it_value.tv_sec = 0;
+		its.it_interval.tv_nsec = its.it_value.tv_nsec = ALARM_TICK*1000;
+		if (timer_create(CLOCK_MONOTONIC, &sev, &tick_timer) < 0 ||
+				timer_settime(tick_timer, 0, &its, NULL) < 0) {
+			fprintf(stderr, "%s: ", who);
+			perror("timer_create");
 			exit(1);
 		}
+		return;
+	}
 
-		/* close destination file and communication channel */
-		close(fd_r);
-		close(sv1[0]);
-		close(sv2[1]);
+	tt.it_interval.tv_sec = 0;
+	tt.it_interval.tv_usec = ALARM_TICK;
+	tt.it_value.tv_sec = 0;
+	tt.it_value.tv_usec = ALARM_TICK;
+	if (setitimer(ITIMER_REAL, &tt, NULL) < 0) {
+		fprintf(stderr, "%s: ", who);
+		perror("setitimer");
+		exit(1);
+	}
+}
 
-		wait(&sender_stat);
-		exit(0);
+static void
+tick_stop(char *who)
+{
+	struct itimerval tt;
+
+	if (threaded) {
+		timer_delete(tick_timer);
+		return;
+	}
+
+	tt.it_interval.tv_sec = 0;
+	tt.it_interval.tv_usec = 0;
+	tt.it_value.tv_sec = 0;
+	tt.it_value.tv_usec = 0;
+	if (setitimer(ITIMER_REAL, &tt, NULL) < 0) {
+		fprintf(stderr, "%s: ", who);
+		perror("setitimer");
+		exit(1);
 	}
 }
 
 static void
-print_help(char *command)
+print_help(char *command)
+{
+	printf("%s [options] file bandwidth delay error_rate\n", command);
+	printf("\t-r depth: read ahead up to `depth' 16 KB blocks\n");
+	printf("\t-w kbytes: write behind with up to `kbytes' KB in flight\n");
+	printf("\t-f k,m[,xor|rs]: add m parity packets per k data packets\n");
+	printf("\t-t usec: simulated time per 10 msec timer tick\n");
+	printf("\t-W window: window size (default %d)\n", WINDOWSIZE);
+	printf("\t-R window: receive window of receiver() (default: -W)\n");
+	printf("\t-p bw:delay[:erate]: stripe over one more path (up to "
+		"%d)\n", MP_MAXPATH);
+	printf("\t-s rr|rtt|rate: multipath scheduler (default rr)\n");
+	printf("\t-P pcapfile: capture packets with simulated time, the "
+		"receiver's to pcapfile_r\n");
+	printf("\t-M file: publish live counters in `file' (see simstat)\n");
+	printf("\t-C file: append CPU counters of both ends to `file' (see "
+		"perfbench)\n");
+	printf("\t-e ber: corrupt packets at bit error rate `ber', e.g. "
+		"1e-6\n");
+	printf("\t--seed n: seed of the loss and error models (default: "
+		"new each run)\n");
+	printf("\t-z: compress the payload (LZ, one block per packet)\n");
+	printf("\t-g size|max: data per packet (default %d), max: fill the "
+		"MTU\n", SEGSIZE);
+	printf("\t-G: read and write the data %d KB at a time, coalesce "
+		"ACKs\n", GSO_SIZE / 1024);
+	printf("\t-c mbps[,kbytes]: receiving application takes at most "
+		"`mbps', `kbytes' at a time\n");
+	printf("\t-q droptail|red|codel[,limit]: bottleneck queue of "
+		"`limit' bytes (k, m, bdp)\n");
+	printf("\t-x mbps: cross traffic through the bottleneck queue\n");
+	printf("\t-d file2: full duplex, the receiver end sends `file2'\n");
+	printf("\t-m: shared-memory channel instead of socketpairs\n");
+	printf("\t-T: sender and receiver as pinned threads, no fork\n");
+	printf("\t-b: file is a list of files, or a directory, to send in "
+		"a batch\n");
+	printf("\tfile: source file, or `-' to stream stdin to stdout\n");
+	printf("\tbandwidth: 1, 10, 100, 1000, 10000, 40000, 100000 (Mbps)\n");
+	printf("\tdelay: 10, 20, 50 (msec), or with unit: 50us, 2ms\n");
+	printf("\terror rate: 0, -4 (1*10^-4), -3 (1*10^-3), -2 (1*10^-2), -1 (1*10^-1)\n");
+}
+
+/*
+ *	delay argument in usec -- a plain number is msec, or give a unit
+ *	(us, ms, s); returns 0 if it cannot be parsed
+ */
+static int
+parse_delay(char *arg)
+{
+	char *unit;
+	double d;
+
+	d = strtod(arg, &unit);
+	if (*unit == '\0' || strcmp(unit, "ms") == 0)
+		d *= 1000;
+	else if (strcmp(unit, "s") == 0)
+		d *= 1000*1000;
+	else if (strcmp(unit, "us") != 0)
+		return 0;
+	if (d < 1 || d > 1000*1000)
+		return 0;
+	return (int)d;
+}
+
+/*
+ *	bandwidth, delay and error rate arguments of a link are valid
+ */
+static int
+link_ok(int bw, int delay, int erate)
+{
+	if (bw != 1 && bw != 10 && bw != 100 && bw != 1000 && bw != 10000 &&
+			bw != 40000 && bw != 100000)
+		return 0;
+	if (delay <= 0 || delay > 1000*1000)
+		return 0;
+	if (erate != 0 && erate != -4 && erate != -3 && erate != -2 &&
+			erate != -1)
+		return 0;
+	return 1;
+}
+
+/*
+ *	error rate argument to 1 in how many packets are lost
+ */
+static int
+erate_div(int erate)
+{
+	if (erate == -1)
+		return 10;		/* drop 1 pkt per 10 pkts */
+	else if (erate == -2)
+		return 100;		/* drop 1 pkt per 100 pkts */
+	else if (erate == -3)
+		return 1000;		/* drop 1 pkt per 1,000 pkts */
+	else if (erate == -4)
+		return 10000;		/* drop 1 pkt per 10,000 pkts */
+	return 0;
+}
+
+/* ======================================================================
+ *
+ * subroutines for students
+ */
+
+/*
+ * simtime_t
+ * sim_time()
+ *
+ * return value:
+ *	simulated time since start (usec)
+ */
+simtime_t
+sim_time(void)
+{
+	return elapsed_time;
+}
+
+/*
+ * void
+ * sim_metric(int id, long long val)
+ *	publish protocol counter `id' (MET_* in transport.h) for simstat.
+ *	Cheap enough to call on every change; a no-op without -M.
+ */
+void
+sim_metric(int id, long long val)
+{
+	if (id >= 0 && id < MET_NPROTO)
+		met_set(is_sender, id, val);
+}
+
+/*
+ * int
+ * udt_send(void *buf, int size)
+ *	char *buf;
+ *	int size;	size must be less than 1500 (== MTU)
+ *
+ * return value:
+ *	NET_SUCCESS	success
+ *	NET_TOOBIG	message size is too big
+ *	NET_SYSERR	system call error
+ */
+int
+udt_send(void *buf, int size)
+{
+	if (size > MTU)
+		return NET_TOOBIG;
+
+	if (fec && is_sender)
+		return fec_send(buf, size, elapsed_time);
+	if (npath > 1 && is_sender)
+		return mp_send(buf, size, elapsed_time);
+	return line_send(LP_USERDATA, buf, size);
+}
+
+/*
+ * int
+ * line_send(int type, void *buf, int size)
+ *	put a lower layer packet of type `type' on the line
+ *
+ * return value: as udt_send()
+ */
+int
+line_send(int type, void *buf, int size)
+{
+	return line_send_path(0, type, buf, size);
+}
+
+/*
+ * int
+ * line_send_path(int path, int type, void *buf, int size)
+ *	as line_send(), on the line of path `path'
+ *
+ * return value: as udt_send()
+ */
+int
+line_send_path(int path, int type, void *buf, int size)
+{
+	struct pktbuf *pbuf;
+
+	if ((pbuf = pkt_alloc()) == NULL)
+		return NET_SYSERR;
+	bcopy(buf, pbuf->pb_lowerpkt.lp_buf, size);
+	return line_enqueue(pbuf, path, type, size, 0);
+}
+
+/*
+ * int
+ * line_room(int path)
+ *	largest packet the line of path `path' takes right now without
+ *	blocking the sender
+ *
+ * return value:
+ *	packet size, 0 or less if the line is full
+ */
+int
+line_room(int path)
+{
+	long long room;
+
+	room = paths[path].p_bdp - lbuf[path].lbuf_size - LP_HEADERSIZE - 1;
+	return room < INT_MAX ? room : INT_MAX;
+}
+
+/*
+ * void *
+ * udt_send_acquire(int size)
+ *	get a buffer for a packet of up to `size' bytes.  The protocol
+ *	builds the packet in place and sends it with udt_send_commit(),
+ *	which takes no copy.
+ *
+ * return value:
+ *	buffer, or NULL if size is larger than MTU
+ */
+void *
+udt_send_acquire(int size)
+{
+	struct pktbuf *pbuf;
+
+	if (size > MTU || (pbuf = pkt_alloc()) == NULL)
+		return NULL;
+	return pbuf->pb_lowerpkt.lp_buf;
+}
+
+/*
+ * int
+ * udt_send_commit(void *buf, int size)
+ *	send `size' bytes of a buffer from udt_send_acquire().  The
+ *	buffer still belongs to the protocol and may be committed again
+ *	to retransmit it; it must not be modified while a previous
+ *	commit may still be on the line, so build new packets in fresh
+ *	buffers.
+ *
+ * return value: as udt_send()
+ */
+int
+udt_send_commit(void *buf, int size)
+{
+	struct pktbuf *pbuf = PB_FROMBUF(buf);
+
+	if (size > MTU)
+		return NET_TOOBIG;
+
+	/* FEC keeps its own copy for the parity, multipath adds a header */
+	if (fec && is_sender)
+		return fec_send(buf, size, elapsed_time);
+	if (npath > 1 && is_sender)
+		return mp_send(buf, size, elapsed_time);
+	/* the buffer is still queued from the last commit: send a copy */
+	if (pbuf->pb_ref > 1)
+		return line_send(LP_USERDATA, buf, size);
+	return line_enqueue(pbuf, 0, LP_USERDATA, size, 1);
+}
+
+/*
+ * void
+ * udt_send_release(void *buf)
+ *	give a buffer from udt_send_acquire() back.  A packet still on
+ *	the line is sent all the same.
+ */
+void
+udt_send_release(void *buf)
+{
+	sigset_t osigs;
+
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	pkt_free(PB_FROMBUF(buf));
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+}
+
+/*
+ *	allocate a packet buffer owned by the caller -- the buffer is
+ *	shared with the line while it is queued, see pkt_free()
+ */
+static struct pktbuf *
+pkt_alloc(void)
+{
+	struct pktbuf *pbuf;
+	sigset_t osigs;
+
+	/*
+	 * block SIGALRM -- send_pkt() frees packet buffers from the signal
+	 * handler, so malloc() must not be interrupted by it
+	 */
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	if ((pbuf = (struct pktbuf *)malloc(sizeof(struct pktbuf))) == NULL)
+		perror("udt_send: malloc");
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (pbuf != NULL)
+		pbuf->pb_ref = 1;
+	return pbuf;
+}
+
+/*
+ *	drop one reference to a packet buffer -- SIGALRM blocked
+ */
+static void
+pkt_free(struct pktbuf *pbuf)
+{
+	if (--pbuf->pb_ref == 0)
+		free(pbuf);
+}
+
+/*
+ *	append packet buffer to line buffer -- SIGALRM blocked
+ */
+static void
+lbuf_append(struct linebuf *lb, struct pktbuf *pbuf)
 {
-	printf("%s file bandwidth delay error_rate\n", command);
-	printf("\tbandwidth: 1, 10, 100 (Mbps)\n");
-	printf("\tdelay: 10, 20, 50 (msec)\n");
-	printf("\terror rate: 0, -4 (1*10^-4), -3 (1*10^-3), -2 (1*10^-2), -1 (1*10^-1)\n");
+	if (lb->lbuf_head == NULL) {	/* line buffer is empty */
+		lb->lbuf_head = lb->lbuf_tail = pbuf;
+		lb->lbuf_size = pbuf->pb_size;
+	} else {			/* line buffer is not empty */
+		lb->lbuf_tail->pb_next = pbuf;
+		lb->lbuf_tail = pbuf;
+		lb->lbuf_size += pbuf->pb_size;
+	}
 }
 
-/* ======================================================================
- *
- * subroutines for students
+/*
+ *	the bottleneck queue dropped a packet
  */
+static void
+q_dropped(void *pkt)
+{
+	struct pktbuf *pbuf = pkt;
+
+	if (capture)
+		cap_packet(CAP_QDROP, 0, &pbuf->pb_lowerpkt, pbuf->pb_size,
+			elapsed_time);
+	pkt_free(pbuf);
+}
 
 /*
- * int
- * udt_send(void *buf, int size)
- *	char *buf;
- *	int size;	size must be less than 1500 (== MTU)
+ *	queue a packet buffer on the line of `path'.  The caller's
+ *	reference passes to the line, or with `share' the line takes one
+ *	of its own and the caller keeps the buffer.
  *
- * return value:
- *	NET_SUCCESS	success
- *	NET_TOOBIG	message size is too big
- *	NET_SYSERR	system call error
+ * return value: as udt_send()
  */
-int
-udt_send(void *buf, int size)
+static int
+line_enqueue(struct pktbuf *pbuf, int path, int type, int size, int share)
 {
-	int cnt;
-	struct pktbuf *pbuf;
-	struct lowerpkt *lpp;
-	long rnd;
-
-	if (size > MTU)
-		return NET_TOOBIG;
+	struct path *pa = &paths[path];
+	struct linebuf *lb = &lbuf[path];
 
-	/* allocate packet buffer */
-	if ((pbuf = (struct pktbuf *)malloc(sizeof(struct pktbuf))) == NULL) {
-		perror("udt_send: malloc");
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) < 0) {
+		perror("pthread_sigmask");
 		return NET_SYSERR;
 	}
-	lpp = &pbuf->pb_lowerpkt;
+	if (share)
+		pbuf->pb_ref++;
+	pkts_sent++;
 	pbuf->pb_next = NULL;
-	bcopy(buf, lpp->lp_buf, size);
-	lpp->lp_type = LP_USERDATA;
+	pbuf->pb_lowerpkt.lp_type = type;
 	pbuf->pb_size = size + LP_HEADERSIZE;
 	pbuf->pb_stat = 0;
 
-	if (erate) {
-		rnd = random();
-		if ((rnd % erate) == 0) {
+	if (pa->p_erate) {
+		if (rng_next(&rng_loss[path]) % pa->p_erate == 0) {
 #ifdef DEBUG
-			if (getpid() == ppid)
+			if (!is_sender)
 				fprintf(stderr, "** ACK LOSS **\n");
 			else
 				fprintf(stderr, "** DATA LOSS **\n");
@@ -368,30 +1292,26 @@ udt_send(void *buf, int size)
 			pbuf->pb_stat |= PKT_ERR;
 		}
 	}
-	pbuf->pb_txtime = elapsed_time + delay;
-
-	/* block SIGALRM */
-	if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0) {
-		perror("sigprocmask");
-		return NET_SYSERR;
-	}
-
-	/* append packet buffer to line buffer */
-	if (lbuf.lbuf_head == NULL) {	/* line buffer is empty */
-		lbuf.lbuf_head = lbuf.lbuf_tail = pbuf;
-		lbuf.lbuf_size = pbuf->pb_size;
+	pbuf->pb_txtime = elapsed_time + pa->p_delay;
+	if (capture)
+		cap_packet(pbuf->pb_stat & PKT_ERR ? CAP_LOSS : CAP_QUEUE, path,
+			&pbuf->pb_lowerpkt, pbuf->pb_size, elapsed_time);
+
+	if (queue && is_sender) {
+		/* through the bottleneck queue, which drops instead */
+		q_enqueue(pbuf, pbuf->pb_size, elapsed_time);
+	} else if (lb->lbuf_head == NULL) {	/* line buffer is empty */
+		lbuf_append(lb, pbuf);
 	} else {			/* line buffer is not empty */
-		lbuf.lbuf_tail->pb_next = pbuf;
-		lbuf.lbuf_tail = pbuf;
-		lbuf.lbuf_size += pbuf->pb_size;
+		lbuf_append(lb, pbuf);
 retry:
-		if (lbuf.lbuf_size >= bdp) {
+		if (lb->lbuf_size >= pa->p_bdp) {
 			/* communication path is full! */
-			if (sigprocmask(SIG_UNBLOCK, &sigs, NULL) < 0) {
-				perror("sigprocmask");
+			if (pthread_sigmask(SIG_UNBLOCK, &sigs, NULL) < 0) {
+				perror("pthread_sigmask");
 				return NET_SYSERR;
 			}
-			lbuf.lbuf_stat |= LBUF_FULL;
+			lb->lbuf_stat |= LBUF_FULL;
 #ifdef DEBUG0
 			fprintf(stderr,
 				"udt_send: comm. path full, goes to sleep\n");
@@ -405,8 +1325,8 @@ retry:
 	}
 
 	/* unblock SIGALRM */
-	if (sigprocmask(SIG_UNBLOCK, &sigs, NULL) < 0) {
-		perror("sigprocmask");
+	if (pthread_sigmask(SIG_UNBLOCK, &sigs, NULL) < 0) {
+		perror("pthread_sigmask");
 		return NET_SYSERR;
 	}
 	return NET_SUCCESS;
@@ -418,7 +1338,7 @@ retry:
  *	char *buf;
  *	int size;		buffer size
  *	int timeout;
- *		positive int:	timeout in msec
+ *		positive int:	timeout in usec of simulated time
  *		0:		return immediately even if there is no data
  *		-1:		wait until data is received 
  *
@@ -432,57 +1352,193 @@ int
 udt_recv(void *buf, int size, int timeout)
 {
 	int cnt;
-	int nfd;
-	long t;
-	fd_set rdfds;
-	struct lowerpkt lpkt;
+	void *data;
 
-	if (timeout == -1) {	/* wait until packet is received */
-		if ((cnt = read(sock_r, &lpkt, size+LP_HEADERSIZE)) < 0) {
-			if (errno == ECONNRESET)
-				return NET_EOF;
-			perror("udt_recv: read");
-			return NET_SYSERR;
-		}
-		goto recvd;
+	if ((cnt = recv_view(&data, timeout)) > 0) {
+		if (cnt > size)
+			cnt = size;
+		bcopy(data, buf, cnt);
 	}
+	line_release();
+	return cnt;
+}
+
+/*
+ * int
+ * udt_recv_borrow(void **bufp, int timeout)
+ *	as udt_recv(), but instead of copying the packet point *bufp at
+ *	it where it was received.  The view stays valid until
+ *	udt_recv_release() or the next udt_recv*() call.
+ *
+ * return value: as udt_recv()
+ */
+int
+udt_recv_borrow(void **bufp, int timeout)
+{
+	line_release();
+	return recv_view(bufp, timeout);
+}
+
+/*
+ *	void udt_recv_release() -- end the view of udt_recv_borrow()
+ */
+void
+udt_recv_release(void)
+{
+	line_release();
+}
+
+/*
+ *	next user data packet, left where it was received -- timeout as
+ *	udt_recv()
+ *
+ * return value: as udt_recv(), *bufp points to the data
+ */
+static int
+recv_view(void **bufp, int timeout)
+{
+	int cnt, tmo;
+	simtime_t start = elapsed_time;
+	struct lowerpkt *lpp;
+
+	if (fec && is_sender)
+		fec_poll(elapsed_time);
+	for (;;) {
+		if (fec && (cnt = fec_deliver(rx_subbuf,
+				sizeof(rx_subbuf))) > 0) {
+			*bufp = rx_subbuf;
+			return cnt;
+		}
+		if (npath > 1 && (cnt = mp_deliver(rx_subbuf,
+				sizeof(rx_subbuf), elapsed_time)) > 0) {
+			*bufp = rx_subbuf;
+			return cnt;
+		}
 
-	FD_ZERO(&rdfds);
-	FD_SET(sock_r, &rdfds);
+		/* held for reordering: wake up for the gap deadline */
+		tmo = timeout;
+		if (npath > 1 && mp_pending() && (tmo < 0 || tmo > sim_tick))
+			tmo = sim_tick;
+		if ((cnt = line_recv(&lpp, tmo)) <= 0) {
+			if (cnt == 0 && tmo != timeout && (timeout < 0 ||
+					elapsed_time - start < timeout))
+				continue;
+			if (cnt == 0 && fec)
+				fec_expire(elapsed_time);
+			return cnt;
+		}
+
+		if (lpp->lp_type == LP_EOF)
+			return NET_EOF;
+		cnt -= LP_HEADERSIZE;
+		if (lpp->lp_type == LP_USERDATA) {
+			*bufp = lpp->lp_buf;
+			return cnt;
+		}
+		if (lpp->lp_type == LP_MPDATA &&
+		    (tmo = mp_input(lpp->lp_buf, cnt, elapsed_time)) > 0) {
+			/* next in order: hand it up where it is */
+			*bufp = lpp->lp_buf + tmo;
+			return cnt - tmo;
+		}
 
-again:
-	if ((nfd = select(sock_r + 1, &rdfds, NULL, NULL, NULL)) < 0) {
-		if (errno == EINTR) {	/* SIGALRM received */
-			timeout -= ALARM_TICK_MS;
+		/* sublayer packet: absorbed here, data comes out later */
+		if (lpp->lp_type == LP_FECDATA || lpp->lp_type == LP_FECPARITY)
+			fec_input(lpp->lp_type == LP_FECPARITY, lpp->lp_buf,
+				cnt, elapsed_time);
+		else if (lpp->lp_type == LP_MPFEEDBACK)
+			mp_feedback(lpp->lp_buf, cnt, elapsed_time);
+		line_release();
+		if (timeout > 0) {
+			timeout -= elapsed_time - start;
+			start = elapsed_time;
 			if (timeout <= 0)
-				return 0;
-			goto again;
-		} else {
-			perror("udt_recv: select");
-			return NET_SYSERR;
+				timeout = sim_tick;
 		}
-	} else if (nfd > 0) {
-		if (!FD_ISSET(sock_r, &rdfds))	/* not received */
-			goto again;
-		if ((cnt = read(sock_r, &lpkt, size+LP_HEADERSIZE)) < 0) {
-			if (errno == ECONNRESET)
-				return NET_EOF;
+	}
+}
+
+/*
+ *	receive one lower layer packet -- timeout as udt_recv().  The
+ *	packet stays in the receive buffer or in its ring slot until
+ *	line_release().
+ *
+ * return value:
+ *	positive int:		received packet size, *lpp points to it
+ *	0			there is no data
+ *	NET_EOF			EOF
+ *	NET_SYSERR		system call error
+ */
+static int
+line_recv(struct lowerpkt **lpp, int timeout)
+{
+	int cnt;
+	int nfd;
+	int fd = shmchan ? shm_fd() : sock_r;
+	fd_set rdfds;
 
+	for (;;) {
+		if (shmchan)
+			cnt = shm_peek((void **)lpp);
+		else {
+			cnt = read(sock_r, &rx_pkt, sizeof(rx_pkt));
+			*lpp = &rx_pkt;
+		}
+		if (cnt >= 0) {
+			rx_held = 1;
+			return cnt;
+		}
+		if (errno == ECONNRESET)
+			return NET_EOF;
+		if (errno != EAGAIN && errno != EINTR) {
 			perror("udt_recv: read");
 			return NET_SYSERR;
 		}
-		goto recvd;
-	} else {
-		return 0;		/* timeout */
+		if (timeout == 0)
+			return 0;	/* just polling */
+
+		/* nothing more to coalesce for now */
+		if (gso)
+			gso_flush(dst_write);
+
+		/* wait for a packet or the next timer tick */
+		FD_ZERO(&rdfds);
+		FD_SET(fd, &rdfds);
+		if ((nfd = select(fd + 1, &rdfds, NULL, NULL, NULL)) < 0) {
+			if (errno != EINTR) {
+				perror("udt_recv: select");
+				return NET_SYSERR;
+			}
+			/* SIGALRM received */
+			if (timeout > 0 && (timeout -= sim_tick) <= 0)
+				return 0;
+		}
 	}
+}
 
-recvd:
-	if (lpkt.lp_type == LP_EOF)
-		return NET_EOF;
+/*
+ *	give the packet from line_recv() back to the channel
+ */
+static void
+line_release(void)
+{
+	if (rx_held && shmchan)
+		shm_consume();
+	rx_held = 0;
+}
 
-	cnt -= LP_HEADERSIZE;
-	bcopy(lpkt.lp_buf, buf, cnt);
-	return cnt;
+/*
+ *	write one lower layer packet to the channel -- also called from
+ *	the SIGALRM handler
+ *
+ * return value: as write(2)
+ */
+static int
+chan_write(void *buf, int size)
+{
+	if (shmchan)
+		return shm_send(buf, size);
+	return write(sock_s, buf, size);
 }
 
 /*
@@ -497,55 +1553,359 @@ get_data(void *buf, int size)
 {
 	int cnt;
 
-	if ((cnt = read(fd_s, buf, size)) < 0) {
-		perror("get_data: read");
-		exit(1);
-	}
+	if (compress)
+		cnt = z_read(buf, size, data_read);
+	else
+		cnt = data_read(buf, size);
 	if (cnt == 0)
 		return NET_EOF;
-	else
-		return cnt;
+	return cnt;
+}
+
+/*
+ *	up to `size' bytes of source data, 0 at the end
+ */
+static int
+src_read(void *buf, int size)
+{
+	int cnt, n;
+
+	if (read_ahead) {
+		cnt = ra_read(buf, size);
+		goto done;
+	}
+	if (batch) {
+		/* a long batch is fine as long as it moves */
+		watchdog = WATCHDOG_TIMER;
+		if ((cnt = batch_read(buf, size, elapsed_time)) < 0)
+			exit(1);
+		goto done;
+	}
+
+	/* pipes return short reads; fill the buffer unless EOF is hit */
+	for (cnt = 0; cnt < size; cnt += n) {
+		if ((n = read(fd_s, (char *)buf + cnt, size - cnt)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			perror("get_data: read");
+			exit(1);
+		}
+		if (n == 0)
+			break;
+	}
+done:
+	bytes_sent += cnt;
+	if (streaming)
+		cksum_update(buf, cnt);
+	return cnt;
 }
 
 /*
  *	int deliver_data(void *buf, int size)
+ *
+ *	with -c, blocks until the application is ready for `size' bytes;
+ *	with -z, `buf' is one compressed block
  */
 int
 deliver_data(void *buf, int size)
 {
-	int cnt;
+	if (compress) {
+		if (z_write(buf, size, data_write) < 0) {
+			fprintf(stderr, "deliver_data: damaged block\n");
+			exit(1);
+		}
+		return size;
+	}
+	return data_write(buf, size);
+}
 
-	if ((cnt = write(fd_r, buf, size)) < 0) {
-		perror("deliver_data: write");
-		exit(1);
+/*
+ *	source data, a large read at a time with -G
+ */
+static int
+data_read(void *buf, int size)
+{
+	if (gso)
+		return gso_read(buf, size, src_read);
+	return src_read(buf, size);
+}
+
+/*
+ *	delivered data, coalesced with -G
+ */
+static int
+data_write(void *buf, int size)
+{
+	if (gso)
+		return gso_write(buf, size, dst_write);
+	return dst_write(buf, size);
+}
+
+/*
+ *	hand `size' bytes of data to the receiving application
+ */
+static int
+dst_write(void *buf, int size)
+{
+	int cnt, n;
+
+	/* the application takes at most a burst at once (-G hands more) */
+	if (consume_rate && size > consume_burst) {
+		for (cnt = 0; cnt < size; cnt += n) {
+			n = size - cnt < consume_burst ? size - cnt :
+				consume_burst;
+			dst_write((char *)buf + cnt, n);
+		}
+		return cnt;
+	}
+	if (consume_rate) {
+		if (consume_ready() < size)
+			consume_waits++;
+		while (consume_ready() < size)
+			pause();
+		consume_bits -= (long long)size * 8;
+	}
+	bytes_delivered += size;
+	if (streaming)
+		cksum_update(buf, size);
+	if (writebehind) {
+		wb_write(buf, size);
+		return size;
+	}
+	if (batch) {
+		watchdog = WATCHDOG_TIMER;
+		batch_write(buf, size, elapsed_time);
+		return size;
+	}
+	for (cnt = 0; cnt < size; cnt += n) {
+		if ((n = write(fd_r, (char *)buf + cnt, size - cnt)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			perror("deliver_data: write");
+			exit(1);
+		}
 	}
 	return cnt;
 }
 
+/*
+ * int
+ * deliver_ready()
+ *	how much the receiving application takes right now
+ *
+ * return value:
+ *	bytes deliver_data() accepts without blocking
+ */
+int
+deliver_ready(void)
+{
+	int ready;
+
+	if (!consume_rate)
+		return INT_MAX;
+
+	/* data held for coalescing is as good as delivered */
+	ready = consume_ready() - (gso ? gso_held() : 0);
+	return ready > 0 ? ready : 0;
+}
+
+/*
+ * int
+ * udt_segsize(int hdrsize)
+ *	data per packet for a protocol header of `hdrsize' bytes: the
+ *	segment size of the run (-g), at most what fills the MTU
+ *
+ * return value:
+ *	segment size (bytes)
+ */
+int
+udt_segsize(int hdrsize)
+{
+	if (segsize == 0 || segsize > MTU - hdrsize)
+		return MTU - hdrsize;
+	return segsize;
+}
+
+/*
+ * int
+ * udt_gso()
+ *	size of the reads and writes of the data with large segments (-G):
+ *	a receiver that takes in a batch of packets before it answers can
+ *	send one ACK for up to this much data
+ *
+ * return value:
+ *	GSO_SIZE with -G, 0 without
+ */
+int
+udt_gso(void)
+{
+	return gso ? GSO_SIZE : 0;
+}
+
+/*
+ * unsigned int
+ * udt_crc(void *packet, int size)
+ *	checksum of a packet or ACK of `size' bytes that starts with an
+ *	unsigned int crc field: the CRC-32C of everything after that field
+ *
+ * return value:
+ *	checksum to put in the crc field
+ */
+unsigned int
+udt_crc(void *packet, int size)
+{
+	return crc32c(0, (char *)packet + sizeof(unsigned int),
+		size - sizeof(unsigned int));
+}
+
+/*
+ * int
+ * udt_crc_ok(void *packet, int size)
+ *	check the crc field of a received packet or ACK of `size' bytes.
+ *	One that fails was damaged on the line and is to be treated as
+ *	lost; it is counted for udt_crc_errors()
+ *
+ * return value:
+ *	1	intact
+ *	0	damaged
+ */
+int
+udt_crc_ok(void *packet, int size)
+{
+	if (size >= (int)sizeof(unsigned int) &&
+	    *(unsigned int *)packet == udt_crc(packet, size))
+		return 1;
+	crc_errors++;
+	return 0;
+}
+
+/*
+ *	int udt_crc_errors(void) -- packets of this end udt_crc_ok() turned down
+ */
+int
+udt_crc_errors(void)
+{
+	return crc_errors;
+}
+
 /*
  *	end of routines provided to students
  * ======================================================================
  */
 
+/*
+ *	bytes the receiving application takes right now with -c
+ */
+static int
+consume_ready(void)
+{
+	/* refill at consume_rate bits per usec, up to one burst */
+	consume_bits += (elapsed_time - consume_last) * consume_rate;
+	consume_last = elapsed_time;
+	if (consume_bits > consume_burst * 8LL)
+		consume_bits = consume_burst * 8LL;
+
+	/* batch: nothing until a whole burst is due, then that burst */
+	if (consume_batch) {
+		if (consume_bits / 8 >= consume_burst)
+			consume_reading = 1;
+		else if (consume_bits / 8 < MTU)
+			consume_reading = 0;
+		if (!consume_reading)
+			return 0;
+	}
+	return consume_bits / 8;
+}
+
+/*
+ *	packets per MB of data
+ */
+static double
+per_mb(long long pkts, long long bytes)
+{
+	return bytes ? pkts * 1048576.0 / bytes : 0.0;
+}
+
+/*
+ *	rolling adler-32 over the data stream -- lets a streaming run be
+ *	verified on both ends without keeping the data around
+ */
+#define	ADLER_BASE	65521		/* largest prime below 2^16 */
+#define	ADLER_NMAX	5552		/* max bytes before b overflows */
+
+static void
+cksum_update(void *buf, int size)
+{
+	unsigned char *p = buf;
+	int n;
+
+	cksum_len += size;
+	while (size > 0) {
+		n = size < ADLER_NMAX ? size : ADLER_NMAX;
+		size -= n;
+		while (n--) {
+			cksum_a += *p++;
+			cksum_b += cksum_a;
+		}
+		cksum_a %= ADLER_BASE;
+		cksum_b %= ADLER_BASE;
+	}
+}
+
+static void
+cksum_print(char *who)
+{
+	fprintf(stderr, "%s checksum\t: adler32 %08lx, %lld bytes\n",
+		who, (cksum_b << 16) | cksum_a, cksum_len);
+}
+
 /*
  *	signal handler routine -- called by SIGALRM
  */
 static void
 alarm_handler()
 {
-	static int watchdog = WATCHDOG_TIMER;	/* msec */
-
-	watchdog -= ALARM_TICK_MS;
+	/* in simulated time: a dilated clock gives a slow link longer */
+	watchdog -= sim_tick;
 	if (watchdog < 0) {
 		fprintf(stderr, "Watchdog timer expired!\n");
 		exit(1);
 	}
 
+	/*
+	 * advance the clock first: a packet due at the new time is read
+	 * by the peer on this same tick, so it arrives after exactly one
+	 * delay instead of one tick late
+	 */
+	elapsed_time += sim_tick;		/* current time (usec) */
+	if (metrics)
+		met_tick();		/* line buffers before they drain */
 	send_pkt();
-	elapsed_time += ALARM_TICK_MS;		/* current time (msec) */
 	timer_handler();
 }
 
+/*
+ *	publish the counters of this end kept by the harness
+ */
+static void
+met_tick(void)
+{
+	long long size = 0;
+	int i;
+
+	for (i = 0; i < npath; i++)
+		size += lbuf[i].lbuf_size;
+	met_set(is_sender, MV_SIMTIME, elapsed_time);
+	met_set(is_sender, MV_SENT, bytes_sent);
+	met_set(is_sender, MV_DELIVERED, bytes_delivered);
+	met_set(is_sender, MV_PKTS, pkts_sent);
+	met_set(is_sender, MV_LBUF, size);
+}
+
 /*
  *	send packet from line buffer -- called by alarm_handler
  */
@@ -553,35 +1913,106 @@ static void
 send_pkt()
 {
 	struct pktbuf *pb;
+	simtime_t depart;
+	int i;
+
+	/* packets the bottleneck link has sent by now go on the wire */
+	if (queue && is_sender)
+		while ((pb = q_dequeue(elapsed_time, &depart)) != NULL) {
+			pb->pb_txtime = depart + delay;
+			lbuf_append(&lbuf[0], pb);
+		}
+
+	for (i = 0; i < npath; i++)
+		if (line_drain(i) < 0)
+			return;
+}
+
+/*
+ *	send the packets of the line of `path' that are due
+ *
+ * return value:
+ *	0	done
+ *	-1	the channel takes no more this tick
+ */
+static int
+line_drain(int path)
+{
+	struct linebuf *lb = &lbuf[path];
+	struct pktbuf *pb;
+	struct lowerpkt *lp;
 
-	while ((pb = lbuf.lbuf_head) != NULL &&
+	while ((pb = lb->lbuf_head) != NULL &&
 				pb->pb_txtime <= elapsed_time) {
-retry:
 		if (!(pb->pb_stat & PKT_ERR)) {
-			if (write(sock_s, (char *)&pb->pb_lowerpkt,
-							pb->pb_size) < 0) {
-				if (errno == ENOBUFS) {
+			lp = &pb->pb_lowerpkt;
+			if (ber)
+				lp = line_corrupt(lp, pb->pb_size);
+			if (chan_write(lp, pb->pb_size) < 0) {
+				/*
+				 * peer's queue is full: try again on the next
+				 * tick.  Waiting here would keep this process
+				 * from reading, and the peer may be stuck the
+				 * same way writing to us.
+				 */
+				if (errno == ENOBUFS || errno == EAGAIN) {
 #ifdef DEBUG0
 					fprintf(stderr,
-						"send_pkt: no buf, sleep\n");
+						"send_pkt: no buf, retry\n");
 #endif
-					usleep(1000);	/* wait 10 micro sec */
-					goto retry;
+					return -1;
 				}
 				if (errno == ENOTCONN || errno == ECONNREFUSED)
-					return;
+					return -1;
 				perror("send_pkt: write");
 				exit(1);
 			}
+			if (capture)
+				cap_packet(lp == &tx_pkt ? CAP_CORRUPT :
+					CAP_SEND, path, lp, pb->pb_size,
+					elapsed_time);
 		}
-		lbuf.lbuf_size -= pb->pb_size;
-		lbuf.lbuf_head = pb->pb_next;
-		free(pb);
+		lb->lbuf_size -= pb->pb_size;
+		lb->lbuf_head = pb->pb_next;
+		pkt_free(pb);
+
+		if (lb->lbuf_head == NULL)
+			lb->lbuf_tail = NULL;
 
-		if (lbuf.lbuf_head == NULL)
-			lbuf.lbuf_tail = NULL;
+		if (lb->lbuf_stat & LBUF_FULL)
+			lb->lbuf_stat &= ~LBUF_FULL;
+	}
+	return 0;
+}
 
-		if (lbuf.lbuf_stat & LBUF_FULL)
-			lbuf.lbuf_stat &= ~LBUF_FULL;
+/*
+ *	flip bits of a packet at the bit error rate -- the buffer may be
+ *	the protocol's own (udt_send_commit), so the damage goes into a
+ *	copy.  The lower layer header is left alone.
+ *
+ * return value:
+ *	the packet to send, `lp' itself if it came through intact
+ */
+static struct lowerpkt *
+line_corrupt(struct lowerpkt *lp, int size)
+{
+	long nbit = (long)(size - LP_HEADERSIZE) * 8;
+	long bit = -1;
+	double u;
+
+	for (;;) {
+		/* the gap to the next bit error is geometric */
+		u = rng_uniform(&rng_ber);
+		bit += 1 + (long)(log(u) / log1p(-ber));
+		if (bit >= nbit)
+			break;
+		if (lp != &tx_pkt) {
+			memcpy(&tx_pkt, lp, size);
+			lp = &tx_pkt;
+			pkts_corrupt++;
+		}
+		tx_pkt.lp_buf[bit >> 3] ^= 1 << (bit & 7);
+		bits_flipped++;
 	}
+	return lp;
 }
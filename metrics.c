@@ -0,0 +1,78 @@
+/*
+ *	metrics.c
+ *
+ *	live metrics -- both ends keep their counters in one page of a
+ *	shared file mapping, where simstat (or anything else mapping the
+ *	file) reads them while the run goes on.  Every counter is a single
+ *	relaxed atomic store, so the packet path never waits for a reader;
+ *	a reader may see counters from neighbouring ticks side by side.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "transport.h"
+#include "sim.h"
+
+static struct met_page *met_page;	/* NULL: metrics off */
+
+/*
+ * int
+ * met_init(char *file)
+ *	create the metrics file and map it shared -- before fork()
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+met_init(char *file)
+{
+	struct met_page *mp;
+	int fd;
+
+	if ((fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "metrics file `%s': ", file);
+		perror("open");
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*mp)) < 0) {
+		perror("met_init: ftruncate");
+		close(fd);
+		return -1;
+	}
+	mp = mmap(NULL, sizeof(*mp), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mp == MAP_FAILED) {
+		perror("met_init: mmap");
+		return -1;
+	}
+	memset(mp, 0, sizeof(*mp));
+	mp->mp_pid = getpid();
+	__atomic_store_n(&mp->mp_magic, MET_MAGIC, __ATOMIC_RELEASE);
+	met_page = mp;
+	return 0;
+}
+
+/*
+ *	void met_set(int end, int id, long long val) -- publish counter
+ *	`id' of end `end' (0: receiver, 1: sender)
+ */
+void
+met_set(int end, int id, long long val)
+{
+	if (met_page != NULL)
+		__atomic_store_n(&met_page->mp_val[end][id], val,
+			__ATOMIC_RELAXED);
+}
+
+/*
+ *	int met_on(void) -- metrics are published
+ */
+int
+met_on(void)
+{
+	return met_page != NULL;
+}
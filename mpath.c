@@ -0,0 +1,484 @@
+/*
+ *	mpath.c
+ *
+ *	multipath striping -- the sender spreads its packets over several
+ *	simulated links, each with its own bandwidth, delay and error
+ *	rate, and the receiver puts them back into one ordered stream.
+ *
+ *	Every packet carries a connection sequence number (gseq) for the
+ *	reordering, a sequence number on its path (pseq) and the gseq of
+ *	the packet sent on the same path before it.  Paths are FIFO, so
+ *	when that previous gseq never arrived it was lost on that path
+ *	and the receiver stops waiting for it; only losses it cannot
+ *	pin down this way hold the stream up, for at most the delay
+ *	spread of the paths.  The receiver reports per-path arrivals back
+ *	on path 0, which gives the sender the round trip time and loss of
+ *	every path for its scheduler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+#include "sim.h"
+
+/*
+ *	multipath header -- in front of every striped packet
+ */
+struct mphdr {
+	unsigned int mh_gseq;		/* connection sequence number */
+	unsigned int mh_pseq;		/* sequence number on the path */
+	unsigned int mh_prev;		/* gseq sent before on the path */
+	unsigned short mh_path;		/* path number */
+	unsigned short mh_pad;
+	simtime_t mh_sent;		/* sender time (usec) */
+};
+
+/*
+ *	feedback -- one entry per path
+ */
+struct mpfb {
+	unsigned int mf_pseq;		/* highest pseq received */
+	unsigned int mf_count;		/* packets received */
+	simtime_t mf_echo;		/* mh_sent of the last packet */
+	simtime_t mf_hold;		/* it was held that long (usec) */
+};
+
+#define	MP_NONE		0xffffffff	/* no packet on the path yet */
+#define	MP_RING		4096		/* reorder buffer (packets) */
+
+#define	MP_RR		0		/* schedulers */
+#define	MP_RTT		1
+#define	MP_RATE		2
+
+/*
+ *	path state
+ */
+struct mppath {
+	int pa_bw;			/* Mbps */
+	int pa_delay;			/* usec */
+
+	/* sender */
+	unsigned int pa_pseq;		/* last pseq sent */
+	unsigned int pa_prev;		/* last gseq sent */
+	long long pa_pkts, pa_bytes;
+	simtime_t pa_srtt;		/* smoothed rtt, 0: no sample */
+	double pa_loss;			/* smoothed loss fraction */
+	unsigned int pa_fbpseq;		/* last feedback */
+	unsigned int pa_fbcount;
+	simtime_t pa_fbecho;
+
+	/* receiver */
+	unsigned int pa_last;		/* last gseq received */
+	unsigned int pa_hipseq;		/* highest pseq received */
+	unsigned int pa_count;		/* packets received */
+	simtime_t pa_echo;		/* mh_sent of the last packet */
+	simtime_t pa_arrive;		/* ... and when it came */
+	long long pa_lost;		/* losses pinned on this path */
+};
+
+/*
+ *	reorder buffer slot
+ */
+struct mpslot {
+	int ms_stat;
+	int ms_len;
+	char ms_data[MTU];
+};
+
+#define	MS_EMPTY	0
+#define	MS_DATA		1		/* packet waits for its turn */
+#define	MS_LOST		2		/* packet known to be lost */
+
+static struct mppath mp_path[MP_MAXPATH];
+static int mp_npath;
+static int mp_sched;
+static int mp_age;		/* longest wait for a gap (usec) */
+static int mp_fbint;		/* feedback interval (usec) */
+
+/* sender */
+static unsigned int mp_gseq;	/* next gseq */
+static int mp_rr;		/* next path of round robin */
+static char mp_pbuf[sizeof(struct mphdr) + MTU];
+
+/* receiver */
+static struct mpslot *mp_ring;
+static unsigned int mp_next;	/* next gseq handed up */
+static int mp_nheld;		/* packets in the reorder buffer */
+static simtime_t mp_since;	/* head of the buffer waits since */
+static simtime_t mp_fbtime = -1;	/* last feedback sent */
+
+/* statistics */
+static long long mp_nreord, mp_nlost, mp_nlate, mp_ndrop, mp_nfb;
+static int mp_maxheld;
+
+static char *mp_names[] = { "rr", "rtt", "rate" };
+
+/*
+ * int
+ * mp_init(char *sched)
+ *	select the scheduler: rr (round robin), rtt (lowest round trip
+ *	time with room) or rate (packets in proportion to bandwidth)
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+mp_init(char *sched)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(mp_names) / sizeof(mp_names[0])); i++)
+		if (strcmp(sched, mp_names[i]) == 0)
+			break;
+	if (i == sizeof(mp_names) / sizeof(mp_names[0]))
+		return -1;
+	mp_sched = i;
+	if ((mp_ring = calloc(MP_RING, sizeof(*mp_ring))) == NULL) {
+		perror("mp_init: calloc");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * int
+ * mp_addpath(int bw, int delay)
+ *	add the next path (Mbps, usec)
+ *
+ * return value:
+ *	path number, or -1 if there are too many
+ */
+int
+mp_addpath(int bw, int delay)
+{
+	struct mppath *pa;
+
+	if (mp_npath == MP_MAXPATH)
+		return -1;
+	pa = &mp_path[mp_npath];
+	pa->pa_bw = bw;
+	pa->pa_delay = delay;
+	pa->pa_prev = pa->pa_last = MP_NONE;
+	return mp_npath++;
+}
+
+/*
+ *	void mp_timing(int age, int fbint) -- a gap is given up after
+ *	`age' usec, feedback goes out every `fbint' usec
+ */
+void
+mp_timing(int age, int fbint)
+{
+	mp_age = age;
+	mp_fbint = fbint;
+}
+
+/* ======================================================================
+ *
+ * sender side
+ */
+
+/*
+ *	round trip time of a path, the nominal one until measured -- the
+ *	report comes back on path 0
+ */
+static simtime_t
+mp_rtt(struct mppath *pa)
+{
+	return pa->pa_srtt ? pa->pa_srtt : pa->pa_delay + mp_path[0].pa_delay;
+}
+
+/*
+ *	choose a path, among those whose line takes a packet of `size'
+ *	bytes without blocking, or among all if size is 0
+ *
+ * return value:
+ *	path number, -1 if none has room
+ */
+static int
+mp_pick(int size)
+{
+	struct mppath *pa;
+	double v, best = 0;
+	int i, p = -1;
+
+	if (mp_sched == MP_RR) {
+		for (i = 0; i < mp_npath; i++) {
+			p = (mp_rr + i) % mp_npath;
+			if (size == 0 || line_room(p) >= size) {
+				mp_rr = p + 1;
+				return p;
+			}
+		}
+		return -1;
+	}
+	for (i = 0; i < mp_npath; i++) {
+		if (size && line_room(i) < size)
+			continue;
+		pa = &mp_path[i];
+		if (mp_sched == MP_RTT)
+			v = mp_rtt(pa);
+		else {
+			/* bytes sent per useful bandwidth: lowest goes next */
+			v = pa->pa_loss < 0.95 ? 1 - pa->pa_loss : 0.05;
+			v = pa->pa_bytes / (pa->pa_bw * v);
+		}
+		if (p < 0 || v < best) {
+			best = v;
+			p = i;
+		}
+	}
+	return p;
+}
+
+/*
+ * int
+ * mp_send(void *buf, int size, simtime_t now)
+ *	send a packet on the path the scheduler picks.  If no line has
+ *	room, it blocks on the scheduler's choice like udt_send() does.
+ *
+ * return value: as udt_send()
+ */
+int
+mp_send(void *buf, int size, simtime_t now)
+{
+	struct mphdr *mh = (struct mphdr *)mp_pbuf;
+	struct mppath *pa;
+	int p, ret;
+
+	if ((p = mp_pick(sizeof(*mh) + size)) < 0)
+		p = mp_pick(0);
+	pa = &mp_path[p];
+	mh->mh_gseq = mp_gseq++;
+	mh->mh_pseq = ++pa->pa_pseq;
+	mh->mh_prev = pa->pa_prev;
+	mh->mh_path = p;
+	mh->mh_pad = 0;
+	mh->mh_sent = now;
+	pa->pa_prev = mh->mh_gseq;
+	memcpy(mh + 1, buf, size);
+	ret = line_send_path(p, LP_MPDATA, mp_pbuf, sizeof(*mh) + size);
+	if (ret != NET_SUCCESS)
+		return ret;
+	pa->pa_pkts++;
+	pa->pa_bytes += size;
+	return NET_SUCCESS;
+}
+
+/*
+ * void
+ * mp_feedback(void *buf, int size, simtime_t now)
+ *	take in the receiver's report: rtt and loss of every path
+ */
+void
+mp_feedback(void *buf, int size, simtime_t now)
+{
+	struct mpfb *mf = buf;
+	struct mppath *pa;
+	simtime_t rtt;
+	int i, sent, got;
+
+	for (i = 0; i < mp_npath && (i + 1) * (int)sizeof(*mf) <= size;
+			i++, mf++) {
+		pa = &mp_path[i];
+		if (mf->mf_count == 0)
+			continue;
+		if (mf->mf_echo != pa->pa_fbecho) {
+			rtt = now - mf->mf_echo - mf->mf_hold;
+			pa->pa_srtt = pa->pa_srtt ?
+				(7 * pa->pa_srtt + rtt) / 8 : rtt;
+			pa->pa_fbecho = mf->mf_echo;
+		}
+		sent = mf->mf_pseq - pa->pa_fbpseq;
+		got = mf->mf_count - pa->pa_fbcount;
+		if (sent > 0) {
+			pa->pa_loss = 0.875 * pa->pa_loss +
+				0.125 * (sent - got) / sent;
+			pa->pa_fbpseq = mf->mf_pseq;
+			pa->pa_fbcount = mf->mf_count;
+		}
+	}
+}
+
+/* ======================================================================
+ *
+ * receiver side
+ */
+
+/*
+ *	report the arrivals on every path to the sender
+ */
+static void
+mp_report(simtime_t now)
+{
+	struct mpfb fb[MP_MAXPATH];
+	struct mppath *pa;
+	int i;
+
+	for (i = 0; i < mp_npath; i++) {
+		pa = &mp_path[i];
+		fb[i].mf_pseq = pa->pa_hipseq;
+		fb[i].mf_count = pa->pa_count;
+		fb[i].mf_echo = pa->pa_echo;
+		fb[i].mf_hold = now - pa->pa_arrive;
+	}
+	if (line_send(LP_MPFEEDBACK, fb, mp_npath * sizeof(fb[0])) ==
+			NET_SUCCESS)
+		mp_nfb++;
+	mp_fbtime = now;
+}
+
+/*
+ * int
+ * mp_input(void *buf, int size, simtime_t now)
+ *	take in a striped packet from the line.  The next one in order
+ *	is left where it is for the caller to hand up; anything later
+ *	waits in the reorder buffer.
+ *
+ * return value:
+ *	positive int:	header size, the data after it is next in order
+ *	0:		packet absorbed
+ */
+int
+mp_input(void *buf, int size, simtime_t now)
+{
+	struct mphdr *mh = buf;
+	struct mppath *pa;
+	struct mpslot *ms;
+	int len = size - sizeof(*mh);
+	int off;
+
+	if (len < 0 || mh->mh_path >= mp_npath)
+		return 0;
+	pa = &mp_path[mh->mh_path];
+	pa->pa_count++;
+	if ((int)(mh->mh_pseq - pa->pa_hipseq) > 0)
+		pa->pa_hipseq = mh->mh_pseq;
+	pa->pa_echo = mh->mh_sent;
+	pa->pa_arrive = now;
+
+	/* the packet before this one on the path is not coming */
+	off = mh->mh_prev - mp_next;
+	if (mh->mh_prev != pa->pa_last && mh->mh_prev != MP_NONE &&
+			off >= 0 && off < MP_RING &&
+			mp_ring[mh->mh_prev % MP_RING].ms_stat == MS_EMPTY) {
+		mp_ring[mh->mh_prev % MP_RING].ms_stat = MS_LOST;
+		pa->pa_lost++;
+	}
+	pa->pa_last = mh->mh_gseq;
+
+	if (mp_fbtime < 0 || now - mp_fbtime >= mp_fbint)
+		mp_report(now);
+
+	off = mh->mh_gseq - mp_next;
+	if (off == 0) {
+		mp_ring[mp_next % MP_RING].ms_stat = MS_EMPTY;
+		mp_next++;
+		if (mp_nheld > 0)
+			mp_since = now;
+		return sizeof(*mh);
+	}
+	if (off < 0) {
+		mp_nlate++;	/* its gap was given up already */
+		return 0;
+	}
+	if (off >= MP_RING || len > MTU) {
+		mp_ndrop++;
+		return 0;
+	}
+	ms = &mp_ring[mh->mh_gseq % MP_RING];
+	if (ms->ms_stat == MS_DATA)
+		return 0;	/* duplicate */
+	ms->ms_stat = MS_DATA;
+	ms->ms_len = len;
+	memcpy(ms->ms_data, mh + 1, len);
+	if (mp_nheld++ == 0)
+		mp_since = now;
+	if (mp_nheld > mp_maxheld)
+		mp_maxheld = mp_nheld;
+	mp_nreord++;
+	return 0;
+}
+
+/*
+ * int
+ * mp_deliver(void *buf, int size, simtime_t now)
+ *	hand the next in-order packet up from the reorder buffer,
+ *	skipping gaps that are lost or have been waited for too long
+ *
+ * return value:
+ *	positive int:	size of data
+ *	0:		nothing deliverable yet
+ */
+int
+mp_deliver(void *buf, int size, simtime_t now)
+{
+	struct mpslot *ms;
+	int len;
+
+	for (;;) {
+		ms = &mp_ring[mp_next % MP_RING];
+		if (ms->ms_stat == MS_DATA) {
+			len = ms->ms_len < size ? ms->ms_len : size;
+			memcpy(buf, ms->ms_data, len);
+			ms->ms_stat = MS_EMPTY;
+			mp_next++;
+			if (--mp_nheld > 0)
+				mp_since = now;
+			return len;
+		}
+		if (mp_nheld == 0)
+			return 0;
+		if (ms->ms_stat != MS_LOST && now - mp_since < mp_age)
+			return 0;	/* may still come on a slower path */
+		ms->ms_stat = MS_EMPTY;
+		mp_next++;
+		mp_nlost++;
+	}
+}
+
+/*
+ *	int mp_pending() -- packets wait in the reorder buffer
+ */
+int
+mp_pending(void)
+{
+	return mp_nheld;
+}
+
+/*
+ *	print multipath statistics -- `bytes' is the goodput of the
+ *	connection over `now' usec
+ */
+void
+mp_stats(int sender, long long bytes, simtime_t now)
+{
+	struct mppath *pa;
+	int i, cap = 0;
+
+	if (!sender) {
+		for (i = 0; i < mp_npath; i++)
+			fprintf(stderr, "path %d\t\t: %u packets received, "
+				"%lld lost\n", i, mp_path[i].pa_count,
+				mp_path[i].pa_lost);
+		fprintf(stderr, "multipath\t: %lld packets reordered (max "
+			"%d held), %lld gaps skipped, %lld late, %lld "
+			"dropped, %lld reports\n", mp_nreord, mp_maxheld,
+			mp_nlost, mp_nlate, mp_ndrop, mp_nfb);
+		return;
+	}
+	for (i = 0; i < mp_npath; i++) {
+		pa = &mp_path[i];
+		cap += pa->pa_bw;
+		fprintf(stderr, "path %d\t\t: %d Mbps %d usec, %lld packets, "
+			"%.1f%% utilized, srtt %lld usec, loss %.1f%%\n", i,
+			pa->pa_bw, pa->pa_delay, pa->pa_pkts,
+			now ? 100.0 * pa->pa_bytes * 8 / pa->pa_bw / now : 0.0,
+			mp_rtt(pa), 100 * pa->pa_loss);
+	}
+	fprintf(stderr, "multipath\t: %s, goodput %.3f of %d Mbps (%.1f%%)\n",
+		mp_names[mp_sched], now ? bytes * 8.0 / now : 0.0, cap,
+		now ? 100.0 * bytes * 8 / cap / now : 0.0);
+}
@@ -0,0 +1,759 @@
+/*
+ *	pdes.c
+ *
+ *	many flows over many links, as a parallel discrete event simulation:
+ *
+ *		pdes [-f flows] [-l links] [-n packets] [-W window]
+ *		     [-b Mbps] [-d min,max] [-e erate] [-t threads] [-B]
+ *		     [--seed n]
+ *
+ *	The harness runs one connection against the clock; this runs a
+ *	whole topology in simulated time only.  Each flow is a go-back-N
+ *	sender and receiver over one full duplex link, data one way and
+ *	ACKs the other.  Flow f uses link f % links, so a link carries
+ *	several flows, and it has a bandwidth, a delay (drawn between min
+ *	and max usec), a drop-tail queue of one round trip and a loss rate.
+ *
+ *	Flows and links are split in blocks over `threads' shards, one per
+ *	worker thread, each with its own event heap.  The synchronization
+ *	is conservative, in windows: every shard runs its events up to the
+ *	earliest pending event of all shards plus the lookahead, then all
+ *	meet at a barrier.  Half of a link's delay lies between the sender
+ *	and the link's queue, the other half after it, so any event a flow
+ *	or a link posts for another one is at least half the smallest link
+ *	delay away -- the lookahead -- and an event for another shard never
+ *	falls into the window being run.  Those go through a lock-free
+ *	mailbox per pair of shards, one producer and one consumer, and are
+ *	put into the heap after the barrier.
+ *
+ *	The results do not depend on the number of threads: events are
+ *	ordered by time, then by the flow or link that posted them and how
+ *	many it had posted before, so each one sees its events in the same
+ *	order however they are spread; and each link draws its losses from
+ *	its own random stream.  The digest of the flow and link counts
+ *	shows it.  -B runs the topology on 1, 2, 4 ... threads up to the
+ *	number of cores (or -t) and checks that every run has the same
+ *	digest.
+ */
+
+#define	_GNU_SOURCE		/* CPU_SET */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	PD_MAXSHARD	64
+#define	PD_CACHELINE	64
+#define	PD_CHUNK	255		/* events per mailbox chunk */
+#define	PD_NEVER	LLONG_MAX
+#define	PD_DATASIZE	1044		/* 1 KB of data and a header */
+#define	PD_ACKSIZE	40
+#define	PD_SPIN		1000		/* barrier spins before yielding */
+
+/* event types */
+#define	EV_START	0		/* flow: start sending */
+#define	EV_LINK		1		/* link: packet at the queue */
+#define	EV_ARRIVE	2		/* flow: packet at the other end */
+#define	EV_TIMEOUT	3		/* flow: retransmission timer */
+
+struct event {
+	simtime_t ev_t;
+	unsigned long long ev_key;	/* poster << 40 | posted before */
+	int ev_type;
+	int ev_ent;			/* flow, or nflow + link */
+	int ev_flow;
+	int ev_seqn;			/* ACK: next expected, timer: gen */
+	int ev_dir;			/* 0 data, 1 ACKs */
+	int ev_size;
+};
+
+struct flow {
+	int f_link;			/* entity of its link */
+	int f_base, f_next;		/* sender */
+	int f_expect;			/* receiver */
+	int f_timer;			/* generation of the running timer */
+	simtime_t f_rto;
+	simtime_t f_done;		/* last packet acknowledged */
+	long long f_sent, f_retx, f_timeouts;
+	unsigned long long f_nposted;
+} __attribute__((aligned(PD_CACHELINE)));
+
+struct link {
+	simtime_t l_delay;
+	simtime_t l_qlimit;		/* longest wait in the queue */
+	double l_bw;			/* bits per usec */
+	double l_erate;
+	simtime_t l_busy[2];		/* line busy until, per direction */
+	struct rng l_rng;
+	long long l_pkts, l_lost, l_dropped;
+	unsigned long long l_nposted;
+} __attribute__((aligned(PD_CACHELINE)));
+
+/*
+ *	mailbox -- a list of chunks, written by one shard and read by
+ *	another.  The producer publishes each event by storing the chunk's
+ *	count, and a new chunk by linking it; the consumer frees a chunk
+ *	once it has read all of it and the next one is linked.
+ */
+struct chunk {
+	struct chunk *c_next;
+	int c_n;			/* events written */
+	struct event c_ev[PD_CHUNK];
+};
+
+struct mbox {
+	struct chunk *mb_tail;		/* producer */
+	char mb_pad[PD_CACHELINE - sizeof(struct chunk *)];
+	struct chunk *mb_head;		/* consumer */
+	int mb_read;
+} __attribute__((aligned(PD_CACHELINE)));
+
+struct shard {
+	int s_id;
+	int s_sense;			/* of the barrier */
+	pthread_t s_thread;
+	struct event *s_heap;
+	int s_nheap, s_maxheap;
+	simtime_t s_end;		/* end of the window being run */
+	simtime_t s_next;		/* earliest event, between windows */
+	long long s_events, s_remote;
+} __attribute__((aligned(PD_CACHELINE)));
+
+/* the topology */
+static int nflow = 256, nlink = 64, npkt = 1000, window = 32;
+static double bw = 100, erate = 0.001;
+static simtime_t dmin = 1000, dmax = 10000;
+
+static struct flow *flows;
+static struct link *links;
+static struct shard *shards;
+static struct mbox *mbox;		/* [from * nshard + to] */
+static int nshard;
+static simtime_t lookahead;
+static long long nwindow;
+
+static int bar_count, bar_sense;
+
+static struct option long_opts[] = {
+	{ "seed", required_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static long long
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ *	zeroed array on cache line boundaries, so that shards do not share
+ *	the lines of their flows and links
+ */
+static void *
+pd_alloc(size_t n, size_t size)
+{
+	size_t len = (n * size + PD_CACHELINE - 1) & ~(PD_CACHELINE - 1);
+	void *p;
+
+	if ((p = aligned_alloc(PD_CACHELINE, len)) == NULL) {
+		perror("pdes: aligned_alloc");
+		exit(1);
+	}
+	memset(p, 0, len);
+	return p;
+}
+
+/*
+ *	shard that owns an entity: flows and links in blocks
+ */
+static int
+pd_owner(int ent)
+{
+	if (ent < nflow)
+		return (long long)ent * nshard / nflow;
+	return (long long)(ent - nflow) * nshard / nlink;
+}
+
+static int
+ev_before(struct event *a, struct event *b)
+{
+	return a->ev_t < b->ev_t || (a->ev_t == b->ev_t &&
+	    a->ev_key < b->ev_key);
+}
+
+static void
+heap_push(struct shard *sh, struct event *ev)
+{
+	int i, up;
+
+	if (sh->s_nheap == sh->s_maxheap) {
+		sh->s_maxheap = sh->s_maxheap ? 2 * sh->s_maxheap : 1024;
+		if ((sh->s_heap = realloc(sh->s_heap, sh->s_maxheap *
+		    sizeof(struct event))) == NULL) {
+			perror("pdes: realloc");
+			exit(1);
+		}
+	}
+	for (i = sh->s_nheap++; i > 0; i = up) {
+		up = (i - 1) / 2;
+		if (!ev_before(ev, &sh->s_heap[up]))
+			break;
+		sh->s_heap[i] = sh->s_heap[up];
+	}
+	sh->s_heap[i] = *ev;
+}
+
+static void
+heap_pop(struct shard *sh, struct event *ev)
+{
+	struct event *h = sh->s_heap, *last;
+	int i, c, n;
+
+	*ev = h[0];
+	n = --sh->s_nheap;
+	last = &h[n];
+	for (i = 0; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && ev_before(&h[c + 1], &h[c]))
+			c++;
+		if (!ev_before(&h[c], last))
+			break;
+		h[i] = h[c];
+	}
+	h[i] = *last;
+}
+
+static void
+mb_init(struct mbox *mb)
+{
+	mb->mb_head = mb->mb_tail = pd_alloc(1, sizeof(struct chunk));
+	mb->mb_read = 0;
+}
+
+static void
+mb_push(struct mbox *mb, struct event *ev)
+{
+	struct chunk *c = mb->mb_tail, *nc;
+	int n = c->c_n;
+
+	if (n < PD_CHUNK) {
+		c->c_ev[n] = *ev;
+		__atomic_store_n(&c->c_n, n + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	nc = pd_alloc(1, sizeof(struct chunk));
+	nc->c_ev[0] = *ev;
+	nc->c_n = 1;
+	__atomic_store_n(&c->c_next, nc, __ATOMIC_RELEASE);
+	mb->mb_tail = nc;
+}
+
+/*
+ *	move the events in a mailbox into the shard's heap
+ */
+static void
+mb_drain(struct mbox *mb, struct shard *sh)
+{
+	struct chunk *c = mb->mb_head, *next;
+	int n;
+
+	for (;;) {
+		n = __atomic_load_n(&c->c_n, __ATOMIC_ACQUIRE);
+		while (mb->mb_read < n)
+			heap_push(sh, &c->c_ev[mb->mb_read++]);
+		if (mb->mb_read < PD_CHUNK || (next =
+		    __atomic_load_n(&c->c_next, __ATOMIC_ACQUIRE)) == NULL)
+			break;
+		free(c);
+		mb->mb_head = c = next;
+		mb->mb_read = 0;
+	}
+}
+
+static void
+mb_free(struct mbox *mb)
+{
+	struct chunk *c, *next;
+
+	for (c = mb->mb_head; c != NULL; c = next) {
+		next = c->c_next;
+		free(c);
+	}
+}
+
+/*
+ *	sense reversing barrier; spins, and yields when the shards are
+ *	more than the cores
+ */
+static void
+pd_barrier(struct shard *sh)
+{
+	int sense = sh->s_sense = !sh->s_sense;
+	int spin;
+
+	if (__atomic_add_fetch(&bar_count, 1, __ATOMIC_ACQ_REL) == nshard) {
+		__atomic_store_n(&bar_count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&bar_sense, sense, __ATOMIC_RELEASE);
+		return;
+	}
+	for (spin = 0; __atomic_load_n(&bar_sense, __ATOMIC_ACQUIRE) != sense;
+	    spin++)
+		if (spin >= PD_SPIN)
+			sched_yield();
+}
+
+/*
+ *	post an event from entity `from'; for another shard, it must be
+ *	past the window being run
+ */
+static void
+pd_post(struct shard *sh, struct event *ev, int from,
+	unsigned long long *nposted)
+{
+	int to = pd_owner(ev->ev_ent);
+
+	ev->ev_key = (unsigned long long)from << 40 | (*nposted)++;
+	if (to == sh->s_id) {
+		heap_push(sh, ev);
+		return;
+	}
+	if (ev->ev_t < sh->s_end) {
+		fprintf(stderr, "pdes: event at %lld for shard %d inside the "
+			"window ending at %lld\n", ev->ev_t, to, sh->s_end);
+		abort();
+	}
+	mb_push(&mbox[sh->s_id * nshard + to], ev);
+	sh->s_remote++;
+}
+
+static void
+flow_send(struct shard *sh, int f, simtime_t now, int seqn, int dir)
+{
+	struct flow *fl = &flows[f];
+	struct event ev;
+
+	ev.ev_t = now + links[fl->f_link - nflow].l_delay / 2;
+	ev.ev_type = EV_LINK;
+	ev.ev_ent = fl->f_link;
+	ev.ev_flow = f;
+	ev.ev_seqn = seqn;
+	ev.ev_dir = dir;
+	ev.ev_size = dir ? PD_ACKSIZE : PD_DATASIZE;
+	pd_post(sh, &ev, f, &fl->f_nposted);
+	if (dir == 0)
+		fl->f_sent++;
+}
+
+static void
+flow_timer(struct shard *sh, int f, simtime_t now)
+{
+	struct flow *fl = &flows[f];
+	struct event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.ev_t = now + fl->f_rto;
+	ev.ev_type = EV_TIMEOUT;
+	ev.ev_ent = f;
+	ev.ev_seqn = ++fl->f_timer;
+	pd_post(sh, &ev, f, &fl->f_nposted);
+}
+
+/*
+ *	go-back-N at both ends of a flow
+ */
+static void
+flow_event(struct shard *sh, struct event *ev)
+{
+	int f = ev->ev_ent, s;
+	struct flow *fl = &flows[f];
+
+	switch (ev->ev_type) {
+	case EV_START:
+		flow_timer(sh, f, ev->ev_t);
+		break;
+	case EV_ARRIVE:
+		if (ev->ev_dir == 0) {
+			/* receiver: cumulative ACK of the next expected */
+			if (ev->ev_seqn == fl->f_expect)
+				fl->f_expect++;
+			flow_send(sh, f, ev->ev_t, fl->f_expect, 1);
+			return;
+		}
+		if (ev->ev_seqn <= fl->f_base)
+			return;
+		fl->f_base = ev->ev_seqn;
+		if (fl->f_base == npkt) {
+			fl->f_done = ev->ev_t;
+			fl->f_timer++;		/* stops it */
+			return;
+		}
+		flow_timer(sh, f, ev->ev_t);
+		break;
+	case EV_TIMEOUT:
+		if (ev->ev_seqn != fl->f_timer)
+			return;			/* stopped or restarted */
+		fl->f_timeouts++;
+		for (s = fl->f_base; s < fl->f_next; s++) {
+			flow_send(sh, f, ev->ev_t, s, 0);
+			fl->f_retx++;
+		}
+		flow_timer(sh, f, ev->ev_t);
+		break;
+	}
+	while (fl->f_next < npkt && fl->f_next < fl->f_base + window)
+		flow_send(sh, f, ev->ev_t, fl->f_next++, 0);
+}
+
+/*
+ *	a packet at a link's queue: lost, dropped, or sent on to the other
+ *	end of its flow
+ */
+static void
+link_event(struct shard *sh, struct event *ev)
+{
+	struct link *ln = &links[ev->ev_ent - nflow];
+	simtime_t *busy = &ln->l_busy[ev->ev_dir];
+	struct event out;
+
+	ln->l_pkts++;
+	if (ln->l_erate > 0 && rng_uniform(&ln->l_rng) < ln->l_erate) {
+		ln->l_lost++;
+		return;
+	}
+	if (*busy < ev->ev_t)
+		*busy = ev->ev_t;
+	if (*busy - ev->ev_t > ln->l_qlimit) {
+		ln->l_dropped++;
+		return;
+	}
+	*busy += (simtime_t)(ev->ev_size * 8 / ln->l_bw + 0.5);
+	out = *ev;
+	out.ev_t = *busy + ln->l_delay - ln->l_delay / 2;
+	out.ev_type = EV_ARRIVE;
+	out.ev_ent = ev->ev_flow;
+	pd_post(sh, &out, ev->ev_ent, &ln->l_nposted);
+}
+
+/*
+ *	worker: run windows until no shard has events left
+ */
+static void *
+pd_worker(void *arg)
+{
+	struct shard *sh = arg;
+	struct event ev;
+	cpu_set_t cpus;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	simtime_t next;
+	int i;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(sh->s_id % (ncpu > 0 ? ncpu : 1), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	for (;;) {
+		next = PD_NEVER;
+		for (i = 0; i < nshard; i++)
+			if (shards[i].s_next < next)
+				next = shards[i].s_next;
+		if (next == PD_NEVER)
+			break;
+		sh->s_end = next + lookahead;
+
+		while (sh->s_nheap > 0 && sh->s_heap[0].ev_t < sh->s_end) {
+			heap_pop(sh, &ev);
+			sh->s_events++;
+			if (ev.ev_ent < nflow)
+				flow_event(sh, &ev);
+			else
+				link_event(sh, &ev);
+		}
+
+		/* every shard is done posting for the next window */
+		pd_barrier(sh);
+		for (i = 0; i < nshard; i++)
+			if (i != sh->s_id)
+				mb_drain(&mbox[i * nshard + sh->s_id], sh);
+		sh->s_next = sh->s_nheap > 0 ? sh->s_heap[0].ev_t : PD_NEVER;
+		if (sh->s_id == 0)
+			nwindow++;
+		pd_barrier(sh);
+	}
+	return NULL;
+}
+
+/*
+ *	set up the topology of the seed, spread over `threads' shards
+ */
+static void
+pd_setup(int threads)
+{
+	struct rng topo, streams;
+	struct link *ln;
+	struct flow *fl;
+	struct event ev;
+	int i;
+
+	nshard = threads;
+	flows = pd_alloc(nflow, sizeof(struct flow));
+	links = pd_alloc(nlink, sizeof(struct link));
+	shards = pd_alloc(nshard, sizeof(struct shard));
+	mbox = pd_alloc(nshard * nshard, sizeof(struct mbox));
+	for (i = 0; i < nshard * nshard; i++)
+		mb_init(&mbox[i]);
+	nwindow = 0;
+	bar_count = bar_sense = 0;
+
+	rng_init(&topo, 0);
+	rng_init(&streams, 1);
+	lookahead = PD_NEVER;
+	for (i = 0; i < nlink; i++) {
+		ln = &links[i];
+		ln->l_delay = dmin + rng_next(&topo) % (dmax - dmin + 1);
+		ln->l_qlimit = 2 * ln->l_delay;
+		ln->l_bw = bw;
+		ln->l_erate = erate;
+		rng_split(&streams, &ln->l_rng);
+		if (ln->l_delay / 2 < lookahead)
+			lookahead = ln->l_delay / 2;
+	}
+	for (i = 0; i < nshard; i++) {
+		shards[i].s_id = i;
+		shards[i].s_end = 0;
+	}
+
+	/* flows start a little apart */
+	memset(&ev, 0, sizeof(ev));
+	ev.ev_type = EV_START;
+	for (i = 0; i < nflow; i++) {
+		fl = &flows[i];
+		fl->f_link = nflow + i % nlink;
+		fl->f_rto = 4 * links[i % nlink].l_delay +
+			2 * links[i % nlink].l_qlimit;
+		ev.ev_t = rng_next(&topo) % dmin;
+		ev.ev_ent = i;
+		pd_post(&shards[pd_owner(i)], &ev, i, &fl->f_nposted);
+	}
+	for (i = 0; i < nshard; i++)
+		shards[i].s_next = shards[i].s_nheap > 0 ?
+			shards[i].s_heap[0].ev_t : PD_NEVER;
+}
+
+static void
+pd_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < nshard * nshard; i++)
+		mb_free(&mbox[i]);
+	for (i = 0; i < nshard; i++)
+		free(shards[i].s_heap);
+	free(mbox);
+	free(shards);
+	free(links);
+	free(flows);
+}
+
+/*
+ *	digest of what every flow and link did
+ */
+static unsigned int
+pd_digest(void)
+{
+	unsigned int crc = 0;
+	long long v[3];
+	int i;
+
+	for (i = 0; i < nflow; i++) {
+		v[0] = flows[i].f_done;
+		v[1] = flows[i].f_sent;
+		v[2] = flows[i].f_timeouts;
+		crc = crc32c(crc, v, sizeof(v));
+	}
+	for (i = 0; i < nlink; i++) {
+		v[0] = links[i].l_pkts;
+		v[1] = links[i].l_lost;
+		v[2] = links[i].l_dropped;
+		crc = crc32c(crc, v, sizeof(v));
+	}
+	return crc;
+}
+
+struct pd_result {
+	long long r_nsec;
+	long long r_events, r_remote;
+	unsigned int r_digest;
+};
+
+/*
+ *	run the topology on `threads' threads, and print the statistics
+ *	unless `quiet'
+ */
+static void
+pd_run(int threads, int quiet, struct pd_result *res)
+{
+	long long t0, sent = 0, retx = 0, timeouts = 0, lost = 0, dropped = 0;
+	simtime_t done = 0;
+	int i;
+
+	pd_setup(threads);
+	t0 = nsec();
+	for (i = 0; i < nshard; i++)
+		if (pthread_create(&shards[i].s_thread, NULL, pd_worker,
+		    &shards[i]) != 0) {
+			perror("pdes: pthread_create");
+			exit(1);
+		}
+	for (i = 0; i < nshard; i++)
+		pthread_join(shards[i].s_thread, NULL);
+	res->r_nsec = nsec() - t0;
+
+	res->r_events = res->r_remote = 0;
+	for (i = 0; i < nshard; i++) {
+		res->r_events += shards[i].s_events;
+		res->r_remote += shards[i].s_remote;
+	}
+	res->r_digest = pd_digest();
+
+	if (!quiet) {
+		for (i = 0; i < nflow; i++) {
+			sent += flows[i].f_sent;
+			retx += flows[i].f_retx;
+			timeouts += flows[i].f_timeouts;
+			if (flows[i].f_done > done)
+				done = flows[i].f_done;
+		}
+		for (i = 0; i < nlink; i++) {
+			lost += links[i].l_lost;
+			dropped += links[i].l_dropped;
+		}
+		printf("pdes\t\t: %d flows over %d links, %d threads, "
+			"lookahead %lld usec\n", nflow, nlink, nshard, lookahead);
+		printf("events\t\t: %lld in %.3f sec (%.2f M/s), %.0f%% to "
+			"other shards, %lld windows\n", res->r_events,
+			res->r_nsec / 1e9, res->r_events * 1e3 / res->r_nsec,
+			100.0 * res->r_remote / res->r_events, nwindow);
+		printf("flows\t\t: %lld packets sent, %lld resent, %lld "
+			"timeouts, all done at %.3f sec\n", sent, retx,
+			timeouts, done / 1e6);
+		printf("links\t\t: %lld lost, %lld dropped\n", lost, dropped);
+		printf("digest\t\t: %08x\n", res->r_digest);
+	}
+	pd_cleanup();
+}
+
+/*
+ *	scaling: 1, 2, 4 ... threads, then `maxthreads'
+ */
+static int
+pd_bench(int maxthreads)
+{
+	struct pd_result one, res;
+	int t, bad = 0;
+
+	printf("%d flows over %d links, %d packets each, seed %llu\n",
+		nflow, nlink, npkt, rng_getseed());
+	printf("threads       sec     Mev/s   speedup   remote  digest\n");
+	for (t = 1; t <= maxthreads; t = t < maxthreads && 2 * t > maxthreads ?
+	    maxthreads : 2 * t) {
+		pd_run(t, 1, &res);
+		if (t == 1)
+			one = res;
+		printf("%7d %9.3f %9.2f %9.2f %7.0f%%  %08x%s\n", t,
+			res.r_nsec / 1e9, res.r_events * 1e3 / res.r_nsec,
+			(double)one.r_nsec / res.r_nsec,
+			100.0 * res.r_remote / res.r_events, res.r_digest,
+			res.r_digest != one.r_digest ? "  MISMATCH" : "");
+		fflush(stdout);
+		if (res.r_digest != one.r_digest)
+			bad = 1;
+		if (t == maxthreads)
+			break;
+	}
+	return bad;
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-f flows] [-l links] [-n packets] "
+		"[-W window] [-b Mbps]\n\t[-d min,max] [-e erate] "
+		"[-t threads] [-B] [--seed n]\n", prog);
+	fprintf(stderr, "\t-d\tlink delays, usec (1000,10000)\n");
+	fprintf(stderr, "\t-t\tworker threads (1), with -B the most to try "
+		"(cores)\n");
+	fprintf(stderr, "\t-B\tscaling benchmark, checking the digests\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pd_result res;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int ch, threads = 0, bench = 0;
+	char *p;
+
+	rng_setseed(1);
+	while ((ch = getopt_long(argc, argv, "f:l:n:W:b:d:e:t:B", long_opts,
+	    NULL)) != -1) {
+		switch (ch) {
+		case 'f':
+			nflow = atoi(optarg);
+			break;
+		case 'l':
+			nlink = atoi(optarg);
+			break;
+		case 'n':
+			npkt = atoi(optarg);
+			break;
+		case 'W':
+			window = atoi(optarg);
+			break;
+		case 'b':
+			bw = atof(optarg);
+			break;
+		case 'd':
+			dmin = dmax = strtoll(optarg, &p, 10);
+			if (*p == ',')
+				dmax = strtoll(p + 1, NULL, 10);
+			break;
+		case 'e':
+			erate = atof(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'B':
+			bench = 1;
+			break;
+		case 'S':
+			rng_setseed(strtoull(optarg, NULL, 0));
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nflow <= 0 || nlink <= 0 || npkt <= 0 ||
+	    window <= 0 || bw <= 0 || erate < 0 || erate >= 1 ||
+	    dmin < 2 || dmax < dmin || threads < 0 || threads > PD_MAXSHARD)
+		usage(argv[0]);
+	if (threads == 0)
+		threads = bench ? (ncpu < PD_MAXSHARD ? ncpu : PD_MAXSHARD) : 1;
+	if (threads > nlink || threads > nflow)
+		threads = nlink < nflow ? nlink : nflow;
+
+	if (bench)
+		return pd_bench(threads);
+	pd_run(threads, 0, &res);
+	return 0;
+}
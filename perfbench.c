@@ -0,0 +1,423 @@
+/*
+ *	perfbench.c
+ *
+ *	what the simulator itself costs, so that a change to main.c, gbn.c
+ *	or sw.c can be told to make it cheaper or dearer:
+ *
+ *		perfbench [-n runs] [-o out.json] [-c base.json [-t pct]]
+ *			[scenario ...]
+ *
+ *	runs a fixed set of scenarios (all by default) with -C and a fixed
+ *	--seed, `runs' times each (3 by default), and prints the median
+ *	CPU time, cycles, instructions, cache misses, context switches and
+ *	system calls of each end per MB delivered.  -o writes the results
+ *	as a JSON baseline; -c compares them with a baseline and flags
+ *	every counter that grew by more than `pct' percent (10 by
+ *	default), exiting with 1 if any did.  Counters the machine does not
+ *	have are null in the JSON and left out of the comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	PB_MAXRUNS	15
+#define	PB_MAXRESULT	64
+#define	PB_NMETRIC	(1 + PC_NEVENT)	/* CPU time, perf counters */
+#define	PB_SEED		"1"
+
+static struct scenario {
+	char *sc_name;
+	char *sc_prog;
+	char *sc_opts;
+	char *sc_file, *sc_bw, *sc_delay, *sc_erate;
+} scenarios[] = {
+	{ "gbn", "gbn", "-W 64", "1M-file", "100", "10", "0" },
+	{ "gbn-loss", "gbn", "-W 64", "1M-file", "100", "10", "-3" },
+	{ "gbn-fast", "gbn", "-W 1024", "2M-file", "1000", "1ms", "0" },
+	{ "gbn-shm", "gbn", "-W 64 -m", "1M-file", "100", "10", "0" },
+	{ "gbn-threads", "gbn", "-W 64 -T", "1M-file", "100", "10", "0" },
+	{ "gbn-mtu", "gbn", "-W 64 -g max", "1M-file", "100", "10", "0" },
+	{ "gbn-gso", "gbn", "-W 64 -g max -G", "1M-file", "100", "10", "0" },
+	{ "sw", "sw", "", "1M-file", "100", "10", "0" },
+	{ NULL }
+};
+
+/* per scenario and end; -1: counter not available */
+struct result {
+	char r_name[32];
+	int r_sender;
+	double r_mb;			/* MB delivered */
+	double r_val[PB_NMETRIC];	/* per MB */
+};
+
+static struct result cur[PB_MAXRESULT], base[PB_MAXRESULT];
+static int ncur, nbase;
+
+static char *
+metric(int m)
+{
+	return m == 0 ? "cpu_us" : pc_name(m - 1);
+}
+
+static void
+usage(char *cmd)
+{
+	fprintf(stderr, "usage: %s [-n runs] [-o out.json] [-c base.json "
+		"[-t pct]] [scenario ...]\n", cmd);
+	exit(1);
+}
+
+/*
+ *	value of `"key": ...' in a line of JSON, -1 for null or missing
+ */
+static double
+json_num(char *line, char *key)
+{
+	char pat[64], *p;
+
+	snprintf(pat, sizeof(pat), "\"%s\":", key);
+	if ((p = strstr(line, pat)) == NULL)
+		return -1;
+	p += strlen(pat);
+	while (*p == ' ')
+		p++;
+	if (strncmp(p, "null", 4) == 0)
+		return -1;
+	return strtod(p, NULL);
+}
+
+static int
+json_str(char *line, char *key, char *buf, int len)
+{
+	char pat[64], *p, *q;
+
+	snprintf(pat, sizeof(pat), "\"%s\": \"", key);
+	if ((p = strstr(line, pat)) == NULL)
+		return -1;
+	p += strlen(pat);
+	if ((q = strchr(p, '"')) == NULL || q - p >= len)
+		return -1;
+	memcpy(buf, p, q - p);
+	buf[q - p] = '\0';
+	return 0;
+}
+
+/*
+ *	one run of scenario `sc'; the counts of both ends go to
+ *	val[end][metric], not yet per MB
+ *
+ * return value:
+ *	bytes delivered, -1 if the run failed
+ */
+static double
+run(struct scenario *sc, char *tmp, double val[2][PB_NMETRIC])
+{
+	char opts[256], prog[64], line[512], end[16], *argv[32], *tok;
+	double bytes = -1;
+	FILE *fp;
+	int argc = 0, status, m, s;
+	pid_t pid;
+
+	snprintf(prog, sizeof(prog), "./%s", sc->sc_prog);
+	argv[argc++] = prog;
+	argv[argc++] = "-C";
+	argv[argc++] = tmp;
+	argv[argc++] = "--seed";
+	argv[argc++] = PB_SEED;
+	strncpy(opts, sc->sc_opts, sizeof(opts) - 1);
+	opts[sizeof(opts) - 1] = '\0';
+	for (tok = strtok(opts, " "); tok != NULL; tok = strtok(NULL, " "))
+		argv[argc++] = tok;
+	argv[argc++] = sc->sc_file;
+	argv[argc++] = sc->sc_bw;
+	argv[argc++] = sc->sc_delay;
+	argv[argc++] = sc->sc_erate;
+	argv[argc] = NULL;
+
+	unlink(tmp);
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL ||
+		    freopen("/dev/null", "w", stderr) == NULL)
+			_exit(127);
+		execv(prog, argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: %s failed\n", sc->sc_name, prog);
+		return -1;
+	}
+
+	if ((fp = fopen(tmp, "r")) == NULL) {
+		perror(tmp);
+		return -1;
+	}
+	for (s = 0; s < 2; s++)
+		for (m = 0; m < PB_NMETRIC; m++)
+			val[s][m] = -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (json_str(line, "end", end, sizeof(end)) < 0)
+			continue;
+		s = strcmp(end, "sender") == 0;
+		for (m = 0; m < PB_NMETRIC; m++)
+			val[s][m] = json_num(line, metric(m));
+		if (!s)
+			bytes = json_num(line, "bytes");
+	}
+	fclose(fp);
+	return bytes;
+}
+
+static int
+dcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ *	run scenario `sc' `runs' times into two results, the medians
+ *
+ * return value:
+ *	0	success
+ *	-1	a run failed or delivered the wrong amount of data
+ */
+static int
+bench(struct scenario *sc, int runs, char *tmp)
+{
+	double val[PB_MAXRUNS][2][PB_NMETRIC], v[PB_MAXRUNS], bytes;
+	struct stat st;
+	struct result *r;
+	int i, m, s, n;
+
+	if (stat(sc->sc_file, &st) < 0) {
+		perror(sc->sc_file);
+		return -1;
+	}
+	for (i = 0; i < runs; i++) {
+		if ((bytes = run(sc, tmp, val[i])) < 0)
+			return -1;
+		if (bytes != st.st_size) {
+			fprintf(stderr, "%s: delivered %.0f of %lld bytes\n",
+				sc->sc_name, bytes, (long long)st.st_size);
+			return -1;
+		}
+	}
+
+	for (s = 1; s >= 0; s--) {
+		r = &cur[ncur++];
+		snprintf(r->r_name, sizeof(r->r_name), "%s", sc->sc_name);
+		r->r_sender = s;
+		r->r_mb = st.st_size / 1e6;
+		for (m = 0; m < PB_NMETRIC; m++) {
+			for (i = n = 0; i < runs; i++)
+				if (val[i][s][m] >= 0)
+					v[n++] = val[i][s][m];
+			if (n < runs) {
+				r->r_val[m] = -1;	/* not counted */
+				continue;
+			}
+			qsort(v, n, sizeof(v[0]), dcmp);
+			r->r_val[m] = v[n / 2] / r->r_mb;
+		}
+	}
+	return 0;
+}
+
+static void
+print(struct result *r)
+{
+	int m;
+
+	printf("%-12s %-8s", r->r_name, r->r_sender ? "sender" : "receiver");
+	for (m = 0; m < PB_NMETRIC; m++)
+		if (r->r_val[m] < 0)
+			printf(" %12s", "n/a");
+		else
+			printf(" %12.0f", r->r_val[m]);
+	printf("\n");
+}
+
+static int
+save(char *file, int runs)
+{
+	FILE *fp;
+	int i, m;
+
+	if ((fp = fopen(file, "w")) == NULL) {
+		perror(file);
+		return -1;
+	}
+	fprintf(fp, "{\n  \"seed\": %s,\n  \"runs\": %d,\n  \"unit\": "
+		"\"per MB delivered\",\n  \"results\": [\n", PB_SEED, runs);
+	for (i = 0; i < ncur; i++) {
+		fprintf(fp, "    {\"scenario\": \"%s\", \"end\": \"%s\", "
+			"\"mb\": %.6f", cur[i].r_name,
+			cur[i].r_sender ? "sender" : "receiver", cur[i].r_mb);
+		for (m = 0; m < PB_NMETRIC; m++)
+			if (cur[i].r_val[m] < 0)
+				fprintf(fp, ", \"%s\": null", metric(m));
+			else
+				fprintf(fp, ", \"%s\": %.1f", metric(m),
+					cur[i].r_val[m]);
+		fprintf(fp, "}%s\n", i < ncur - 1 ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+	return fclose(fp);
+}
+
+static int
+load(char *file)
+{
+	char line[1024], end[16];
+	struct result *r;
+	FILE *fp;
+	int m;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL && nbase < PB_MAXRESULT) {
+		r = &base[nbase];
+		if (json_str(line, "scenario", r->r_name,
+				sizeof(r->r_name)) < 0 ||
+		    json_str(line, "end", end, sizeof(end)) < 0)
+			continue;
+		r->r_sender = strcmp(end, "sender") == 0;
+		r->r_mb = json_num(line, "mb");
+		for (m = 0; m < PB_NMETRIC; m++)
+			r->r_val[m] = json_num(line, metric(m));
+		nbase++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ *	compare with the baseline
+ *
+ * return value:
+ *	number of counters that grew by more than `pct' percent
+ */
+static int
+compare(double pct)
+{
+	struct result *r, *b;
+	double d;
+	int i, j, m, nreg = 0;
+
+	printf("\nagainst the baseline (+%.0f%% is a regression):\n", pct);
+	for (i = 0; i < ncur; i++) {
+		r = &cur[i];
+		for (b = NULL, j = 0; j < nbase; j++)
+			if (strcmp(base[j].r_name, r->r_name) == 0 &&
+			    base[j].r_sender == r->r_sender)
+				b = &base[j];
+		if (b == NULL) {
+			printf("%-12s %-8s not in the baseline\n", r->r_name,
+				r->r_sender ? "sender" : "receiver");
+			continue;
+		}
+		printf("%-12s %-8s", r->r_name,
+			r->r_sender ? "sender" : "receiver");
+		for (m = 0; m < PB_NMETRIC; m++) {
+			if (r->r_val[m] < 0 || b->r_val[m] <= 0) {
+				printf(" %12s", "-");
+				continue;
+			}
+			d = (r->r_val[m] - b->r_val[m]) * 100 / b->r_val[m];
+			printf(" %+10.1f%%%c", d, d > pct ? '!' : ' ');
+			if (d > pct)
+				nreg++;
+		}
+		printf("\n");
+	}
+	if (nreg)
+		printf("%d counters regressed\n", nreg);
+	return nreg;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct scenario *sc;
+	char tmp[] = "/tmp/perfbenchXXXXXX";
+	char *out = NULL, *basefile = NULL;
+	double pct = 10;
+	int runs = 3, ch, fd, i, m, failed = 0, unavail = 0;
+
+	while ((ch = getopt(argc, argv, "n:o:c:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			runs = atoi(optarg);
+			if (runs < 1 || runs > PB_MAXRUNS)
+				usage(argv[0]);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'c':
+			basefile = optarg;
+			break;
+		case 't':
+			if ((pct = atof(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (basefile && load(basefile) < 0)
+		exit(1);
+	if ((fd = mkstemp(tmp)) < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+
+	printf("%-12s %-8s", "per MB", "end");
+	for (m = 0; m < PB_NMETRIC; m++)
+		printf(" %12s", metric(m));
+	printf("\n");
+	for (sc = scenarios; sc->sc_name != NULL; sc++) {
+		for (i = optind; i < argc; i++)
+			if (strcmp(argv[i], sc->sc_name) == 0)
+				break;
+		if (optind < argc && i == argc)
+			continue;
+		if (bench(sc, runs, tmp) < 0) {
+			failed = 1;
+			continue;
+		}
+		print(&cur[ncur - 2]);
+		print(&cur[ncur - 1]);
+		fflush(stdout);
+	}
+	unlink(tmp);
+
+	for (i = 0; i < ncur; i++)
+		for (m = 1; m < PB_NMETRIC; m++)
+			if (cur[i].r_val[m] < 0)
+				unavail = 1;
+	if (unavail)
+		printf("n/a: counter not available here (no PMU, "
+			"perf_event_paranoid or no tracefs)\n");
+	if (out && save(out, runs) < 0)
+		exit(1);
+	if (basefile && compare(pct) > 0)
+		exit(1);
+	return failed;
+}
@@ -0,0 +1,213 @@
+/*
+ *	perfctr.c
+ *
+ *	what a run costs the machine -- each end counts CPU cycles,
+ *	instructions, cache misses, context switches and system calls of
+ *	its own thread (and the helper threads it starts) with
+ *	perf_event_open(2), and appends them as one JSON object per line
+ *	to a file for perfbench.  The counts of a helper thread are only
+ *	added in once it has ended, so each end stops and joins its
+ *	read-ahead or write-behind thread before pc_stop().  A counter the kernel or the machine does
+ *	not offer (no PMU in a VM, perf_event_paranoid, no tracefs for the
+ *	system call tracepoint) is written as null; context switches then
+ *	come from getrusage(), and CPU time always does.
+ */
+
+#define	_GNU_SOURCE		/* RUSAGE_THREAD */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "transport.h"
+#include "sim.h"
+
+static struct pc_event {
+	char *pe_name;
+	int pe_type;
+	unsigned long long pe_config;
+} pc_events[PC_NEVENT] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "ctxsw", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "syscalls", PERF_TYPE_TRACEPOINT, 0 },	/* id from tracefs */
+};
+
+static char *pc_tpfiles[] = {
+	"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+	"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	NULL
+};
+
+/* per end, so per thread in -T mode */
+static __thread int pc_fd[PC_NEVENT];
+static __thread struct rusage pc_ru;
+
+/* CPU time and context switches of helper threads that have ended */
+static long long pc_hcpu[2], pc_hcsw[2];	/* receiver, sender */
+
+/*
+ *	id of the system call entry tracepoint, -1 if there is no tracefs
+ */
+static long long
+pc_tracepoint(void)
+{
+	FILE *fp;
+	long long id;
+	int i;
+
+	for (i = 0; pc_tpfiles[i] != NULL; i++) {
+		if ((fp = fopen(pc_tpfiles[i], "r")) == NULL)
+			continue;
+		if (fscanf(fp, "%lld", &id) != 1)
+			id = -1;
+		fclose(fp);
+		return id;
+	}
+	return -1;
+}
+
+/*
+ *	void pc_start(void) -- start counting for this end
+ */
+void
+pc_start(void)
+{
+	struct perf_event_attr attr;
+	long long tp;
+	int i;
+
+	tp = pc_tracepoint();
+	for (i = 0; i < PC_NEVENT; i++) {
+		pc_fd[i] = -1;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pc_events[i].pe_type;
+		attr.config = pc_events[i].pe_config;
+		if (attr.type == PERF_TYPE_TRACEPOINT) {
+			if (tp < 0)
+				continue;
+			attr.config = tp;
+		}
+		attr.disabled = 1;
+		attr.inherit = 1;	/* and read-ahead, write-behind */
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		pc_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+			PERF_FLAG_FD_CLOEXEC);
+	}
+	for (i = 0; i < PC_NEVENT; i++)
+		if (pc_fd[i] >= 0)
+			ioctl(pc_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	getrusage(RUSAGE_THREAD, &pc_ru);
+}
+
+/*
+ *	counter value scaled up for the time it was multiplexed out, -1
+ *	if it is not there
+ */
+static long long
+pc_read(int i)
+{
+	unsigned long long v[3];	/* value, enabled, running */
+
+	if (pc_fd[i] < 0 || read(pc_fd[i], v, sizeof(v)) != sizeof(v) ||
+	    v[2] == 0)
+		return -1;
+	if (v[2] < v[1])
+		return (double)v[0] * v[1] / v[2];
+	return v[0];
+}
+
+static long long
+tv_usec(struct timeval *tv)
+{
+	return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+/*
+ * void
+ * pc_stop(char *file, int sender, long long bytes)
+ *	stop counting and append this end's counts, for `bytes' of data
+ *	sent or delivered, to `file'
+ */
+void
+pc_stop(char *file, int sender, long long bytes)
+{
+	struct rusage ru;
+	long long val[PC_NEVENT], cpu;
+	char line[512];
+	int i, n, fd;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	for (i = 0; i < PC_NEVENT; i++) {
+		val[i] = pc_read(i);
+		if (pc_fd[i] >= 0)
+			close(pc_fd[i]);
+	}
+	if (val[PC_CTXSW] < 0)
+		val[PC_CTXSW] = ru.ru_nvcsw + ru.ru_nivcsw -
+			pc_ru.ru_nvcsw - pc_ru.ru_nivcsw + pc_hcsw[sender];
+	cpu = tv_usec(&ru.ru_utime) + tv_usec(&ru.ru_stime) -
+		tv_usec(&pc_ru.ru_utime) - tv_usec(&pc_ru.ru_stime) +
+		pc_hcpu[sender];
+
+	n = snprintf(line, sizeof(line), "{\"end\": \"%s\", \"bytes\": %lld, "
+		"\"cpu_us\": %lld", sender ? "sender" : "receiver", bytes, cpu);
+	for (i = 0; i < PC_NEVENT; i++)
+		if (val[i] < 0)
+			n += snprintf(line + n, sizeof(line) - n, ", \"%s\": null",
+				pc_events[i].pe_name);
+		else
+			n += snprintf(line + n, sizeof(line) - n, ", \"%s\": %lld",
+				pc_events[i].pe_name, val[i]);
+	n += snprintf(line + n, sizeof(line) - n, "}\n");
+
+	/* one write, so that the two ends' lines do not mix */
+	if ((fd = open(file, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0 ||
+	    write(fd, line, n) != n) {
+		fprintf(stderr, "counter file `%s': ", file);
+		perror("write");
+	}
+	if (fd >= 0)
+		close(fd);
+
+	fprintf(stderr, "counters\t: %lld usec cpu", cpu);
+	for (i = 0; i < PC_NEVENT; i++)
+		if (val[i] < 0)
+			fprintf(stderr, ", %s n/a", pc_events[i].pe_name);
+		else
+			fprintf(stderr, ", %lld %s", val[i],
+				pc_events[i].pe_name);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * void
+ * pc_exit(int sender)
+ *	called by a helper thread of the sender or receiver end as it
+ *	ends: getrusage() of the end's own thread does not see it
+ */
+void
+pc_exit(int sender)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	pc_hcpu[sender] += tv_usec(&ru.ru_utime) + tv_usec(&ru.ru_stime);
+	pc_hcsw[sender] += ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/*
+ *	char *pc_name(int i) -- name of counter `i' in the JSON
+ */
+char *
+pc_name(int i)
+{
+	return pc_events[i].pe_name;
+}
@@ -0,0 +1,449 @@
+/*
+ *	queue.c
+ *
+ *	bottleneck router queue in front of the data direction of the
+ *	line.  Packets from the sender (flow 0) and optional constant-rate
+ *	cross traffic (flow 1) share one buffer, drained at the link rate;
+ *	the policy decides which packets the buffer drops:
+ *
+ *	droptail	drop arrivals that do not fit
+ *	red		Random Early Detection on the average queue size
+ *	codel		Controlled Delay, drops at dequeue when the
+ *			sojourn time stays above target for an interval
+ *
+ *	Queueing delays are kept in a log-linear histogram per flow for
+ *	the percentiles printed by q_stats().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	Q_DROPTAIL	0
+#define	Q_RED		1
+#define	Q_CODEL		2
+
+#define	Q_NFLOW		2		/* sender, cross traffic */
+#define	Q_MINPKT	64		/* smallest packet, sizes the ring */
+
+/* RED parameters (Floyd and Jacobson) */
+#define	RED_WQ		0.002		/* weight of the average */
+#define	RED_MAXP	0.1		/* drop probability at max_th */
+
+/* histogram: 16 exact buckets, then 16 per power of two (usec) */
+#define	QH_SUB		16
+#define	QH_BUCKETS	(QH_SUB * 40)
+
+/*
+ *	queued packet
+ */
+struct qent {
+	void *qe_pkt;			/* NULL for cross traffic */
+	int qe_size;			/* bytes */
+	int qe_flow;
+	simtime_t qe_arrival;		/* enqueue time */
+};
+
+/*
+ *	per-flow statistics
+ */
+struct qflow {
+	long long qf_npkt;		/* arrivals */
+	long long qf_bytes;
+	long long qf_ndrop;		/* dropped, either end */
+	long long qf_nsent;		/* left the queue */
+	long long qf_maxdelay;
+	long long qf_hist[QH_BUCKETS];	/* queueing delay */
+};
+
+static char *q_names[] = { "droptail", "red", "codel" };
+
+static int q_policy;
+static int q_limit;		/* buffer size (bytes) */
+static int q_bdp;		/* for printing the limit */
+static int q_bw;		/* link rate (Mbps = bits/usec) */
+static void (*q_drop)(void *);	/* frees a dropped packet */
+
+static struct qent *q_ring;	/* FIFO */
+static int q_nslot;
+static int q_head, q_len;
+static int q_bytes, q_peak;	/* bytes queued, max */
+static long long q_busy;	/* link busy until (nsec) */
+
+/* cross traffic */
+static int q_cross;		/* rate (Mbps), 0: none */
+static long long q_crossnext;	/* next arrival (nsec) */
+
+/* RED */
+static double red_avg;		/* average queue (bytes) */
+static int red_count;		/* packets since last drop */
+static simtime_t red_idle;	/* queue empty since, -1: busy */
+static struct rng red_rng;	/* drop decisions */
+
+/* CoDel */
+static simtime_t codel_target, codel_interval;
+static simtime_t codel_first;	/* sojourn above target until */
+static simtime_t codel_next;	/* next drop */
+static int codel_dropping;
+static int codel_count, codel_lastcount;
+
+static struct qflow q_flow[Q_NFLOW];
+
+static int q_push(void *, int, int, simtime_t);
+static int red_drop(simtime_t);
+static struct qent *codel_head(simtime_t, int *);
+static void q_pop(void);
+static void q_gencross(simtime_t);
+static void qh_add(long long *, long long);
+static long long qh_pct(long long *, long long, int);
+
+/*
+ * int
+ * q_init(char *spec, int bw, int delay, int bdp, int cross, void (*drop)())
+ *	set up the queue from `policy[,limit]'; limit is in bytes (k and
+ *	m suffixes) or bdp multiples (`2bdp'), default one bdp.  `cross'
+ *	Mbps of cross traffic share the buffer and the link.
+ *
+ * return value:
+ *	0	success
+ *	-1	bad spec
+ */
+int
+q_init(char *spec, int bw, int delay, int bdp, int cross,
+	void (*drop)(void *))
+{
+	char name[16];
+	char *limit, *unit;
+	double d;
+	int i;
+
+	strncpy(name, spec, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	if ((limit = strchr(name, ',')) != NULL)
+		*limit++ = '\0';
+	for (i = 0; i < 3; i++)
+		if (strcmp(name, q_names[i]) == 0)
+			break;
+	if (i == 3)
+		return -1;
+	q_policy = i;
+
+	q_limit = bdp;
+	if (limit != NULL) {
+		d = strtod(limit, &unit);
+		if (strcmp(unit, "bdp") == 0)
+			d *= bdp;
+		else if (strcmp(unit, "k") == 0)
+			d *= 1024;
+		else if (strcmp(unit, "m") == 0)
+			d *= 1024*1024;
+		else if (*unit != '\0')
+			return -1;
+		if (d > INT_MAX)
+			return -1;
+		q_limit = d;
+	}
+	if (q_limit < MTU + 64)
+		return -1;
+
+	q_bdp = bdp;
+	q_bw = bw;
+	q_cross = cross;
+	q_drop = drop;
+	q_nslot = q_limit / Q_MINPKT + 1;
+	if ((q_ring = malloc(q_nslot * sizeof(*q_ring))) == NULL) {
+		perror("q_init: malloc");
+		return -1;
+	}
+	red_idle = 0;
+	rng_init(&red_rng, RNG_STREAM(1, RNG_RED));
+
+	/*
+	 * RFC 8289 uses 5 ms / 100 ms for Internet paths; the interval
+	 * should cover a round trip, so scale both down on short links
+	 */
+	codel_interval = 10 * delay;
+	if (codel_interval > 100*1000)
+		codel_interval = 100*1000;
+	codel_target = codel_interval / 20;
+	return 0;
+}
+
+/*
+ * int
+ * q_enqueue(void *pkt, int size, simtime_t now)
+ *	offer a packet of the sender to the queue
+ *
+ * return value:
+ *	0	queued
+ *	-1	dropped (pkt was handed to the drop function)
+ */
+int
+q_enqueue(void *pkt, int size, simtime_t now)
+{
+	q_gencross(now);
+	return q_push(pkt, size, 0, now);
+}
+
+/*
+ * void *
+ * q_dequeue(simtime_t now, simtime_t *depart)
+ *	next packet of the sender that the link starts transmitting by
+ *	`now'; cross traffic is transmitted and discarded on the way
+ *
+ * return value:
+ *	packet, its last bit leaves at *depart
+ *	NULL	nothing to send yet
+ */
+void *
+q_dequeue(simtime_t now, simtime_t *depart)
+{
+	struct qent *qe;
+	simtime_t start;
+	long long delay;
+	void *pkt;
+	int drop;
+
+	q_gencross(now);
+	for (;;) {
+		if (q_len == 0)
+			return NULL;
+		qe = &q_ring[q_head];
+		start = (q_busy + 999) / 1000;
+		if (start < qe->qe_arrival)
+			start = qe->qe_arrival;
+		if (start > now)
+			return NULL;	/* link busy */
+
+		if (q_policy == Q_CODEL) {
+			if ((qe = codel_head(start, &drop)) == NULL)
+				return NULL;
+			if (drop)
+				continue;
+		}
+
+		delay = start - qe->qe_arrival;
+		qh_add(q_flow[qe->qe_flow].qf_hist, delay);
+		if (delay > q_flow[qe->qe_flow].qf_maxdelay)
+			q_flow[qe->qe_flow].qf_maxdelay = delay;
+		q_flow[qe->qe_flow].qf_nsent++;
+
+		if (q_busy < start * 1000)
+			q_busy = start * 1000;
+		q_busy += (long long)qe->qe_size * 8 * 1000 / q_bw;
+		pkt = qe->qe_pkt;
+		q_pop();
+		if (q_len == 0)
+			red_idle = now;
+		if (pkt != NULL) {
+			*depart = (q_busy + 999) / 1000;
+			return pkt;
+		}
+	}
+}
+
+/*
+ *	add an arrival, applying the drop policy
+ */
+static int
+q_push(void *pkt, int size, int flow, simtime_t now)
+{
+	struct qent *qe;
+
+	q_flow[flow].qf_npkt++;
+	q_flow[flow].qf_bytes += size;
+	if (q_bytes + size > q_limit || q_len == q_nslot ||
+			(q_policy == Q_RED && red_drop(now))) {
+		q_flow[flow].qf_ndrop++;
+		if (pkt != NULL)
+			(*q_drop)(pkt);
+		return -1;
+	}
+
+	qe = &q_ring[(q_head + q_len) % q_nslot];
+	qe->qe_pkt = pkt;
+	qe->qe_size = size;
+	qe->qe_flow = flow;
+	qe->qe_arrival = now;
+	q_len++;
+	q_bytes += size;
+	if (q_bytes > q_peak)
+		q_peak = q_bytes;
+	red_idle = -1;
+	return 0;
+}
+
+static void
+q_pop(void)
+{
+	q_bytes -= q_ring[q_head].qe_size;
+	q_head = (q_head + 1) % q_nslot;
+	q_len--;
+}
+
+/*
+ *	RED: update the average queue size, then decide on the arrival
+ */
+static int
+red_drop(simtime_t now)
+{
+	double minth = q_limit / 4, maxth = q_limit * 3 / 4;
+	double pb, pa;
+	long long m;
+
+	if (red_idle >= 0) {
+		/* decay the average as if small packets left while idle */
+		m = (now - red_idle) * q_bw / (MTU * 8);
+		red_avg *= pow(1 - RED_WQ, m);
+	} else
+		red_avg += RED_WQ * (q_bytes - red_avg);
+
+	if (red_avg < minth) {
+		red_count = -1;
+		return 0;
+	}
+	if (red_avg >= maxth) {
+		red_count = 0;
+		return 1;
+	}
+	red_count++;
+	pb = RED_MAXP * (red_avg - minth) / (maxth - minth);
+	pa = red_count * pb >= 1 ? 1 : pb / (1 - red_count * pb);
+	if (rng_uniform(&red_rng) < pa) {
+		red_count = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ *	CoDel (RFC 8289 dequeue): look at the head at time `now'.  *drop
+ *	is set when the head was dropped and the caller has to look again.
+ */
+static struct qent *
+codel_head(simtime_t now, int *drop)
+{
+	struct qent *qe = &q_ring[q_head];
+	int ok = 0;
+	int delta;
+
+	*drop = 0;
+	if (now - qe->qe_arrival < codel_target || q_bytes <= MTU)
+		codel_first = 0;
+	else if (codel_first == 0)
+		codel_first = now + codel_interval;
+	else if (now >= codel_first)
+		ok = 1;
+
+	if (codel_dropping) {
+		if (!ok)
+			codel_dropping = 0;
+		else if (now >= codel_next) {
+			codel_count++;
+			codel_next += codel_interval / sqrt(codel_count);
+			*drop = 1;
+		}
+	} else if (ok) {
+		codel_dropping = 1;
+		delta = codel_count - codel_lastcount;
+		codel_count = delta > 1 &&
+			now - codel_next < 16 * codel_interval ? delta : 1;
+		codel_next = now + codel_interval / sqrt(codel_count);
+		codel_lastcount = codel_count;
+		*drop = 1;
+	}
+
+	if (*drop) {
+		q_flow[qe->qe_flow].qf_ndrop++;
+		if (qe->qe_pkt != NULL)
+			(*q_drop)(qe->qe_pkt);
+		q_pop();
+		if (q_len == 0)
+			return NULL;
+	}
+	return qe;
+}
+
+/*
+ *	cross traffic: MTU-sized packets at q_cross Mbps up to `now'
+ */
+static void
+q_gencross(simtime_t now)
+{
+	if (q_cross == 0)
+		return;
+	while (q_crossnext <= now * 1000) {
+		q_push(NULL, MTU, 1, q_crossnext / 1000);
+		q_crossnext += (long long)MTU * 8 * 1000 / q_cross;
+	}
+}
+
+/*
+ *	log-linear histogram of usec values
+ */
+static void
+qh_add(long long *hist, long long v)
+{
+	int e, i;
+
+	if (v < QH_SUB)
+		i = v;
+	else {
+		for (e = 0; (v >> e) >= 2 * QH_SUB; e++)
+			;
+		i = QH_SUB * (e + 1) + (v >> e) - QH_SUB;
+	}
+	if (i >= QH_BUCKETS)
+		i = QH_BUCKETS - 1;
+	hist[i]++;
+}
+
+/*
+ *	pct percentile of n values -- lower edge of its bucket
+ */
+static long long
+qh_pct(long long *hist, long long n, int pct)
+{
+	long long want = (n * pct + 99) / 100, sum = 0;
+	int i, e;
+
+	for (i = 0; i < QH_BUCKETS - 1; i++)
+		if ((sum += hist[i]) >= want)
+			break;
+	if (i < QH_SUB)
+		return i;
+	e = i / QH_SUB - 1;
+	return (long long)(i % QH_SUB + QH_SUB) << e;
+}
+
+/*
+ *	void q_stats() -- print buffer use, drops and delay percentiles
+ */
+void
+q_stats(void)
+{
+	struct qflow *qf;
+	int i;
+
+	fprintf(stderr, "queue\t\t: %s, limit %d bytes (%.2f bdp), "
+		"peak %d bytes\n", q_names[q_policy], q_limit,
+		(double)q_limit / q_bdp, q_peak);
+	for (i = 0; i < Q_NFLOW; i++) {
+		qf = &q_flow[i];
+		if (qf->qf_npkt == 0)
+			continue;
+		fprintf(stderr, "queue %s\t: %lld packets, %lld dropped "
+			"(%.2f%%), delay p50 %lld p90 %lld p99 %lld "
+			"max %lld usec\n", i == 0 ? "flow" : "cross",
+			qf->qf_npkt, qf->qf_ndrop,
+			100.0 * qf->qf_ndrop / qf->qf_npkt,
+			qh_pct(qf->qf_hist, qf->qf_nsent, 50),
+			qh_pct(qf->qf_hist, qf->qf_nsent, 90),
+			qh_pct(qf->qf_hist, qf->qf_nsent, 99),
+			qf->qf_maxdelay);
+	}
+}
@@ -0,0 +1,197 @@
+/*
+ *	readahead.c
+ *
+ *	background read-ahead for get_data() -- a reader thread keeps a
+ *	ring of blocks filled from the source file so the sender loop does
+ *	not stall on read(2).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	RA_BLKSIZE	(16*1024)	/* read size of the reader thread */
+
+/*
+ *	read-ahead block
+ */
+struct rablk {
+	int rb_size;			/* valid data size */
+	char rb_buf[RA_BLKSIZE];	/* data */
+};
+
+static struct rablk *ra_ring;	/* ring of blocks */
+static int ra_depth;		/* number of blocks in ring */
+static int ra_head;		/* next block to dequeue */
+static int ra_tail;		/* next block to fill */
+static int ra_count;		/* filled blocks */
+static int ra_off;		/* read offset in head block */
+static int ra_eof;		/* reader hit EOF */
+static int ra_quit;		/* ra_stop() was called */
+static int ra_fd;		/* source file */
+
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_drained = PTHREAD_COND_INITIALIZER;
+
+static long long ra_nget;	/* ra_read() calls */
+static long long ra_nempty;	/* calls that found the ring empty */
+static long long ra_nblk;	/* blocks read */
+
+static void *ra_reader(void *);
+
+/*
+ * int
+ * ra_start(int fd, int depth)
+ *	start the reader thread with a ring of `depth' blocks
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+ra_start(int fd, int depth)
+{
+	sigset_t sigs, osigs;
+	int err;
+
+	if ((ra_ring = malloc(sizeof(struct rablk) * depth)) == NULL) {
+		perror("ra_start: malloc");
+		return -1;
+	}
+	ra_fd = fd;
+	ra_depth = depth;
+
+	/* keep SIGALRM on the sender thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	err = pthread_create(&ra_thread, NULL, ra_reader, NULL);
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (err) {
+		fprintf(stderr, "ra_start: pthread_create: %s\n",
+			strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	reader thread -- fill the ring until EOF
+ */
+static void *
+ra_reader(void *arg)
+{
+	struct rablk *rb;
+	int cnt;
+
+	for (;;) {
+		pthread_mutex_lock(&ra_lock);
+		while (ra_count == ra_depth && !ra_quit)
+			pthread_cond_wait(&ra_drained, &ra_lock);
+		if (ra_quit) {
+			pthread_mutex_unlock(&ra_lock);
+			break;
+		}
+		rb = &ra_ring[ra_tail];
+		pthread_mutex_unlock(&ra_lock);
+
+		/* the slot is ours until it is published below */
+		while ((cnt = read(ra_fd, rb->rb_buf, RA_BLKSIZE)) < 0) {
+			if (errno != EINTR) {
+				perror("ra_reader: read");
+				exit(1);
+			}
+		}
+
+		pthread_mutex_lock(&ra_lock);
+		if (cnt == 0) {
+			ra_eof = 1;
+			pthread_cond_signal(&ra_filled);
+			pthread_mutex_unlock(&ra_lock);
+			break;
+		}
+		rb->rb_size = cnt;
+		ra_tail = (ra_tail + 1) % ra_depth;
+		ra_count++;
+		ra_nblk++;
+		pthread_cond_signal(&ra_filled);
+		pthread_mutex_unlock(&ra_lock);
+	}
+	pc_exit(1);		/* its share of the sender's counts */
+	return NULL;
+}
+
+/*
+ *	void ra_stop(void) -- stop the reader thread and wait for it
+ */
+void
+ra_stop(void)
+{
+	pthread_mutex_lock(&ra_lock);
+	ra_quit = 1;
+	pthread_cond_signal(&ra_drained);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread, NULL);
+}
+
+/*
+ * int
+ * ra_read(void *buf, int size)
+ *	copy up to `size' bytes out of the ring; only waits when the
+ *	reader has fallen behind
+ *
+ * return value:
+ *	positive int:	size of data
+ *	0:		end of file
+ */
+int
+ra_read(void *buf, int size)
+{
+	struct rablk *rb;
+	int cnt, n;
+
+	pthread_mutex_lock(&ra_lock);
+	ra_nget++;
+	if (ra_count == 0 && !ra_eof)
+		ra_nempty++;
+	for (cnt = 0; cnt < size; cnt += n) {
+		while (ra_count == 0 && !ra_eof)
+			pthread_cond_wait(&ra_filled, &ra_lock);
+		if (ra_count == 0)
+			break;		/* EOF */
+
+		rb = &ra_ring[ra_head];
+		n = rb->rb_size - ra_off;
+		if (n > size - cnt)
+			n = size - cnt;
+		memcpy((char *)buf + cnt, rb->rb_buf + ra_off, n);
+		ra_off += n;
+		if (ra_off == rb->rb_size) {
+			ra_off = 0;
+			ra_head = (ra_head + 1) % ra_depth;
+			ra_count--;
+			pthread_cond_signal(&ra_drained);
+		}
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return cnt;
+}
+
+/*
+ *	print read-ahead statistics
+ */
+void
+ra_stats(void)
+{
+	fprintf(stderr, "read-ahead\t: %d x %d KB ring, %lld blocks read, "
+		"%lld of %lld gets found it empty\n",
+		ra_depth, RA_BLKSIZE/1024, ra_nblk, ra_nempty, ra_nget);
+}
@@ -0,0 +1,134 @@
+/*
+ *	rng.c
+ *
+ *	random numbers for the loss models -- xoshiro256** (Blackman and
+ *	Vigna), one generator per stream.  All streams come from the one
+ *	seed of the run: the seed is spread over the 256 bit state by
+ *	splitmix64, and stream n is that state moved on by n jumps of
+ *	2^128 steps, so streams never overlap.  With the same seed every
+ *	model sees the same numbers whatever the protocol does with the
+ *	others: the n-th packet put on a path in one direction is lost or
+ *	not alike in every run.
+ */
+
+#include "transport.h"
+#include "sim.h"
+
+static unsigned long long rng_seed;
+
+static unsigned long long
+rotl(unsigned long long x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static unsigned long long
+splitmix64(unsigned long long *x)
+{
+	unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ *	move the generator on by 2^128 steps
+ */
+static void
+rng_jump(struct rng *r)
+{
+	static const unsigned long long jump[] = {
+		0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+		0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+	};
+	unsigned long long s[4] = { 0, 0, 0, 0 };
+	int i, b, j;
+
+	for (i = 0; i < 4; i++)
+		for (b = 0; b < 64; b++) {
+			if (jump[i] & 1ULL << b)
+				for (j = 0; j < 4; j++)
+					s[j] ^= r->r_s[j];
+			rng_next(r);
+		}
+	for (j = 0; j < 4; j++)
+		r->r_s[j] = s[j];
+}
+
+/*
+ *	void rng_setseed(unsigned long long seed) -- seed of the run, set
+ *	before the streams are
+ */
+void
+rng_setseed(unsigned long long seed)
+{
+	rng_seed = seed;
+}
+
+/*
+ *	unsigned long long rng_getseed(void) -- seed of the run
+ */
+unsigned long long
+rng_getseed(void)
+{
+	return rng_seed;
+}
+
+/*
+ * void
+ * rng_init(struct rng *r, int stream)
+ *	start `r' as stream number `stream' of the run's seed
+ */
+void
+rng_init(struct rng *r, int stream)
+{
+	unsigned long long x = rng_seed;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		r->r_s[i] = splitmix64(&x);
+	while (stream-- > 0)
+		rng_jump(r);
+}
+
+/*
+ * void
+ * rng_split(struct rng *r, struct rng *to)
+ *	start `to' where `r' is and move `r' on by a jump, so that taking
+ *	n streams in a row costs n jumps, not n * (n - 1) / 2
+ */
+void
+rng_split(struct rng *r, struct rng *to)
+{
+	*to = *r;
+	rng_jump(r);
+}
+
+/*
+ *	unsigned long long rng_next(struct rng *r) -- next 64 random bits
+ */
+unsigned long long
+rng_next(struct rng *r)
+{
+	unsigned long long *s = r->r_s;
+	unsigned long long v = rotl(s[1] * 5, 7) * 9;
+	unsigned long long t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return v;
+}
+
+/*
+ *	double rng_uniform(struct rng *r) -- uniform in (0, 1)
+ */
+double
+rng_uniform(struct rng *r)
+{
+	return ((rng_next(r) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
@@ -2,9 +2,10 @@
  *	sample source
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include "transport.h"
 
-#define	DATASIZE	1024
+#define	DATASIZE	(MTU - 8)	/* at most; see SEGSIZE */
 #define PKTTYPE_DATA	1
 
 struct pkt {
@@ -16,8 +17,8 @@ struct pkt {
 
 #define HEADERLEN	(sizeof(struct pkt) - DATASIZE)
 
-static int elapsed_time = 0;		/* elapsed time (ms) */
-					/* incremented in 10ms interval */
+static simtime_t elapsed_time = 0;	/* elapsed time (usec) */
+					/* updated every timer tick */
 
 /*
  * void
@@ -35,7 +36,8 @@ sender(int window, int timeout)
 #endif
 
 	packet.pkt_type = PKTTYPE_DATA;
-	while ((cnt = get_data(packet.pkt_data, DATASIZE)) != NET_EOF) {
+	while ((cnt = get_data(packet.pkt_data, udt_segsize(HEADERLEN)))
+	    != NET_EOF) {
 #ifdef DEBUG
 		packet.pkt_seqnum = txseq++;
 		packet.pkt_len = cnt;
@@ -58,10 +60,10 @@ sender(int window, int timeout)
 
 /*
  * void
- * receiver()
+ * receiver(int window)
  */
 void
-receiver()
+receiver(int window)
 {
 	int cnt;
 	static int rxseq = 0;
@@ -89,9 +91,21 @@ receiver()
 	}
 }
 
-/* called by timer per 10ms */
+/*
+ * void
+ * peer(int window, int timeout)
+ *	full duplex mode is not implemented in this sample
+ */
+void
+peer(int window, int timeout)
+{
+	fprintf(stderr, "peer: full duplex mode not supported\n");
+	exit(1);
+}
+
+/* called by timer every tick */
 void
 timer_handler()
 {
-	elapsed_time += 10;
+	elapsed_time = sim_time();
 }
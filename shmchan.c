@@ -0,0 +1,174 @@
+/*
+ *	shmchan.c
+ *
+ *	shared-memory packet channel -- replaces the socketpairs between
+ *	sender and receiver with one ring of packet slots per direction in
+ *	a region mapped before fork().  An eventfd wakes the reader, and
+ *	only when it has announced that it is going to sleep.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	SHM_SLOTS	256		/* slots per direction (power of 2) */
+
+/*
+ *	ring of packet slots -- single producer, single consumer
+ */
+struct shmring {
+	unsigned int sr_head;		/* next slot to read */
+	char sr_pad1[60];		/* keep head and tail apart */
+	unsigned int sr_tail;		/* next slot to write */
+	int sr_waiting;			/* reader sleeps on the eventfd */
+	char sr_pad2[56];
+};
+
+#define	SLOT(r, i)	((char *)((r) + 1) + \
+				((i) & (SHM_SLOTS - 1)) * shm_slotsize)
+
+static int shm_slotsize;	/* int size + packet */
+static struct shmring *shm_ring[2];	/* 0: sender -> receiver */
+static int shm_efd[2];		/* wakeup per ring */
+static __thread struct shmring *shm_tx, *shm_rx;	/* this end's rings */
+static __thread int shm_txfd, shm_rxfd;
+
+/*
+ * int
+ * shm_init(int pktsize)
+ *	map the rings; must be called before fork()
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+shm_init(int pktsize)
+{
+	size_t len;
+	char *p;
+	int i;
+
+	shm_slotsize = (sizeof(int) + pktsize + 63) & ~63;
+	len = sizeof(struct shmring) + SHM_SLOTS * shm_slotsize;
+	p = mmap(NULL, 2 * len, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("shm_init: mmap");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		shm_ring[i] = (struct shmring *)(p + i * len);
+		if ((shm_efd[i] = eventfd(0, EFD_NONBLOCK)) < 0) {
+			perror("shm_init: eventfd");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *	void shm_attach(int sender) -- pick the rings for this end
+ */
+void
+shm_attach(int sender)
+{
+	shm_tx = shm_ring[!sender];
+	shm_txfd = shm_efd[!sender];
+	shm_rx = shm_ring[sender];
+	shm_rxfd = shm_efd[sender];
+}
+
+/*
+ * int
+ * shm_send(void *buf, int size)
+ *	copy a packet into the next free slot; safe to call from the
+ *	SIGALRM handler
+ *
+ * return value:
+ *	0	success
+ *	-1	ring is full (errno ENOBUFS)
+ */
+int
+shm_send(void *buf, int size)
+{
+	unsigned int tail = shm_tx->sr_tail;
+	unsigned long long one = 1;
+	char *slot;
+
+	if (tail - __atomic_load_n(&shm_tx->sr_head, __ATOMIC_ACQUIRE)
+			== SHM_SLOTS) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	slot = SLOT(shm_tx, tail);
+	*(int *)slot = size;
+	memcpy(slot + sizeof(int), buf, size);
+	__atomic_store_n(&shm_tx->sr_tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	/* pairs with the store of sr_waiting in shm_peek() */
+	if (__atomic_load_n(&shm_tx->sr_waiting, __ATOMIC_SEQ_CST)) {
+		shm_tx->sr_waiting = 0;
+		write(shm_txfd, &one, sizeof(one));
+	}
+	return 0;
+}
+
+/*
+ * int
+ * shm_peek(void **pp)
+ *	look at the next packet in the ring without taking it out; the
+ *	packet stays in its slot until shm_consume()
+ *
+ * return value:
+ *	positive int:	packet size, *pp points to the packet
+ *	-1		ring is empty (errno EAGAIN); shm_fd() becomes
+ *			readable when a packet arrives
+ */
+int
+shm_peek(void **pp)
+{
+	unsigned int head = shm_rx->sr_head;
+	unsigned long long cnt;
+	char *slot;
+
+	if (head == __atomic_load_n(&shm_rx->sr_tail, __ATOMIC_ACQUIRE)) {
+		/* drain stale wakeups, then announce that we will sleep */
+		read(shm_rxfd, &cnt, sizeof(cnt));
+		__atomic_store_n(&shm_rx->sr_waiting, 1, __ATOMIC_SEQ_CST);
+		if (head == __atomic_load_n(&shm_rx->sr_tail,
+				__ATOMIC_SEQ_CST)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		shm_rx->sr_waiting = 0;
+	}
+	slot = SLOT(shm_rx, head);
+	*pp = slot + sizeof(int);
+	return *(int *)slot;
+}
+
+/*
+ *	void shm_consume() -- free the slot returned by shm_peek()
+ */
+void
+shm_consume(void)
+{
+	__atomic_store_n(&shm_rx->sr_head, shm_rx->sr_head + 1,
+		__ATOMIC_RELEASE);
+}
+
+/*
+ *	int shm_fd() -- descriptor to select() on for incoming packets
+ */
+int
+shm_fd(void)
+{
+	return shm_rxfd;
+}
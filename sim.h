@@ -0,0 +1,168 @@
+/*
+ *	sim.h	-- interfaces internal to the simulator harness
+ */
+
+/*
+ *	lower layer packet types (lp_type)
+ */
+#define	LP_USERDATA	0		/* user data */
+#define LP_EOF		1		/* no more user data */
+#define	LP_FECDATA	2		/* user data in an FEC block */
+#define	LP_FECPARITY	3		/* FEC parity */
+#define	LP_MPDATA	4		/* user data striped over paths */
+#define	LP_MPFEEDBACK	5		/* per-path arrival report */
+
+#define	LP_EXTRA	32		/* room for sublayer headers */
+
+/* main.c */
+int line_send(int, void *, int);	/* put packet on the line */
+int line_send_path(int, int, void *, int);	/* ... on one path */
+int line_room(int);			/* bytes the path's line takes */
+
+/* readahead.c */
+int ra_start(int, int);		/* start reader thread on fd */
+int ra_read(void *, int);	/* dequeue data, 0 on EOF */
+void ra_stop(void);		/* stop and join reader thread */
+void ra_stats(void);		/* print ring statistics */
+
+/* writebehind.c */
+int wb_start(int, int);		/* start write-behind on fd */
+void wb_write(void *, int);	/* queue delivered data */
+void wb_flush(void);		/* wait until all data is written */
+void wb_stop(void);		/* flush, stop and join writer thread */
+void wb_stats(void);		/* print write statistics */
+
+/* compress.c */
+int z_start(void);			/* buffers of this end */
+int z_read(void *, int, int (*)(void *, int));	/* fill a block */
+int z_write(void *, int, int (*)(void *, int));	/* unpack a block */
+void z_stats(int);			/* print ratio, CPU time */
+
+/* gso.c */
+int gso_start(void);			/* buffers of this end */
+int gso_read(void *, int, int (*)(void *, int));	/* a segment */
+int gso_write(void *, int, int (*)(void *, int));	/* coalesce */
+void gso_flush(int (*)(void *, int));	/* pass on what is held */
+int gso_held(void);			/* bytes held */
+void gso_stats(int);			/* print reads, writes */
+
+/* fec.c */
+#define	FEC_MAXK	64		/* max data packets per block */
+#define	FEC_MAXM	16		/* max parity packets per block */
+
+int fec_init(int, int, int, int);	/* k, m, xor, flush age */
+int fec_send(void *, int, simtime_t);	/* send data packet */
+void fec_poll(simtime_t);		/* close stale partial block */
+void fec_input(int, void *, int, simtime_t);	/* take packet from line */
+int fec_deliver(void *, int);		/* next in-order data packet */
+void fec_expire(simtime_t);		/* give up on idle blocks */
+void fec_stats(int);			/* print statistics */
+
+/* shmchan.c */
+int shm_init(int);		/* map rings, before fork() */
+void shm_attach(int);		/* select rings for sender/receiver */
+int shm_send(void *, int);	/* enqueue packet */
+int shm_peek(void **);		/* next packet, left in its slot */
+void shm_consume(void);		/* free the peeked slot */
+int shm_fd(void);		/* wakeup descriptor */
+
+/* queue.c */
+int q_init(char *, int, int, int, int, void (*)(void *));
+				/* spec, bw, delay, bdp, cross, drop */
+int q_enqueue(void *, int, simtime_t);	/* offer packet, -1: dropped */
+void *q_dequeue(simtime_t, simtime_t *);	/* next packet on the link */
+void q_stats(void);			/* print drops and delays */
+
+/* mpath.c */
+#define	MP_MAXPATH	8		/* max paths */
+
+int mp_init(char *);			/* scheduler */
+int mp_addpath(int, int);		/* bw, delay: path number */
+void mp_timing(int, int);		/* gap wait, feedback interval */
+int mp_send(void *, int, simtime_t);	/* stripe data packet */
+void mp_feedback(void *, int, simtime_t);	/* sender: take report */
+int mp_input(void *, int, simtime_t);	/* take packet from line */
+int mp_deliver(void *, int, simtime_t);	/* next in-order packet */
+int mp_pending(void);			/* packets held for reordering */
+void mp_stats(int, long long, simtime_t);	/* print statistics */
+
+/* rng.c */
+#define	RNG_LOSS	0		/* streams: + path, loss */
+#define	RNG_BER		MP_MAXPATH	/* bit errors */
+#define	RNG_RED		(MP_MAXPATH + 1)	/* RED drops */
+#define	RNG_NMODEL	(MP_MAXPATH + 2)
+#define	RNG_STREAM(end, model)	((end) * RNG_NMODEL + (model))
+					/* end: 1 data direction, 0 ACKs */
+
+struct rng {
+	unsigned long long r_s[4];	/* xoshiro256** state */
+};
+
+void rng_setseed(unsigned long long);	/* seed of the run */
+unsigned long long rng_getseed(void);
+void rng_init(struct rng *, int);	/* start a stream */
+void rng_split(struct rng *, struct rng *);	/* next stream */
+unsigned long long rng_next(struct rng *);	/* 64 random bits */
+double rng_uniform(struct rng *);	/* in (0, 1) */
+
+/* capture.c */
+#define	CAP_QUEUE	1		/* events: put on the line */
+#define	CAP_SEND	2		/* sent by the line */
+#define	CAP_LOSS	3		/* lost to the error rate */
+#define	CAP_QDROP	4		/* dropped by the bottleneck queue */
+#define	CAP_CORRUPT	5		/* sent with bit errors */
+#define	CAP_NEVENT	6
+#define	CAP_PORT	7000		/* UDP source port: CAP_PORT + event */
+
+int cap_open(char *, int);		/* file, sender end */
+void cap_packet(int, int, void *, int, simtime_t);
+				/* event, path, lower packet, size, time */
+void cap_close(void);			/* flush, print statistics */
+
+/* metrics.c */
+#define	MET_MAGIC	0x4d455452	/* "METR" */
+
+#define	MV_SIMTIME	(MET_NPROTO + 0)	/* simulated time (usec) */
+#define	MV_SENT		(MET_NPROTO + 1)	/* bytes from get_data() */
+#define	MV_DELIVERED	(MET_NPROTO + 2)	/* bytes to deliver_data() */
+#define	MV_PKTS		(MET_NPROTO + 3)	/* packets put on the line */
+#define	MV_LBUF		(MET_NPROTO + 4)	/* bytes in the line buffers */
+#define	MV_STATE	(MET_NPROTO + 5)	/* MET_RUN, MET_DONE */
+#define	MV_NVAL		(MET_NPROTO + 6)
+
+#define	MET_RUN		1
+#define	MET_DONE	2
+
+struct met_page {
+	unsigned int mp_magic;		/* MET_MAGIC once set up */
+	int mp_pid;			/* the simulator */
+	long long mp_val[2][MV_NVAL];	/* receiver end, sender end */
+};
+
+int met_init(char *);			/* create and map, before fork() */
+void met_set(int, int, long long);	/* end, counter, value */
+int met_on(void);			/* metrics are published */
+
+/* crc32c.c */
+unsigned int crc32c_sw(unsigned int, const void *, int);
+				/* crc32c(), portable version */
+char *crc32c_impl(void);		/* version crc32c() uses */
+
+/* perfctr.c */
+#define	PC_CYCLES	0		/* counters */
+#define	PC_INSTR	1
+#define	PC_CMISS	2		/* cache misses */
+#define	PC_CTXSW	3		/* context switches */
+#define	PC_SYSCALL	4		/* system calls */
+#define	PC_NEVENT	5
+
+void pc_start(void);			/* start counting this end */
+void pc_stop(char *, int, long long);	/* file, sender, bytes */
+void pc_exit(int);			/* helper thread of an end ends */
+char *pc_name(int);			/* counter name in the file */
+
+/* batch.c */
+int batch_init(char *);			/* list of objects, count */
+int batch_read(void *, int, simtime_t);	/* object stream, 0 at end */
+void batch_write(void *, int, simtime_t);	/* split delivered stream */
+void batch_stats(int);			/* print latency, throughput */
@@ -0,0 +1,115 @@
+/*
+ *	simstat.c
+ *
+ *	show the live metrics of a run started with -M file, once per
+ *	interval, until both ends are done:
+ *
+ *		simstat file [interval_ms]
+ *
+ *	The run can be started before or after simstat.  Rates are over
+ *	simulated time since the previous line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "transport.h"
+#include "sim.h"
+
+#define	HEADER_EVERY	20		/* lines between headers */
+
+static long long
+val(struct met_page *mp, int end, int id)
+{
+	return __atomic_load_n(&mp->mp_val[end][id], __ATOMIC_RELAXED);
+}
+
+/*
+ *	Mbps over simulated time: bits per usec
+ */
+static double
+rate(long long bytes, long long usec)
+{
+	return usec > 0 ? bytes * 8.0 / usec : 0.0;
+}
+
+static void
+header(void)
+{
+	printf("%6s %9s | %8s %7s %5s %7s %7s %6s %5s | %8s %7s %5s %7s\n",
+		"real", "sim time", "sent MB", "Mbps", "win", "base",
+		"lbuf KB", "retx", "tmo", "deliv MB", "Mbps", "rwnd", "next");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct met_page *mp = MAP_FAILED;
+	long long t, sent, deliv, last_t = 0, last_sent = 0, last_deliv = 0;
+	int interval = 1000;		/* msec */
+	int fd, lines = 0;
+	double real = 0;
+
+	if (argc < 2 || argc > 3 ||
+	    (argc == 3 && (interval = atoi(argv[2])) <= 0)) {
+		fprintf(stderr, "usage: %s file [interval_ms]\n", argv[0]);
+		exit(1);
+	}
+
+	/* wait for the run to set the file up */
+	for (;;) {
+		if ((fd = open(argv[1], O_RDONLY)) >= 0) {
+			mp = mmap(NULL, sizeof(*mp), PROT_READ, MAP_SHARED, fd,
+				0);
+			close(fd);
+		}
+		if (mp != MAP_FAILED &&
+		    __atomic_load_n(&mp->mp_magic, __ATOMIC_ACQUIRE) ==
+				MET_MAGIC)
+			break;
+		if (fd < 0 && errno != ENOENT) {
+			perror(argv[1]);
+			exit(1);
+		}
+		if (mp != MAP_FAILED)
+			munmap(mp, sizeof(*mp));
+		mp = MAP_FAILED;
+		usleep(interval * 1000);
+	}
+
+	for (;;) {
+		t = val(mp, 1, MV_SIMTIME);
+		sent = val(mp, 1, MV_SENT);
+		deliv = val(mp, 0, MV_DELIVERED);
+		if (lines++ % HEADER_EVERY == 0)
+			header();
+		printf("%6.1f %9.3f | %8.2f %7.2f %5lld %7lld %7.1f %6lld "
+			"%5lld | %8.2f %7.2f %5lld %7lld\n", real, t / 1e6,
+			sent / 1e6, rate(sent - last_sent, t - last_t),
+			val(mp, 1, MET_WINDOW), val(mp, 1, MET_BASE),
+			val(mp, 1, MV_LBUF) / 1024.0, val(mp, 1, MET_RETRANS),
+			val(mp, 1, MET_TIMEOUTS), deliv / 1e6,
+			rate(deliv - last_deliv, t - last_t),
+			val(mp, 0, MET_WINDOW), val(mp, 0, MET_BASE));
+		fflush(stdout);
+		last_t = t;
+		last_sent = sent;
+		last_deliv = deliv;
+
+		if (val(mp, 0, MV_STATE) == MET_DONE &&
+		    val(mp, 1, MV_STATE) == MET_DONE)
+			break;
+		if (kill(mp->mp_pid, 0) < 0 && errno == ESRCH) {
+			fprintf(stderr, "simstat: run %d is gone\n",
+				mp->mp_pid);
+			exit(1);
+		}
+		usleep(interval * 1000);
+		real += interval / 1000.0;
+	}
+	return 0;
+}
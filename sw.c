@@ -9,7 +9,7 @@
 #include <assert.h>
 #include "transport.h"
 
-#define	DATASIZE	1024
+#define	DATASIZE	(MTU - 3 * sizeof(int))	/* at most; see SEGSIZE */
 #define HEADERSIZE  (sizeof(Packet) - DATASIZE)
 #define ACKSIZE     sizeof("ACK")
 
@@ -19,17 +19,20 @@ int deliver_data(void*, int);
 int udt_recv(void*,int,int);
 
 /* A packet. The header is made of
+   - CRC-32C of the rest of the packet
    - sequence number
    - size of buffer (filled with valid data)
    This is followed by the data. */
 typedef struct {
+	 unsigned int crc;
 	 int seqn;
 	 int nbuffer;
 	 char buffer[DATASIZE];
 } Packet;
 
-/* ACK packet. Contains the sequence number and a tiny header. */
+/* ACK packet. Contains a CRC, the sequence number and a tiny header. */
 typedef struct {
+	 unsigned int crc;
 	 char code[ACKSIZE];
 	 int  seqn;
 } ACKPacket;
@@ -38,11 +41,14 @@ typedef struct {
    It contains
    - state, indicating what to do next.
    - Number of packets sent so far (ie. sequence number)
-   - A packet, used as the sending buffer */
+   - A packet, used as the sending buffer. It is a transport send buffer
+	 (udt_send_acquire), taken for each new packet and given back once
+	 the packet is acknowledged. */
 typedef struct {
 	 int  state;
 	 int  nsent;
-	 Packet packet;
+	 Packet* packet;
+	 int  nretx, ntimeout;	/* for sim_metric() */
 } Session_sender;
 
 #define SEND_GETDATA    1
@@ -54,9 +60,12 @@ typedef struct {
    Assumes that the data in the session buffer has already been obtained
    from the upper layer. */
 void sender_send_packet(Session_sender* session) {
-	 session->packet.seqn = session->nsent;
+	 session->packet->seqn = session->nsent;
+	 session->packet->crc = udt_crc(session->packet,
+									   HEADERSIZE + session->packet->nbuffer);
 
-	 switch (udt_send(&session->packet, HEADERSIZE + session->packet.nbuffer)) {
+	 switch (udt_send_commit(session->packet,
+							 HEADERSIZE + session->packet->nbuffer)) {
 	 case NET_SUCCESS:
 		  session->state = SEND_WAITACK;
 		  break;
@@ -72,16 +81,22 @@ void sender_send_packet(Session_sender* session) {
 	 }	 
 }
 
-/* Obtains data from the upper layer. */
+/* Obtains data from the upper layer, straight into a new send buffer. */
 void sender_getdata(Session_sender* session) {
-	 int count = get_data(&session->packet.buffer, DATASIZE);
+	 int count;
+
+	 session->packet = udt_send_acquire(sizeof(Packet));
+	 assert (session->packet != NULL);
+	 count = get_data(session->packet->buffer,
+					  udt_segsize(HEADERSIZE));
 	 
 	 if (count != NET_EOF) {
 		  session->state = SEND_SENDPACKET;
-		  session->packet.nbuffer = count;
+		  session->packet->nbuffer = count;
 	 } else {
 		  session->state = SEND_COMPLETE;
-		  session->packet.nbuffer = 0;
+		  udt_send_release(session->packet);
+		  session->packet = NULL;
 	 }
 }
 
@@ -98,24 +113,31 @@ void sender_waitack(Session_sender* session, int timeout) {
 		  exit(1);
 	 } else if (ret == 0) { /* ACK timeout: resend the packet */
 		  session->state = SEND_SENDPACKET;
+		  sim_metric(MET_TIMEOUTS, ++session->ntimeout);
+		  sim_metric(MET_RETRANS, ++session->nretx);
+	 } else if (!udt_crc_ok(&ack, ret)) {
+		  /* damaged ACK: as if lost, keep waiting */
 	 } else {
 	   	  assert (ret == sizeof(ACKPacket));
-		  assert (ack.seqn <= session->packet.seqn);
+		  assert (ack.seqn <= session->packet->seqn);
 		  
-		  if (ack.seqn == session->packet.seqn) {
+		  if (ack.seqn == session->packet->seqn) {
 			   session->state = SEND_GETDATA;
-			   session->packet.nbuffer = 0;
+			   udt_send_release(session->packet);
+			   session->packet = NULL;
 			   session->nsent += 1;
+			   sim_metric(MET_BASE, session->nsent);
 		  } else {
 			   session->state = SEND_SENDPACKET;
+			   sim_metric(MET_RETRANS, ++session->nretx);
 		  }
 	 }
 }
 
 /* Main sender function. Window size is unused. */
 void sender(int window, int timeout) {
-	 Session_sender session = {SEND_GETDATA, 0};
-	 session.packet.seqn = 0;
+	 Session_sender session = {SEND_GETDATA, 0, NULL, 0, 0};
+	 sim_metric(MET_WINDOW, 1);
 	 while (session.state != SEND_COMPLETE) {
 		  switch (session.state) {
 		  case SEND_GETDATA:
@@ -132,13 +154,15 @@ void sender(int window, int timeout) {
 			   exit(1);
 		  }
 	 }
+	 fprintf(stderr, "Sender: %d corrupted ACKs\n", udt_crc_errors());
 }
 
 /* Sends an ACK signal back to the sender. */
 void receiver_acknowledge(int seqn) {
 	 int ret;
-	 ACKPacket ack = {"ACK", 0};
+	 ACKPacket ack = {0, "ACK", 0};
 	 ack.seqn = seqn;
+	 ack.crc = udt_crc(&ack, sizeof(ACKPacket));
 	 ret = udt_send(&ack, sizeof(ACKPacket));
 	 if (ret != NET_SUCCESS) {
 		  switch (ret) {
@@ -155,38 +179,52 @@ void receiver_acknowledge(int seqn) {
 	 }
 }
 
-/* Main receiver function. */
-void receiver()
+/* Main receiver function. Window size is unused. */
+void receiver(int window)
 {
 	 int ret = 0, rxseq = 0;
-	 Packet packet;
+	 Packet* packet;
 
-	 /* Try to receive a packet, check for network errors */
+	 /* Try to receive a packet, check for network errors. The packet is
+		read where the transport received it, not copied out. */
 	 while (1) { 
-		  ret = udt_recv(&packet, sizeof(packet), -1);
+		  ret = udt_recv_borrow((void**)&packet, -1);
 		  if (ret == NET_EOF)
 			   break;
 		  else if (ret == NET_SYSERR) {
 			   fprintf(stderr, "Receiver: NET_SYSERR\n");
 			   exit(1);
 		  }
+		  if (!udt_crc_ok(packet, ret)) {
+			   udt_recv_release();	/* damaged: as if lost */
+			   continue;
+		  }
 		  
 		  /* At this point we have a valid packet. Check the sequence number. */
-		  assert (ret == sizeof(packet));
-		  receiver_acknowledge(packet.seqn);
-		  if (packet.seqn > rxseq)
+		  assert (ret == HEADERSIZE + packet->nbuffer);
+		  receiver_acknowledge(packet->seqn);
+		  if (packet->seqn > rxseq)
 			   printf("Receiver: Error: did not receive #%d\n", rxseq);
-		  else if (packet.seqn < rxseq)
-			   printf("Receiver: Received packet #%d again\n", packet.seqn);
+		  else if (packet->seqn < rxseq)
+			   printf("Receiver: Received packet #%d again\n", packet->seqn);
 		  else {
-			   printf("Receiver: Received packet #%d\n", packet.seqn);
+			   printf("Receiver: Received packet #%d\n", packet->seqn);
 			   rxseq++;
-			   deliver_data(packet.buffer, packet.nbuffer);
+			   sim_metric(MET_BASE, rxseq);
+			   deliver_data(packet->buffer, packet->nbuffer);
 		  }
+		  udt_recv_release();
 	 }
+	 fprintf(stderr, "Receiver: %d corrupted packets\n", udt_crc_errors());
+}
+
+/* Full duplex mode is not implemented for stop-and-wait. */
+void peer(int window, int timeout) {
+	 fprintf(stderr, "peer: full duplex mode not supported\n");
+	 exit(1);
 }
 
-/* called by timer per 10ms */
+/* called by timer every tick */
 void timer_handler() {
 	 /* NOP */;
 }
@@ -10,12 +10,55 @@
 #define	NET_TOOBIG	-2	/* message is too big */
 #define	NET_SYSERR	-3	/* system call error */
 
+/*
+ *	a packet is at most MTU bytes, so a protocol sizes the data field
+ *	of its packets as MTU less its header.  How much of it a packet
+ *	carries is udt_segsize(): SEGSIZE bytes, or what -g sets up to the
+ *	whole field.
+ */
 #define	MTU		1500	/* max transmission unit */
+#define	SEGSIZE		1024	/* default data per packet (-g) */
+#define	GSO_SIZE	(64*1024)	/* data per read or write with -G */
 #define	WINDOWSIZE	32	/* window size */
 
-#define TIMER_TICK	10	/* 10 msec */
+#define TIMER_TICK	10000	/* default timer_handler() period (usec) */
+
+typedef long long simtime_t;	/* simulated time (usec) */
 
 int udt_send(void *, int);	/* send function */
-int udt_recv(void *, int, int);	/* receive function */
+int udt_recv(void *, int, int);	/* receive function, timeout in usec */
+simtime_t sim_time(void);	/* current simulated time */
+int deliver_ready(void);	/* bytes deliver_data() takes at once */
+int udt_segsize(int);		/* data per packet, for a header size */
+int udt_gso(void);		/* GSO_SIZE with -G, else 0 */
+unsigned int crc32c(unsigned int, const void *, int);
+				/* CRC-32C checksum, continue from crc */
+unsigned int udt_crc(void *, int);	/* crc field of a packet */
+int udt_crc_ok(void *, int);	/* crc field matches, else counted */
+int udt_crc_errors(void);	/* damaged packets of this end */
+
+/*
+ *	zero-copy variants -- the protocol builds its packet in a buffer
+ *	owned by the transport and hands it over, instead of having
+ *	udt_send()/udt_recv() copy it
+ */
+void *udt_send_acquire(int);	/* get a send buffer (NULL: too big) */
+int udt_send_commit(void *, int);	/* send it, may be committed again */
+void udt_send_release(void *);	/* give the send buffer back */
+int udt_recv_borrow(void **, int);	/* view of the next packet */
+void udt_recv_release(void);	/* done with the view */
+
+/*
+ *	live metrics (-M) -- counters of the protocol shown by simstat
+ */
+#define	MET_WINDOW	0	/* current window (packets) */
+#define	MET_BASE	1	/* oldest unacknowledged / next expected seqn */
+#define	MET_RETRANS	2	/* packets retransmitted */
+#define	MET_TIMEOUTS	3	/* retransmission timeouts */
+#define	MET_NPROTO	4
+
+void sim_metric(int, long long);	/* publish a protocol counter */
 
 void sender(int, int);		/* sender function written by student */
+void receiver(int);		/* receiver function, receive window size */
+void peer(int, int);		/* both ends in full duplex mode (-d) */
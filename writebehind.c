@@ -0,0 +1,454 @@
+/*
+ *	writebehind.c
+ *
+ *	write-behind for deliver_data() -- delivered data is batched and
+ *	written asynchronously so a slow disk does not hold up the
+ *	receiver loop (and with it the ACKs).  Uses io_uring on seekable
+ *	files and falls back to a writer thread otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+#include "transport.h"
+#include "sim.h"
+
+#define	WB_BATCH	(64*1024)	/* max size of one write */
+
+/*
+ *	write buffer -- one per batch in flight
+ */
+struct wbbuf {
+	struct wbbuf *wb_next;		/* writer thread queue */
+	int wb_len;			/* buffered data size */
+	off_t wb_off;			/* file offset, -1: not seekable */
+	char *wb_data;			/* WB_BATCH bytes */
+};
+
+static struct wbbuf *wb_bufs;	/* all buffers */
+static struct wbbuf **wb_free;	/* stack of idle buffers */
+static int wb_nfree;		/* protected by wb_lock */
+static int wb_nbuf;		/* in-flight budget in buffers */
+static struct wbbuf *wb_cur;	/* batch being filled */
+static int wb_fd;
+static off_t wb_off;		/* next file offset, -1: not seekable */
+
+static long long wb_nwrite;	/* writes submitted */
+static long long wb_nwait;	/* times the budget was exhausted */
+static long long wb_bytes;
+
+static int wb_uring = -1;	/* io_uring fd, -1: use writer thread */
+
+static struct wbbuf *wb_get(void);
+static void wb_wait(void);
+static void wb_submit(struct wbbuf *);
+static void wb_done(struct wbbuf *, int);
+static int wb_pwrite(struct wbbuf *, int);
+
+/*
+ *	writer thread fallback
+ */
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wb_written = PTHREAD_COND_INITIALIZER;
+static struct wbbuf *wb_qhead, *wb_qtail;
+static int wb_quit;		/* wb_stop() was called */
+
+static void *wb_writer(void *);
+
+#ifdef __NR_io_uring_setup
+/*
+ *	io_uring submission/completion rings
+ */
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+
+static int
+uring_init(int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	size_t sqlen, cqlen;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_RW_CUR_POS))
+		goto fail;		/* pre-5.6 kernel: no IORING_OP_WRITE */
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqlen > sqlen)
+			sqlen = cqlen;
+		cqlen = sqlen;
+	}
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else if ((cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING))
+			== MAP_FAILED)
+		goto fail;
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail;
+
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+static void
+uring_submit(struct wbbuf *wb)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *sq_tail;
+	idx = tail & *sq_mask;
+	sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = wb_fd;
+	sqe->addr = (unsigned long)wb->wb_data;
+	sqe->len = wb->wb_len;
+	sqe->off = wb->wb_off;
+	sqe->user_data = (unsigned long)wb;
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while (syscall(__NR_io_uring_enter, wb_uring, 1, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR) {
+			perror("uring_submit: io_uring_enter");
+			exit(1);
+		}
+	}
+}
+
+/*
+ *	collect completions; wait for at least one if `wait'
+ */
+static void
+uring_reap(int wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	for (;;) {
+		head = *cq_head;
+		if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if (!wait)
+			return;
+		if (syscall(__NR_io_uring_enter, wb_uring, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR) {
+			perror("uring_reap: io_uring_enter");
+			exit(1);
+		}
+	}
+	do {
+		cqe = &cqes[head & *cq_mask];
+		wb_done((struct wbbuf *)(unsigned long)cqe->user_data,
+			cqe->res);
+		head++;
+	} while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+#endif /* __NR_io_uring_setup */
+
+/*
+ * int
+ * wb_start(int fd, int budget)
+ *	set up write-behind on `fd' with at most `budget' KB in flight
+ *
+ * return value:
+ *	0	success
+ *	-1	error
+ */
+int
+wb_start(int fd, int budget)
+{
+	sigset_t sigs, osigs;
+	int i, err;
+
+	wb_fd = fd;
+	wb_nbuf = budget * 1024 / WB_BATCH;
+	if (wb_nbuf < 2)
+		wb_nbuf = 2;
+	wb_bufs = calloc(wb_nbuf, sizeof(struct wbbuf));
+	wb_free = calloc(wb_nbuf, sizeof(struct wbbuf *));
+	if (wb_bufs == NULL || wb_free == NULL) {
+		perror("wb_start: malloc");
+		return -1;
+	}
+	for (i = 0; i < wb_nbuf; i++) {
+		if ((wb_bufs[i].wb_data = malloc(WB_BATCH)) == NULL) {
+			perror("wb_start: malloc");
+			return -1;
+		}
+		wb_free[wb_nfree++] = &wb_bufs[i];
+	}
+	wb_off = lseek(fd, 0, SEEK_CUR);	/* -1 on pipes */
+
+#ifdef __NR_io_uring_setup
+	if (wb_off >= 0)
+		wb_uring = uring_init(wb_nbuf);
+#endif
+	if (wb_uring >= 0)
+		return 0;
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+	err = pthread_create(&wb_thread, NULL, wb_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+	if (err) {
+		fprintf(stderr, "wb_start: pthread_create: %s\n",
+			strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	void wb_write(void *buf, int size) -- append delivered data
+ */
+void
+wb_write(void *buf, int size)
+{
+	int n;
+
+	while (size > 0) {
+		if (wb_cur == NULL) {
+			wb_cur = wb_get();
+			wb_cur->wb_len = 0;
+		}
+		n = WB_BATCH - wb_cur->wb_len;
+		if (n > size)
+			n = size;
+		memcpy(wb_cur->wb_data + wb_cur->wb_len, buf, n);
+		wb_cur->wb_len += n;
+		buf = (char *)buf + n;
+		size -= n;
+		if (wb_cur->wb_len == WB_BATCH) {
+			wb_submit(wb_cur);
+			wb_cur = NULL;
+		}
+	}
+#ifdef __NR_io_uring_setup
+	if (wb_uring >= 0)
+		uring_reap(0);
+#endif
+}
+
+/*
+ *	void wb_flush() -- write out everything; must be called before the
+ *	file is closed
+ */
+void
+wb_flush(void)
+{
+	if (wb_cur) {
+		wb_submit(wb_cur);
+		wb_cur = NULL;
+	}
+	pthread_mutex_lock(&wb_lock);
+	while (wb_nfree < wb_nbuf)
+		wb_wait();
+	pthread_mutex_unlock(&wb_lock);
+}
+
+/*
+ *	void wb_stop(void) -- write out everything and stop the writer thread
+ */
+void
+wb_stop(void)
+{
+	wb_flush();
+	if (wb_uring >= 0)
+		return;
+	pthread_mutex_lock(&wb_lock);
+	wb_quit = 1;
+	pthread_cond_signal(&wb_queued);
+	pthread_mutex_unlock(&wb_lock);
+	pthread_join(wb_thread, NULL);
+}
+
+/*
+ *	print write-behind statistics
+ */
+void
+wb_stats(void)
+{
+	fprintf(stderr, "write-behind\t: %s, %d x %d KB in flight, "
+		"%lld writes (%lld bytes), budget exhausted %lld times\n",
+		wb_uring >= 0 ? "io_uring" : "writer thread",
+		wb_nbuf, WB_BATCH/1024, wb_nwrite, wb_bytes, wb_nwait);
+}
+
+/*
+ *	take an idle buffer, waiting for a write to complete if the
+ *	in-flight budget is used up
+ */
+static struct wbbuf *
+wb_get(void)
+{
+	struct wbbuf *wb;
+
+	pthread_mutex_lock(&wb_lock);
+	if (wb_nfree == 0)
+		wb_nwait++;
+	while (wb_nfree == 0)
+		wb_wait();
+	wb = wb_free[--wb_nfree];
+	pthread_mutex_unlock(&wb_lock);
+	return wb;
+}
+
+/*
+ *	wait for some write to complete -- called with wb_lock held
+ */
+static void
+wb_wait(void)
+{
+#ifdef __NR_io_uring_setup
+	if (wb_uring >= 0) {
+		pthread_mutex_unlock(&wb_lock);
+		uring_reap(1);
+		pthread_mutex_lock(&wb_lock);
+		return;
+	}
+#endif
+	pthread_cond_wait(&wb_written, &wb_lock);
+}
+
+static void
+wb_submit(struct wbbuf *wb)
+{
+	wb->wb_off = wb_off;
+	if (wb_off >= 0)
+		wb_off += wb->wb_len;
+	wb_nwrite++;
+	wb_bytes += wb->wb_len;
+
+#ifdef __NR_io_uring_setup
+	if (wb_uring >= 0) {
+		uring_submit(wb);
+		return;
+	}
+#endif
+	pthread_mutex_lock(&wb_lock);
+	wb->wb_next = NULL;
+	if (wb_qtail)
+		wb_qtail->wb_next = wb;
+	else
+		wb_qhead = wb;
+	wb_qtail = wb;
+	pthread_cond_signal(&wb_queued);
+	pthread_mutex_unlock(&wb_lock);
+}
+
+/*
+ *	a write finished with result `res' -- finish a short write
+ *	synchronously and recycle the buffer
+ */
+static void
+wb_done(struct wbbuf *wb, int res)
+{
+	if (res >= 0 && res < wb->wb_len)
+		res = wb_pwrite(wb, res);	/* short write: the rest */
+	if (res < 0) {
+		errno = -res;
+		perror("deliver_data: write");
+		exit(1);
+	}
+
+	pthread_mutex_lock(&wb_lock);
+	wb_free[wb_nfree++] = wb;
+	pthread_cond_signal(&wb_written);
+	pthread_mutex_unlock(&wb_lock);
+}
+
+/*
+ *	write buffer contents from offset `done' on
+ *
+ * return value:
+ *	number of bytes in buffer (i.e. all of them), or -errno
+ */
+static int
+wb_pwrite(struct wbbuf *wb, int done)
+{
+	int n;
+
+	while (done < wb->wb_len) {
+		if (wb->wb_off >= 0)
+			n = pwrite(wb_fd, wb->wb_data + done,
+				wb->wb_len - done, wb->wb_off + done);
+		else
+			n = write(wb_fd, wb->wb_data + done,
+				wb->wb_len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/*
+ *	writer thread -- fallback when io_uring is not available
+ */
+static void *
+wb_writer(void *arg)
+{
+	struct wbbuf *wb;
+
+	for (;;) {
+		pthread_mutex_lock(&wb_lock);
+		while (wb_qhead == NULL && !wb_quit)
+			pthread_cond_wait(&wb_queued, &wb_lock);
+		if (wb_qhead == NULL) {
+			pthread_mutex_unlock(&wb_lock);
+			break;
+		}
+		wb = wb_qhead;
+		if ((wb_qhead = wb->wb_next) == NULL)
+			wb_qtail = NULL;
+		pthread_mutex_unlock(&wb_lock);
+
+		wb_done(wb, wb_pwrite(wb, 0));
+	}
+	pc_exit(0);		/* its share of the receiver's counts */
+	return NULL;
+}